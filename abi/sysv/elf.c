@@ -114,25 +114,18 @@ elf_result_t elf_load(elf_file_t *elf_file, vm_address_space_t *as) {
                 uintptr_t aligned_vaddr = MATH_FLOOR(phdr->vaddr, ARCH_PAGE_GRANULARITY);
                 size_t length = MATH_CEIL(phdr->memsz + (phdr->vaddr - aligned_vaddr), ARCH_PAGE_GRANULARITY);
 
-                void *ptr = vm_map_anon(as, (void *) aligned_vaddr, length, prot, VM_CACHE_STANDARD, VM_FLAG_FIXED | VM_FLAG_ZERO | VM_FLAG_DYNAMICALLY_BACKED);
-                ASSERT(ptr != nullptr);
-                if(phdr->filesz > 0) {
-                    size_t buffer_size = MATH_CEIL(phdr->filesz, ARCH_PAGE_GRANULARITY);
-                    void *buffer = vm_map_anon(g_vm_global_address_space, nullptr, buffer_size, VM_PROT_RW, VM_CACHE_STANDARD, VM_FLAG_NONE);
-                    ASSERT(buffer != nullptr);
-
-                    size_t read_count;
-                    vfs_result_t res = elf_file->file->ops->rw(elf_file->file, &(vfs_rw_t) { .rw = VFS_RW_READ, .size = phdr->filesz, .offset = phdr->offset, .buffer = buffer }, &read_count);
-                    if(res != VFS_RESULT_OK || read_count != phdr->filesz) {
-                        vm_unmap(g_vm_global_address_space, buffer, buffer_size);
-                        return ELF_RESULT_ERR_FS;
-                    }
-
-                    size_t count = vm_copy_to(as, phdr->vaddr, buffer, phdr->filesz);
-                    ASSERT(count == phdr->filesz);
-
-                    vm_unmap(g_vm_global_address_space, buffer, buffer_size);
+                if(phdr->filesz == 0) {
+                    void *ptr = vm_map_anon(as, (void *) aligned_vaddr, length, prot, VM_CACHE_STANDARD, VM_FLAG_FIXED | VM_FLAG_ZERO | VM_FLAG_DYNAMICALLY_BACKED);
+                    ASSERT(ptr != nullptr);
+                    break;
                 }
+
+                // Loadable segments are congruent to their file offset modulo the page size
+                size_t lead = phdr->vaddr - aligned_vaddr;
+                if(phdr->offset < lead || (phdr->offset - lead) % ARCH_PAGE_GRANULARITY != 0) return ELF_RESULT_ERR_MALFORMED;
+
+                void *ptr = vm_map_file(as, (void *) aligned_vaddr, length, prot, VM_CACHE_STANDARD, elf_file->file, phdr->offset - lead, phdr->filesz + lead, VM_FLAG_FIXED | VM_FLAG_DYNAMICALLY_BACKED);
+                ASSERT(ptr != nullptr);
                 break;
             case ELF64_PT_NULL:   break;
             case ELF64_PT_INTERP: break;
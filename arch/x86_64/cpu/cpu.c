@@ -1,9 +1,17 @@
+#include "x86_64/cpu/cpu.h"
+
 #include "sys/init.h"
+#include "x86_64/cpu/cpuid.h"
 #include "x86_64/cpu/cr.h"
 #include "x86_64/cpu/msr.h"
 
 #include <stdint.h>
 
+bool g_x86_64_cpu_smap_support = false;
+bool g_x86_64_cpu_pdpe1gb_support = false;
+bool g_x86_64_cpu_pcid_support = false;
+bool g_x86_64_cpu_invpcid_support = false;
+
 /// Initialize the Page Attribute Table (PAT) for the current CPU.
 /// The PAT is configured in cronus as following:
 ///  - PA0: WB  (Write Back)
@@ -22,7 +30,20 @@ INIT_TARGET(cpu_pat, INIT_STAGE_EARLY, INIT_SCOPE_ALL, INIT_DEPS()) {
 }
 
 INIT_TARGET(cpu, INIT_STAGE_EARLY, INIT_SCOPE_ALL, INIT_DEPS()) {
+    x86_64_cr0_write(x86_64_cr0_read() | (1 << 16)); /* CR0.WP */
+
     uint64_t cr4 = x86_64_cr4_read();
     cr4 |= 1 << 7; /* CR4.PGE */
+    if(x86_64_cpuid_feature(X86_64_CPUID_FEATURE_SMAP)) {
+        cr4 |= 1 << 21; /* CR4.SMAP */
+        g_x86_64_cpu_smap_support = true;
+    }
+    if(x86_64_cpuid_feature(X86_64_CPUID_FEATURE_PCID)) {
+        cr4 |= 1 << 17; /* CR4.PCIDE, the loaded address space still uses PCID 0 */
+        g_x86_64_cpu_pcid_support = true;
+        g_x86_64_cpu_invpcid_support = x86_64_cpuid_feature(X86_64_CPUID_FEATURE_INVPCID);
+    }
     x86_64_cr4_write(cr4);
+
+    g_x86_64_cpu_pdpe1gb_support = x86_64_cpuid_feature(X86_64_CPUID_FEATURE_PDPE1GB);
 }
@@ -9,6 +9,9 @@
 #include "x86_64/debug.h"
 #include "x86_64/interrupt.h"
 
+extern x86_64_exception_fixup_t ld_extable_start[];
+extern x86_64_exception_fixup_t ld_extable_end[];
+
 static char *g_exception_messages[] = {
     "Division by Zero",    "Debug",       "Non-Maskable Interrupt",   "Breakpoint", "Overflow",          "Out of Bounds",     "Invalid Opcode",  "No Coprocessor", "Double Fault", "Coprocessor Segment Overrun", "Bad TSS",
     "Segment not Present", "Stack Fault", "General Protection Fault", "Page Fault", "Unknown Interrupt", "Coprocessor Fault", "Alignment Check",
@@ -58,6 +61,13 @@ static const char *get_message(uint8_t int_no) {
     ASSERT_UNREACHABLE();
 }
 
+uintptr_t x86_64_exception_fixup(uintptr_t rip) {
+    for(x86_64_exception_fixup_t *fixup = ld_extable_start; fixup < ld_extable_end; fixup++) {
+        if(fixup->fault_address == rip) return fixup->fixup_address;
+    }
+    return 0;
+}
+
 INIT_TARGET(exceptions, INIT_STAGE_EARLY, INIT_SCOPE_BSP, INIT_DEPS()) {
     for(int i = 0; i < 32; i++) { x86_64_interrupt_set(i, x86_64_exception_unhandled); }
 }
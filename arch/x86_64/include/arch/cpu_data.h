@@ -7,6 +7,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define X86_64_PCID_SLOT_COUNT 8 /* Slot N uses PCID N + 1 */
+
 typedef struct arch_cpu_data {
     uint32_t lapic_id;
 
@@ -16,4 +18,10 @@ typedef struct arch_cpu_data {
     x86_64_tss_t *tss;
 
     x86_64_thread_t *current_thread; // TODO: move (when we fix the thread pattern)
+
+    struct {
+        uint64_t owner; /* Id of the address space using the PCID, 0 if unused */
+        uint64_t generation; /* TLB generation of the owner the PCID is up to date with */
+    } pcid_slots[X86_64_PCID_SLOT_COUNT];
+    size_t pcid_victim; /* Slot taken next when no slot belongs to the address space */
 } arch_cpu_data_t;
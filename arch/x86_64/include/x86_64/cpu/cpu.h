@@ -0,0 +1,13 @@
+#pragma once
+
+/// Supervisor Mode Access Prevention is enabled.
+extern bool g_x86_64_cpu_smap_support;
+
+/// 1 GiB pages are supported.
+extern bool g_x86_64_cpu_pdpe1gb_support;
+
+/// Process Context Identifiers are enabled.
+extern bool g_x86_64_cpu_pcid_support;
+
+/// The INVPCID instruction is available.
+extern bool g_x86_64_cpu_invpcid_support;
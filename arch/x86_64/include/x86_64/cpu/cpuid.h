@@ -67,6 +67,9 @@
 #define X86_64_CPUID_FEATURE_PBE X86_64_CPUID_DEFINE_FEATURE(1, X86_64_CPUID_REGISTER_EDX, 31)
 #define X86_64_CPUID_FEATURE_ARAT X86_64_CPUID_DEFINE_FEATURE(6, X86_64_CPUID_REGISTER_EAX, 2)
 #define X86_64_CPUID_FEATURE_AVX512 X86_64_CPUID_DEFINE_FEATURE(7, X86_64_CPUID_REGISTER_EBX, 16)
+#define X86_64_CPUID_FEATURE_INVPCID X86_64_CPUID_DEFINE_FEATURE(7, X86_64_CPUID_REGISTER_EBX, 10)
+#define X86_64_CPUID_FEATURE_SMAP X86_64_CPUID_DEFINE_FEATURE(7, X86_64_CPUID_REGISTER_EBX, 20)
+#define X86_64_CPUID_FEATURE_PDPE1GB X86_64_CPUID_DEFINE_FEATURE(0x80000001, X86_64_CPUID_REGISTER_EDX, 26)
 #define X86_64_CPUID_FEATURE_TSC_INVARIANT X86_64_CPUID_DEFINE_FEATURE(0x80000007, X86_64_CPUID_REGISTER_EDX, 8)
 
 typedef enum {
@@ -2,5 +2,16 @@
 
 #include "arch/interrupt.h"
 
+#include <stdint.h>
+
+typedef struct {
+    uintptr_t fault_address; /* Address of the instruction that is allowed to fault */
+    uintptr_t fixup_address; /* Address execution is resumed at */
+} x86_64_exception_fixup_t;
+
 /// Panic stub for unhandled exceptions.
 [[noreturn]] void x86_64_exception_unhandled(arch_interrupt_frame_t *frame);
+
+/// Look up the fixup for a faulting instruction in the exception table.
+/// @returns Address to resume execution at, zero if the instruction has no fixup
+uintptr_t x86_64_exception_fixup(uintptr_t rip);
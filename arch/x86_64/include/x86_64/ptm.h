@@ -6,7 +6,8 @@
 #define X86_64_PTM_AS(ADDRESS_SPACE) (CONTAINER_OF((ADDRESS_SPACE), x86_64_ptm_address_space_t, common))
 
 typedef struct {
-    spinlock_t pt_lock;
     uintptr_t pt_top;
+    uint64_t pcid_owner; /* Unique id, PCID slots are matched against it */
+    uint64_t tlb_generation; /* Bumped whenever non-global entries are invalidated */
     vm_address_space_t common;
 } x86_64_ptm_address_space_t;
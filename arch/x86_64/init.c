@@ -111,6 +111,8 @@ static void initialize_cpu_local(cpu_t *cpu, size_t seqid) {
     cpu->arch.lapic_timer_frequency = 0;
     cpu->arch.tsc_timer_frequency = 0;
     cpu->arch.tss = nullptr;
+    for(size_t i = 0; i < X86_64_PCID_SLOT_COUNT; i++) cpu->arch.pcid_slots[i].owner = 0;
+    cpu->arch.pcid_victim = 0;
 
     cpu->arch.lapic_id = 0;
     cpu->sequential_id = seqid;
@@ -125,6 +127,7 @@ static void initialize_cpu_local(cpu_t *cpu, size_t seqid) {
     cpu->flags.threaded = false;
     cpu->flags.in_interrupt_hard = false;
     cpu->flags.in_interrupt_soft = false;
+    cpu->flags.in_reclaim = false;
     cpu->flags.deferred_work_status = 0;
 }
 
@@ -228,8 +231,10 @@ INIT_TARGET(tss, INIT_STAGE_BEFORE_MAIN, INIT_SCOPE_ALL, INIT_DEPS()) {
 
     x86_64_tss_set_ist(tss, 0, HHDM(PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_NONE))) + ARCH_PAGE_GRANULARITY));
     x86_64_tss_set_ist(tss, 1, HHDM(PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_NONE))) + ARCH_PAGE_GRANULARITY));
+    x86_64_tss_set_ist(tss, 2, HHDM(PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_NONE))) + ARCH_PAGE_GRANULARITY));
     x86_64_interrupt_set_ist(2, 1); // Non-maskable
     x86_64_interrupt_set_ist(18, 2); // Machine check
+    x86_64_interrupt_set_ist(8, 3); // Double fault, a kernel stack overflow into its guard page ends up here
 
     ARCH_CPU_CURRENT_WRITE(arch.tss, tss);
 
@@ -1,4 +1,5 @@
 extern x86_64_interrupt_handler
+extern g_x86_64_cpu_smap_support
 
 %macro SWAPGS_CONDITIONAL 0
         test qword [rsp + 24], 3
@@ -10,6 +11,11 @@ extern x86_64_interrupt_handler
 isr_stub:
     cld
 
+    cmp byte [rel g_x86_64_cpu_smap_support], 0
+    je .smap_done
+    clac ; Never run handlers with user access enabled, RFLAGS.AC is restored by iretq
+    .smap_done:
+
     SWAPGS_CONDITIONAL
 
     push rax
@@ -4,16 +4,22 @@
 #include "arch/page.h"
 #include "arch/ptm.h"
 #include "common/assert.h"
-#include "common/lock/spinlock.h"
 #include "common/log.h"
+#include "lib/container.h"
 #include "lib/expect.h"
+#include "lib/list.h"
+#include "lib/math.h"
 #include "lib/mem.h"
 #include "memory/earlymem.h"
 #include "memory/heap.h"
 #include "memory/hhdm.h"
 #include "memory/page.h"
 #include "memory/pmm.h"
+#include "sched/sched.h"
+#include "sys/dw.h"
 #include "sys/init.h"
+#include "sys/interrupt.h"
+#include "x86_64/cpu/cpu.h"
 #include "x86_64/cpu/cr.h"
 #include "x86_64/exception.h"
 #include "x86_64/interrupt.h"
@@ -34,7 +40,9 @@
 #define ENTRY_FLAG_WRITETHROUGH (1 << 3)
 #define ENTRY_FLAG_DISABLECACHE (1 << 4)
 #define ENTRY_FLAG_ACCESSED (1 << 5)
+#define ENTRY_FLAG_DIRTY (1 << 6)
 #define ENTRY_FLAG_GLOBAL (1 << 8)
+#define ENTRY_FLAG_SWAP (1 << 9) /* Software flag, non-present entry holding a swap entry */
 #define ENTRY_FLAG_NX ((uint64_t) 1 << 63)
 #define ENTRY_FLAG_PAT(PAGE_SIZE) ((PAGE_SIZE) == PAGE_SIZE_4K ? ENTRYL_FLAG_PAT : ENTRYH_FLAG_PAT)
 #define ENTRY_ADDRESS_MASK(PAGE_SIZE) ((PAGE_SIZE) == PAGE_SIZE_4K ? ENTRYL_ADDRESS_MASK : ENTRYH_ADDRESS_MASK)
@@ -42,10 +50,17 @@
 #define ENTRYL_FLAG_PAT (1 << 7)
 #define ENTRYL_ADDRESS_MASK ((uint64_t) 0x000F'FFFF'FFFF'F000)
 
+#define CR3_FLAG_NOFLUSH ((uint64_t) 1 << 63)
+
+#define INVPCID_TYPE_SINGLE_CONTEXT 1
+
 #define ENTRYH_FLAG_PS (1 << 7)
 #define ENTRYH_FLAG_PAT (1 << 12)
 #define ENTRYH_ADDRESS_MASK ((uint64_t) 0x000F'FFFF'FFFF'0000)
 
+#define SWAP_ENTRY_SHIFT 12
+#define SWAP_ENTRY_MAX ((uint64_t) 1 << 51)
+
 #define PAT0 (0)
 #define PAT1 (ENTRY_FLAG_WRITETHROUGH)
 #define PAT2 (ENTRY_FLAG_DISABLECACHE)
@@ -77,8 +92,7 @@ typedef enum {
 
 static x86_64_ptm_address_space_t g_global_address_space;
 
-// TODO: 1gb pages (needs the cpuid check)
-static bool g_x86_64_cpu_pdpe1gb_support = true;
+static uint64_t g_next_pcid_owner = 1;
 
 static uintptr_t alloc_page() {
     if(EXPECT_UNLIKELY(g_earlymem_active)) {
@@ -86,7 +100,57 @@ static uintptr_t alloc_page() {
         mem_clear((void *) HHDM(address), ARCH_PAGE_GRANULARITY);
         return address;
     }
-    return PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_ZERO)));
+    page_t *page = PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_ZERO));
+    page_flags_set(page, PAGE_FLAG_PAGETABLE);
+    return PAGE_PADDR(page);
+}
+
+/// Page tables are locked one by one through the lock bit of their page descriptor. Walks lock
+/// hand over hand from the top and tables are only freed with their parent locked, so a table
+/// reached through a locked parent stays around until it is unlocked.
+/// Lockless walks run with interrupts masked, freed tables are only reused after a shootdown
+/// has gone around every CPU.
+static void table_lock(uint64_t *table) {
+    if(EXPECT_UNLIKELY(g_earlymem_active)) return;
+    sched_preempt_inc();
+    dw_status_disable();
+    page_t *page = PAGE(HHDM_TO_PHYS(table));
+    while(!page_try_lock(page)) arch_cpu_relax();
+}
+
+static void table_unlock(uint64_t *table) {
+    if(EXPECT_UNLIKELY(g_earlymem_active)) return;
+    page_unlock(PAGE(HHDM_TO_PHYS(table)));
+    dw_status_enable();
+    sched_preempt_dec();
+}
+
+/// Adjust the count of non-empty entries of a table.
+/// Tables allocated before the page database are not tracked and never freed.
+/// @warning Assumes the table is locked
+static void table_count(uint64_t *table, int delta) {
+    if(EXPECT_UNLIKELY(g_earlymem_active)) return;
+    page_t *page = PAGE(HHDM_TO_PHYS(table));
+    if(!page_flags_test(page, PAGE_FLAG_PAGETABLE)) return;
+    page->entry_count += delta;
+}
+
+/// Invalidate a range on all CPUs.
+/// INVLPG only reaches the PCID that is loaded, so CPUs that merely hold a context of a user
+/// address space learn about the change through its generation when they load it again.
+/// Entries of the global address space are global and are invalidated in every context.
+/// @warning The generation has to be bumped after the entries are changed.
+static void shootdown(vm_address_space_t *address_space, uintptr_t vaddr, size_t length) {
+    if(address_space != g_vm_global_address_space) __atomic_add_fetch(&X86_64_PTM_AS(address_space)->tlb_generation, 1, __ATOMIC_SEQ_CST);
+    x86_64_tlb_shootdown(vaddr, length);
+}
+
+static void invpcid(uint64_t type, uint64_t pcid, uintptr_t address) {
+    struct {
+        uint64_t pcid;
+        uint64_t address;
+    } descriptor = { .pcid = pcid, .address = address };
+    asm volatile("invpcid %0, %1" : : "m"(descriptor), "r"(type) : "memory");
 }
 
 static uint64_t privilege_to_x86_flags(vm_privilege_t privilege) {
@@ -106,85 +170,242 @@ static uint64_t cache_to_x86_flags(vm_cache_t cache, page_size_t page_size) {
     ASSERT_UNREACHABLE();
 }
 
+/// Replace a big page with a table of the next smaller pages mapping the same memory with the same attributes.
+/// @returns the new table entry
 static uint64_t break_big(uint64_t *table, int index, int current_level) {
-    ASSERT(current_level > 0);
+    ASSERT(current_level > 1);
 
     uint64_t entry = table[index];
 
     uintptr_t address = entry & ENTRYH_ADDRESS_MASK;
-    bool pat = entry & ENTRYH_FLAG_PAT;
-    entry &= ~ENTRYL_ADDRESS_MASK;
+    bool pat = (entry & ENTRYH_FLAG_PAT) != 0;
 
-    uint64_t new_entry = entry;
-    if(current_level - 1 == 0) {
-        new_entry &= ~ENTRYL_FLAG_PAT;
+    uint64_t new_entry = entry & ~(ENTRYH_ADDRESS_MASK | ENTRYH_FLAG_PAT);
+    if(current_level - 1 == 1) {
+        new_entry &= ~ENTRYH_FLAG_PS;
         if(pat) new_entry |= ENTRYL_FLAG_PAT;
     } else {
-        new_entry |= ENTRYH_FLAG_PAT;
+        if(pat) new_entry |= ENTRYH_FLAG_PAT;
     }
 
-    entry |= alloc_page();
-    if(pat) entry |= ENTRYL_FLAG_PAT;
+    uintptr_t new_table_address = alloc_page();
+    uint64_t *new_table = (uint64_t *) HHDM(new_table_address);
+    for(int i = 0; i < 512; i++) new_table[i] = new_entry | (address + i * LEVEL_TO_PAGESIZE(current_level - 1));
+    table_count(new_table, 512);
 
-    uint64_t *new_table = (void *) (entry & ENTRYL_ADDRESS_MASK);
-    for(int i = 0; i < 512 * ARCH_PAGE_GRANULARITY; i += ARCH_PAGE_GRANULARITY) new_table[i] = new_entry | (address + i);
-
-    __atomic_store(&table[index], &entry, __ATOMIC_SEQ_CST);
+    // The table entry only carries permissions, caching and size live in the new entries
+    entry = ENTRY_FLAG_PRESENT | new_table_address | (entry & (ENTRY_FLAG_RW | ENTRY_FLAG_USER | ENTRY_FLAG_NX));
+    __atomic_store_n(&table[index], entry, __ATOMIC_SEQ_CST);
 
     return entry;
 }
 
-static void map_page(uint64_t *pml4, uintptr_t vaddr, uintptr_t paddr, page_size_t page_size, vm_protection_t prot, vm_cache_t cache, vm_privilege_t privilege, bool global) {
-    int lowest_index;
-    switch(page_size) {
-        case PAGE_SIZE_4K: lowest_index = 1; break;
-        case PAGE_SIZE_2M: lowest_index = 2; break;
-        case PAGE_SIZE_1G: lowest_index = 3; break;
-    }
-
+/// Walk down to the table of a level, allocating missing tables and breaking big pages on the way.
+/// The table entries on the way are widened so they do not restrict the protection and privilege.
+/// @param flush Set when an entry that may be cached was changed
+/// @returns the table, locked
+static uint64_t *walk_create(uint64_t *pml4, uintptr_t vaddr, int level, vm_protection_t prot, vm_privilege_t privilege, PARAM_OUT(bool *) flush) {
     uint64_t *current_table = pml4;
-    for(int j = LEVEL_COUNT; j > lowest_index; j--) {
+    table_lock(current_table);
+    for(int j = LEVEL_COUNT; j > level; j--) {
         int index = VADDR_TO_INDEX(vaddr, j);
 
         uint64_t entry = current_table[index];
         if((entry & ENTRY_FLAG_PRESENT) == 0) {
             entry = ENTRY_FLAG_PRESENT | (alloc_page() & ENTRYL_ADDRESS_MASK);
             if(!prot.exec) entry |= ENTRY_FLAG_NX;
+            table_count(current_table, 1);
         } else {
             if((entry & ENTRYH_FLAG_PS) != 0) entry = break_big(current_table, index, j);
             if(prot.exec) entry &= ~ENTRY_FLAG_NX;
         }
         if(prot.write) entry |= ENTRY_FLAG_RW;
         entry |= privilege_to_x86_flags(privilege);
-        __atomic_store(&current_table[index], &entry, __ATOMIC_SEQ_CST);
 
-        current_table = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+        uint64_t previous = __atomic_exchange_n(&current_table[index], entry, __ATOMIC_SEQ_CST);
+        if((previous & ENTRY_FLAG_PRESENT) != 0 && previous != entry) *flush = true;
+
+        uint64_t *next_table = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+        table_lock(next_table);
+        table_unlock(current_table);
+        current_table = next_table;
+    }
+    return current_table;
+}
+
+/// Distance from an address to the end of the entry that covers it at a level.
+static size_t entry_remainder(uintptr_t vaddr, int level) {
+    return MATH_FLOOR(vaddr, LEVEL_TO_PAGESIZE(level)) + LEVEL_TO_PAGESIZE(level) - vaddr;
+}
+
+/// Largest page size a contiguous mapping can use at an offset.
+static page_size_t contiguous_page_size(uintptr_t vaddr, uintptr_t paddr, size_t length) {
+    if(g_x86_64_cpu_pdpe1gb_support && paddr % PAGE_SIZE_1G == 0 && vaddr % PAGE_SIZE_1G == 0 && length >= PAGE_SIZE_1G) return PAGE_SIZE_1G;
+    if(paddr % PAGE_SIZE_2M == 0 && vaddr % PAGE_SIZE_2M == 0 && length >= PAGE_SIZE_2M) return PAGE_SIZE_2M;
+    return PAGE_SIZE_4K;
+}
+
+/// Map a range, consecutive entries of a table are filled without walking again.
+/// @param paddrs Physical address of every 4K page, nullptr maps the contiguous range at paddr with the largest pages that fit
+/// @returns true if an entry that may be cached was replaced, otherwise no shootdown is needed
+static bool map_range(uint64_t *pml4, uintptr_t vaddr, uintptr_t paddr, const uintptr_t *paddrs, size_t length, vm_protection_t prot, vm_cache_t cache, vm_privilege_t privilege, bool global) {
+    bool flush = false;
+    for(size_t i = 0; i < length;) {
+        page_size_t page_size = paddrs == nullptr ? contiguous_page_size(vaddr + i, paddr + i, length - i) : PAGE_SIZE_4K;
+
+        int level;
+        switch(page_size) {
+            case PAGE_SIZE_4K: level = 1; break;
+            case PAGE_SIZE_2M: level = 2; break;
+            case PAGE_SIZE_1G: level = 3; break;
+        }
+
+        uint64_t *table = walk_create(pml4, vaddr + i, level, prot, privilege, &flush);
+
+        uint64_t flags = ENTRY_FLAG_PRESENT | privilege_to_x86_flags(privilege) | cache_to_x86_flags(cache, page_size);
+        if(page_size != PAGE_SIZE_4K) flags |= ENTRYH_FLAG_PS;
+        if(prot.write) flags |= ENTRY_FLAG_RW;
+        if(!prot.exec) flags |= ENTRY_FLAG_NX;
+        if(global) flags |= ENTRY_FLAG_GLOBAL;
+
+        do {
+            uintptr_t address = paddrs == nullptr ? paddr + i : paddrs[i / ARCH_PAGE_GRANULARITY];
+            uint64_t previous = __atomic_exchange_n(&table[VADDR_TO_INDEX(vaddr + i, level)], flags | (address & ENTRY_ADDRESS_MASK(page_size)), __ATOMIC_SEQ_CST);
+            if(previous == 0) table_count(table, 1);
+            if((previous & ENTRY_FLAG_PRESENT) != 0) flush = true;
+            i += page_size;
+        } while(i < length && VADDR_TO_INDEX(vaddr + i, level) != 0 && (paddrs != nullptr || contiguous_page_size(vaddr + i, paddr + i, length - i) == page_size));
+
+        table_unlock(table);
+    }
+    return flush;
+}
+
+/// Find the 4K leaf entry of a virtual address and lock its table.
+/// @returns nullptr if there is no page table for the address or it is mapped by a big page
+static uint64_t *leaf_entry_lock(vm_address_space_t *address_space, uintptr_t vaddr) {
+    uint64_t *current_table = (uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top);
+    table_lock(current_table);
+    for(int j = LEVEL_COUNT; j > 1; j--) {
+        uint64_t entry = current_table[VADDR_TO_INDEX(vaddr, j)];
+        if((entry & ENTRY_FLAG_PRESENT) == 0 || (entry & ENTRYH_FLAG_PS) != 0) {
+            table_unlock(current_table);
+            return nullptr;
+        }
+
+        uint64_t *next_table = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+        table_lock(next_table);
+        table_unlock(current_table);
+        current_table = next_table;
     }
+    return &current_table[VADDR_TO_INDEX(vaddr, 1)];
+}
 
-    uint64_t entry = ENTRY_FLAG_PRESENT | (paddr & ENTRY_ADDRESS_MASK(page_size)) | privilege_to_x86_flags(privilege) | cache_to_x86_flags(cache, page_size);
-    if(page_size != PAGE_SIZE_4K) entry |= ENTRYH_FLAG_PS;
-    if(prot.write) entry |= ENTRY_FLAG_RW;
-    if(!prot.exec) entry |= ENTRY_FLAG_NX;
-    if(global) entry |= ENTRY_FLAG_GLOBAL;
-    __atomic_store(&current_table[VADDR_TO_INDEX(vaddr, lowest_index)], &entry, __ATOMIC_SEQ_CST);
+static void leaf_entry_unlock(uint64_t *entry) {
+    table_unlock((uint64_t *) MATH_FLOOR((uintptr_t) entry, ARCH_PAGE_GRANULARITY));
+}
+
+/// Find the entry that maps a virtual address without taking any table lock.
+/// @warning Interrupts have to stay masked while the entry is used, see table_lock
+/// @param level Level of the entry, 1 unless the address is mapped by a big page
+/// @returns nullptr if a table on the way is not present
+static uint64_t *walk_lockless(vm_address_space_t *address_space, uintptr_t vaddr, PARAM_OUT(int *) level) {
+    uint64_t *current_table = (uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top);
+    int j = LEVEL_COUNT;
+    for(; j > 1; j--) {
+        uint64_t entry = __atomic_load_n(&current_table[VADDR_TO_INDEX(vaddr, j)], __ATOMIC_ACQUIRE);
+        if((entry & ENTRY_FLAG_PRESENT) == 0) return nullptr;
+        if((entry & ENTRYH_FLAG_PS) != 0) break;
+        current_table = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+    }
+    *level = j;
+    return &current_table[VADDR_TO_INDEX(vaddr, j)];
 }
 
 vm_address_space_t *arch_ptm_address_space_create() {
     x86_64_ptm_address_space_t *address_space = heap_alloc(sizeof(x86_64_ptm_address_space_t));
     address_space->pt_top = alloc_page();
-    address_space->pt_lock = SPINLOCK_INIT;
-    address_space->common.lock = SPINLOCK_INIT;
+    address_space->pcid_owner = __atomic_fetch_add(&g_next_pcid_owner, 1, __ATOMIC_RELAXED);
+    address_space->tlb_generation = 0;
+    address_space->common.lock = RWLOCK_INIT;
     address_space->common.regions = vm_create_regions();
+    address_space->common.lookup_cache = nullptr;
     address_space->common.start = USERSPACE_START;
     address_space->common.end = USERSPACE_END;
 
     mem_copy((void *) HHDM(address_space->pt_top + 256 * sizeof(uint64_t)), (void *) HHDM(X86_64_PTM_AS(g_vm_global_address_space)->pt_top + 256 * sizeof(uint64_t)), 256 * sizeof(uint64_t));
 
+    vm_address_space_register(&address_space->common);
     return &address_space->common;
 }
 
+/// Free a page table and the tables below it, the pages they map are left alone.
+static void free_table(uintptr_t table_address, int level) {
+    uint64_t *table = (uint64_t *) HHDM(table_address);
+    if(level > 1) {
+        for(int i = 0; i < 512; i++) {
+            if((table[i] & ENTRY_FLAG_PRESENT) == 0 || (table[i] & ENTRYH_FLAG_PS) != 0) continue;
+            free_table(table[i] & ENTRYL_ADDRESS_MASK, level - 1);
+        }
+    }
+    pmm_free(&PAGE(table_address)->block);
+}
+
+void arch_ptm_address_space_destroy(vm_address_space_t *address_space) {
+    ASSERT(address_space != g_vm_global_address_space);
+
+    // The upper half belongs to the global address space
+    uint64_t *pml4 = (uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top);
+    for(int i = 0; i < 256; i++) {
+        if((pml4[i] & ENTRY_FLAG_PRESENT) == 0) continue;
+        free_table(pml4[i] & ENTRYL_ADDRESS_MASK, LEVEL_COUNT - 1);
+    }
+    pmm_free(&PAGE(X86_64_PTM_AS(address_space)->pt_top)->block);
+
+    // Other CPUs never match the id again and flush the PCID once they reuse the slot
+    if(g_x86_64_cpu_invpcid_support) {
+        interrupt_state_t previous_state = interrupt_state_mask();
+        cpu_t *cpu = ARCH_CPU_CURRENT_PTR();
+        for(size_t i = 0; i < X86_64_PCID_SLOT_COUNT; i++) {
+            if(cpu->arch.pcid_slots[i].owner != X86_64_PTM_AS(address_space)->pcid_owner) continue;
+            invpcid(INVPCID_TYPE_SINGLE_CONTEXT, i + 1, 0);
+            cpu->arch.pcid_slots[i].owner = 0;
+        }
+        interrupt_state_restore(previous_state);
+    }
+
+    heap_free(X86_64_PTM_AS(address_space), sizeof(x86_64_ptm_address_space_t));
+}
+
 void arch_ptm_load_address_space(vm_address_space_t *address_space) {
-    x86_64_cr3_write(X86_64_PTM_AS(address_space)->pt_top);
+    x86_64_ptm_address_space_t *x86_64_address_space = X86_64_PTM_AS(address_space);
+    if(!g_x86_64_cpu_pcid_support) {
+        x86_64_cr3_write(x86_64_address_space->pt_top);
+        return;
+    }
+
+    // Read before the switch, a change that races with it bumps the generation past this one
+    uint64_t generation = __atomic_load_n(&x86_64_address_space->tlb_generation, __ATOMIC_SEQ_CST);
+
+    cpu_t *cpu = ARCH_CPU_CURRENT_PTR();
+    size_t slot = X86_64_PCID_SLOT_COUNT;
+    for(size_t i = 0; i < X86_64_PCID_SLOT_COUNT; i++) {
+        if(cpu->arch.pcid_slots[i].owner == x86_64_address_space->pcid_owner) {
+            slot = i;
+            break;
+        }
+        if(slot == X86_64_PCID_SLOT_COUNT && cpu->arch.pcid_slots[i].owner == 0) slot = i;
+    }
+    if(slot == X86_64_PCID_SLOT_COUNT) {
+        slot = cpu->arch.pcid_victim;
+        cpu->arch.pcid_victim = (slot + 1) % X86_64_PCID_SLOT_COUNT;
+    }
+
+    // Loading without the no flush bit invalidates the non-global entries of the PCID
+    bool valid = cpu->arch.pcid_slots[slot].owner == x86_64_address_space->pcid_owner && cpu->arch.pcid_slots[slot].generation == generation;
+    cpu->arch.pcid_slots[slot].owner = x86_64_address_space->pcid_owner;
+    cpu->arch.pcid_slots[slot].generation = generation;
+    x86_64_cr3_write(x86_64_address_space->pt_top | (slot + 1) | (valid ? CR3_FLAG_NOFLUSH : 0));
 }
 
 void arch_ptm_map(vm_address_space_t *address_space, uintptr_t vaddr, uintptr_t paddr, size_t length, vm_protection_t prot, vm_cache_t cache, vm_privilege_t privilege, bool global) {
@@ -195,22 +416,19 @@ void arch_ptm_map(vm_address_space_t *address_space, uintptr_t vaddr, uintptr_t
     ASSERT(length % ARCH_PAGE_GRANULARITY == 0);
 
     if(!prot.read) log(LOG_LEVEL_ERROR, "PTM", "No-read mapping is not supported on x86_64");
-    spinlock_acquire_nodw(&X86_64_PTM_AS(address_space)->pt_lock);
 
-    for(size_t i = 0; i < length;) {
-        page_size_t cursize = PAGE_SIZE_4K;
-        if(paddr % PAGE_SIZE_2M == 0 && vaddr % PAGE_SIZE_2M == 0 && length - i >= PAGE_SIZE_2M) cursize = PAGE_SIZE_2M;
-
-        if(g_x86_64_cpu_pdpe1gb_support && paddr % PAGE_SIZE_1G == 0 && vaddr % PAGE_SIZE_1G == 0 && length - i >= PAGE_SIZE_1G) cursize = PAGE_SIZE_1G;
+    // Entries that were not present cannot be cached
+    if(map_range((uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top), vaddr, paddr, nullptr, length, prot, cache, privilege, global)) shootdown(address_space, vaddr, length);
+}
 
-        map_page((uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top), vaddr + i, paddr + i, cursize, prot, cache, privilege, global);
+void arch_ptm_map_pages(vm_address_space_t *address_space, uintptr_t vaddr, const uintptr_t *paddrs, size_t count, vm_protection_t prot, vm_cache_t cache, vm_privilege_t privilege, bool global) {
+    LOG_TRACE("PTM", "map_pages(as: %#lx-%#lx, vaddr: %#lx, count: %lu, prot: %c%c%c)", address_space->start, address_space->end, vaddr, count, prot.read ? 'R' : '-', prot.write ? 'W' : '-', prot.exec ? 'X' : '-');
 
-        i += cursize;
-    }
+    ASSERT(vaddr % ARCH_PAGE_GRANULARITY == 0);
 
-    x86_64_tlb_shootdown(vaddr, length);
+    if(!prot.read) log(LOG_LEVEL_ERROR, "PTM", "No-read mapping is not supported on x86_64");
 
-    spinlock_release_nodw(&X86_64_PTM_AS(address_space)->pt_lock);
+    if(map_range((uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top), vaddr, 0, paddrs, count * ARCH_PAGE_GRANULARITY, prot, cache, privilege, global)) shootdown(address_space, vaddr, count * ARCH_PAGE_GRANULARITY);
 }
 
 void arch_ptm_rewrite(vm_address_space_t *address_space, uintptr_t vaddr, size_t length, vm_protection_t prot, vm_cache_t cache, vm_privilege_t privilege, bool global) {
@@ -220,10 +438,10 @@ void arch_ptm_rewrite(vm_address_space_t *address_space, uintptr_t vaddr, size_t
     ASSERT(length % ARCH_PAGE_GRANULARITY == 0);
 
     if(!prot.read) log(LOG_LEVEL_ERROR, "PTM", "No-read mapping is not supported on x86_64");
-    spinlock_acquire_nodw(&X86_64_PTM_AS(address_space)->pt_lock);
 
     for(size_t i = 0; i < length;) {
         uint64_t *current_table = (uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top);
+        table_lock(current_table);
 
         int j = LEVEL_COUNT;
         for(; j > 1; j--) {
@@ -233,7 +451,7 @@ void arch_ptm_rewrite(vm_address_space_t *address_space, uintptr_t vaddr, size_t
             if((entry & ENTRY_FLAG_PRESENT) == 0) goto skip;
             if((entry & ENTRYH_FLAG_PS) != 0) {
                 ASSERT(j <= 3);
-                if(INDEX_TO_VADDR(index, j) < vaddr + i || LEVEL_TO_PAGESIZE(j) > length - i) {
+                if(MATH_FLOOR(vaddr + i, LEVEL_TO_PAGESIZE(j)) < vaddr + i || LEVEL_TO_PAGESIZE(j) > length - i) {
                     entry = break_big(current_table, index, j);
                 } else {
                     break;
@@ -244,11 +462,18 @@ void arch_ptm_rewrite(vm_address_space_t *address_space, uintptr_t vaddr, size_t
             if(prot.exec) entry &= ~ENTRY_FLAG_NX;
             __atomic_store_n(&current_table[index], entry, __ATOMIC_SEQ_CST);
 
-            current_table = (uint64_t *) HHDM(current_table[index] & ENTRYL_ADDRESS_MASK);
+            uint64_t *next_table = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+            table_lock(next_table);
+            table_unlock(current_table);
+            current_table = next_table;
         }
 
         int index = VADDR_TO_INDEX(vaddr + i, j);
-        uint64_t entry = current_table[index] | privilege_to_x86_flags(privilege) | cache_to_x86_flags(cache, j == 0 ? PAGE_SIZE_4K : (j == 1 ? PAGE_SIZE_2M : PAGE_SIZE_1G));
+        if((current_table[index] & ENTRY_FLAG_PRESENT) == 0) goto skip; // Keep swap entries intact
+
+        page_size_t page_size = j == 1 ? PAGE_SIZE_4K : (j == 2 ? PAGE_SIZE_2M : PAGE_SIZE_1G);
+        uint64_t entry = current_table[index] & ~(ENTRY_FLAG_WRITETHROUGH | ENTRY_FLAG_DISABLECACHE | ENTRY_FLAG_PAT(page_size));
+        entry |= privilege_to_x86_flags(privilege) | cache_to_x86_flags(cache, page_size);
 
         if(prot.write)
             entry |= ENTRY_FLAG_RW;
@@ -268,12 +493,37 @@ void arch_ptm_rewrite(vm_address_space_t *address_space, uintptr_t vaddr, size_t
         __atomic_store_n(&current_table[index], entry, __ATOMIC_SEQ_CST);
 
     skip:
-        i += LEVEL_TO_PAGESIZE(j);
+        table_unlock(current_table);
+        i += entry_remainder(vaddr + i, j);
     }
 
-    x86_64_tlb_shootdown(vaddr, length);
+    shootdown(address_space, vaddr, length);
+}
 
-    spinlock_release_nodw(&X86_64_PTM_AS(address_space)->pt_lock);
+/// Detach the tables below a table within a range that have no entries left, bottom up.
+/// @warning Assumes the table is locked
+/// @param tables Collects the detached tables, they may only be freed after a shootdown
+static void prune(uint64_t *table, int level, uintptr_t vaddr, size_t length, list_t *tables) {
+    for(size_t i = 0; i < length;) {
+        uintptr_t address = vaddr + i;
+        size_t step = MATH_MIN(entry_remainder(address, level), length - i);
+        i += step;
+
+        int index = VADDR_TO_INDEX(address, level);
+        uint64_t entry = table[index];
+        if((entry & ENTRY_FLAG_PRESENT) == 0 || (entry & ENTRYH_FLAG_PS) != 0) continue;
+
+        uint64_t *child = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+        page_t *page = PAGE(entry & ENTRYL_ADDRESS_MASK);
+        table_lock(child);
+        if(level - 1 > 1) prune(child, level - 1, address, step, tables);
+        if(page_flags_test(page, PAGE_FLAG_PAGETABLE) && page->entry_count == 0) {
+            __atomic_store_n(&table[index], 0, __ATOMIC_SEQ_CST);
+            table_count(table, -1);
+            list_push(tables, &page->block.list_node);
+        }
+        table_unlock(child);
+    }
 }
 
 void arch_ptm_unmap(vm_address_space_t *address_space, uintptr_t vaddr, size_t length) {
@@ -282,10 +532,10 @@ void arch_ptm_unmap(vm_address_space_t *address_space, uintptr_t vaddr, size_t l
     ASSERT(vaddr % ARCH_PAGE_GRANULARITY == 0);
     ASSERT(length % ARCH_PAGE_GRANULARITY == 0);
 
-    spinlock_acquire_nodw(&X86_64_PTM_AS(address_space)->pt_lock);
-
+    bool flush = false;
     for(size_t i = 0; i < length;) {
         uint64_t *current_table = (uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top);
+        table_lock(current_table);
 
         int j = LEVEL_COUNT;
         for(; j > 1; j--) {
@@ -295,68 +545,252 @@ void arch_ptm_unmap(vm_address_space_t *address_space, uintptr_t vaddr, size_t l
             if((entry & ENTRY_FLAG_PRESENT) == 0) goto skip;
             if((entry & ENTRYH_FLAG_PS) != 0) {
                 ASSERT(j <= 3);
-                if(INDEX_TO_VADDR(index, j) < vaddr + i || LEVEL_TO_PAGESIZE(j) > length - i) {
+                if(MATH_FLOOR(vaddr + i, LEVEL_TO_PAGESIZE(j)) < vaddr + i || LEVEL_TO_PAGESIZE(j) > length - i) {
                     entry = break_big(current_table, index, j);
+                    flush = true;
                 } else {
                     break;
                 }
             }
-            current_table = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+
+            uint64_t *next_table = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+            table_lock(next_table);
+            table_unlock(current_table);
+            current_table = next_table;
         }
-        __atomic_store_n(&current_table[VADDR_TO_INDEX(vaddr + i, j)], 0, __ATOMIC_SEQ_CST);
+        // The rest of a leaf table is cleared without walking again
+        do {
+            uint64_t previous = __atomic_exchange_n(&current_table[VADDR_TO_INDEX(vaddr + i, j)], 0, __ATOMIC_SEQ_CST);
+            if(previous != 0) table_count(current_table, -1);
+            if((previous & ENTRY_FLAG_PRESENT) != 0) flush = true;
+            i += LEVEL_TO_PAGESIZE(j);
+        } while(j == 1 && i < length && VADDR_TO_INDEX(vaddr + i, 1) != 0);
+        table_unlock(current_table);
+        continue;
 
     skip:
-        i += LEVEL_TO_PAGESIZE(j);
+        table_unlock(current_table);
+        i += entry_remainder(vaddr + i, j);
     }
 
-    x86_64_tlb_shootdown(vaddr, length);
+    // The tables of the global address space are shared by every PML4 and stay
+    list_t tables = LIST_INIT;
+    if(address_space != g_vm_global_address_space) {
+        uint64_t *pml4 = (uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top);
+        table_lock(pml4);
+        prune(pml4, LEVEL_COUNT, vaddr, length, &tables);
+        table_unlock(pml4);
+    }
+
+    // Entries that were not present cannot be cached
+    if(flush || tables.count > 0) shootdown(address_space, vaddr, length);
 
-    spinlock_release_nodw(&X86_64_PTM_AS(address_space)->pt_lock);
+    // Walkers that still reached the detached tables are gone once the shootdown went around
+    while(tables.count > 0) pmm_free(CONTAINER_OF(list_pop(&tables), pmm_block_t, list_node));
 }
 
 bool arch_ptm_physical(vm_address_space_t *address_space, uintptr_t vaddr, PARAM_OUT(uintptr_t *) paddr) {
-    spinlock_acquire_nodw(&X86_64_PTM_AS(address_space)->pt_lock);
+    interrupt_state_t previous_state = interrupt_state_mask();
+    int level;
+    uint64_t *entry_pointer = walk_lockless(address_space, vaddr, &level);
+    uint64_t entry = entry_pointer != nullptr ? __atomic_load_n(entry_pointer, __ATOMIC_ACQUIRE) : 0;
+    interrupt_state_restore(previous_state);
+    if((entry & ENTRY_FLAG_PRESENT) == 0) return false;
 
-    uint64_t *current_table = (uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top);
-    int j = LEVEL_COUNT;
-    for(; j > 1; j--) {
-        int index = VADDR_TO_INDEX(vaddr, j);
-        if((current_table[index] & ENTRY_FLAG_PRESENT) == 0) {
-            spinlock_release_nodw(&X86_64_PTM_AS(address_space)->pt_lock);
-            return false;
+    switch(level) {
+        case 1:  *paddr = ((entry & ENTRYL_ADDRESS_MASK) + (vaddr & 0xFFF)); break;
+        case 2:  *paddr = ((entry & ENTRYH_ADDRESS_MASK) + (vaddr & 0x1F'FFFF)); break;
+        case 3:  *paddr = ((entry & ENTRYH_ADDRESS_MASK) + (vaddr & 0x3FFF'FFFF)); break;
+        default: ASSERT_UNREACHABLE();
+    }
+    return true;
+}
+
+bool arch_ptm_accessed(vm_address_space_t *address_space, uintptr_t vaddr) {
+    uint64_t *entry = leaf_entry_lock(address_space, vaddr);
+    if(entry == nullptr) return false;
+    // The TLB is not flushed, a stale entry can only make the page look colder than it is
+    bool accessed = (__atomic_fetch_and(entry, ~(uint64_t) ENTRY_FLAG_ACCESSED, __ATOMIC_SEQ_CST) & ENTRY_FLAG_ACCESSED) != 0;
+    leaf_entry_unlock(entry);
+    return accessed;
+}
+
+bool arch_ptm_swap_set(vm_address_space_t *address_space, uintptr_t vaddr, uint64_t swap_entry) {
+    ASSERT(vaddr % ARCH_PAGE_GRANULARITY == 0);
+    ASSERT(swap_entry < SWAP_ENTRY_MAX);
+
+    // The entry is replaced in place, nothing is allocated or freed since this runs under reclaim
+    uint64_t *entry = leaf_entry_lock(address_space, vaddr);
+    if(entry == nullptr) return false;
+    uint64_t previous = __atomic_exchange_n(entry, (swap_entry << SWAP_ENTRY_SHIFT) | ENTRY_FLAG_SWAP, __ATOMIC_SEQ_CST);
+    if(previous == 0) table_count((uint64_t *) MATH_FLOOR((uintptr_t) entry, ARCH_PAGE_GRANULARITY), 1);
+    leaf_entry_unlock(entry);
+
+    if((previous & ENTRY_FLAG_PRESENT) != 0) shootdown(address_space, vaddr, ARCH_PAGE_GRANULARITY);
+    return true;
+}
+
+bool arch_ptm_swap_get(vm_address_space_t *address_space, uintptr_t vaddr, PARAM_OUT(uint64_t *) swap_entry) {
+    interrupt_state_t previous_state = interrupt_state_mask();
+    int level;
+    uint64_t *entry = walk_lockless(address_space, vaddr, &level);
+    uint64_t value = entry != nullptr && level == 1 ? __atomic_load_n(entry, __ATOMIC_ACQUIRE) : 0;
+    interrupt_state_restore(previous_state);
+
+    if((value & (ENTRY_FLAG_PRESENT | ENTRY_FLAG_SWAP)) != ENTRY_FLAG_SWAP) return false;
+    *swap_entry = value >> SWAP_ENTRY_SHIFT;
+    return true;
+}
+
+size_t arch_ptm_harvest(vm_address_space_t *address_space, uintptr_t vaddr, size_t length, PARAM_OUT(size_t *) dirty) {
+    ASSERT(vaddr % ARCH_PAGE_GRANULARITY == 0);
+    ASSERT(length % ARCH_PAGE_GRANULARITY == 0);
+
+    size_t accessed = 0;
+    *dirty = 0;
+
+    // Cleared entries are collected into one invalidation, a stale entry meanwhile only delays the next sample
+    uintptr_t flush_start = UINTPTR_MAX, flush_end = 0;
+    for(size_t i = 0; i < length;) {
+        uint64_t *current_table = (uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top);
+        table_lock(current_table);
+
+        int j = LEVEL_COUNT;
+        for(; j > 1; j--) {
+            uint64_t entry = current_table[VADDR_TO_INDEX(vaddr + i, j)];
+            if((entry & ENTRY_FLAG_PRESENT) == 0) goto skip;
+            if((entry & ENTRYH_FLAG_PS) != 0) break;
+
+            uint64_t *next_table = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+            table_lock(next_table);
+            table_unlock(current_table);
+            current_table = next_table;
         }
-        if((current_table[index] & ENTRYH_FLAG_PS) != 0) break;
-        current_table = (uint64_t *) HHDM(current_table[index] & ENTRYL_ADDRESS_MASK);
+
+        do {
+            uint64_t *entry = &current_table[VADDR_TO_INDEX(vaddr + i, j)];
+            size_t step = MATH_MIN(entry_remainder(vaddr + i, j), length - i);
+            if((*entry & ENTRY_FLAG_PRESENT) != 0) {
+                uint64_t previous = __atomic_fetch_and(entry, ~(uint64_t) (ENTRY_FLAG_ACCESSED | ENTRY_FLAG_DIRTY), __ATOMIC_SEQ_CST);
+                page_t *page = PAGE(previous & (j == 1 ? ENTRYL_ADDRESS_MASK : ENTRYH_ADDRESS_MASK));
+                if((previous & ENTRY_FLAG_ACCESSED) != 0) {
+                    accessed += step / ARCH_PAGE_GRANULARITY;
+                    page_flags_set(page, PAGE_FLAG_REFERENCED);
+                }
+                if((previous & ENTRY_FLAG_DIRTY) != 0) {
+                    *dirty += step / ARCH_PAGE_GRANULARITY;
+                    page_flags_set(page, PAGE_FLAG_DIRTY);
+                }
+                if((previous & (ENTRY_FLAG_ACCESSED | ENTRY_FLAG_DIRTY)) != 0) {
+                    flush_start = MATH_MIN(flush_start, vaddr + i);
+                    flush_end = vaddr + i + step;
+                }
+            }
+            i += step;
+        } while(j == 1 && i < length && VADDR_TO_INDEX(vaddr + i, 1) != 0);
+        table_unlock(current_table);
+        continue;
+
+    skip:
+        table_unlock(current_table);
+        i += entry_remainder(vaddr + i, j);
     }
 
-    uint64_t entry = current_table[VADDR_TO_INDEX(vaddr, j)];
-    spinlock_release_nodw(&X86_64_PTM_AS(address_space)->pt_lock);
-    if((entry & ENTRY_FLAG_PRESENT) == 0) return false;
+    if(flush_start < flush_end) shootdown(address_space, flush_start, flush_end - flush_start);
+    return accessed;
+}
 
-    switch(j) {
-        case 1:  *paddr = ((entry & ENTRYL_ADDRESS_MASK) + (vaddr & (~0x000F'FFFF'FFFF'F000))); break;
-        case 2:  *paddr = ((entry & ENTRYH_ADDRESS_MASK) + (vaddr & (~0x000F'FFFF'FFE0'0000))); break;
-        case 3:  *paddr = ((entry & ENTRYH_ADDRESS_MASK) + (vaddr & (~0x000F'FFFF'C000'0000))); break;
-        default: ASSERT_UNREACHABLE();
+size_t arch_ptm_collapse(vm_address_space_t *address_space, uintptr_t vaddr, size_t length) {
+    ASSERT(vaddr % ARCH_PAGE_GRANULARITY == 0);
+    ASSERT(length % ARCH_PAGE_GRANULARITY == 0);
+
+    size_t count = 0;
+    for(uintptr_t address = MATH_CEIL(vaddr, PAGE_SIZE_2M); address < vaddr + length && vaddr + length - address >= PAGE_SIZE_2M; address += PAGE_SIZE_2M) {
+        uint64_t *current_table = (uint64_t *) HHDM(X86_64_PTM_AS(address_space)->pt_top);
+        table_lock(current_table);
+        for(int j = LEVEL_COUNT; j > 2; j--) {
+            uint64_t entry = current_table[VADDR_TO_INDEX(address, j)];
+            if((entry & ENTRY_FLAG_PRESENT) == 0 || (entry & ENTRYH_FLAG_PS) != 0) goto next;
+
+            uint64_t *next_table = (uint64_t *) HHDM(entry & ENTRYL_ADDRESS_MASK);
+            table_lock(next_table);
+            table_unlock(current_table);
+            current_table = next_table;
+        }
+
+        int index = VADDR_TO_INDEX(address, 2);
+        uint64_t entry = current_table[index];
+        if((entry & ENTRY_FLAG_PRESENT) == 0 || (entry & ENTRYH_FLAG_PS) != 0) goto next;
+
+        uintptr_t table_address = entry & ENTRYL_ADDRESS_MASK;
+        uint64_t *table = (uint64_t *) HHDM(table_address);
+        table_lock(table);
+
+        // The pages have to continue each other from a 2M aligned frame, accessed and dirty are merged
+        uint64_t first = table[0];
+        if((first & ENTRY_FLAG_PRESENT) == 0 || (first & ENTRYL_ADDRESS_MASK) % PAGE_SIZE_2M != 0) goto next_unlock;
+        uint64_t state = 0;
+        for(int i = 0; i < 512; i++) {
+            if((table[i] & ~(ENTRY_FLAG_ACCESSED | ENTRY_FLAG_DIRTY)) != (first & ~(ENTRY_FLAG_ACCESSED | ENTRY_FLAG_DIRTY)) + i * ARCH_PAGE_GRANULARITY) goto next_unlock;
+            state |= table[i] & (ENTRY_FLAG_ACCESSED | ENTRY_FLAG_DIRTY);
+        }
+
+        uint64_t big = (first & ~(ENTRYL_FLAG_PAT | ENTRY_FLAG_ACCESSED | ENTRY_FLAG_DIRTY)) | ENTRYH_FLAG_PS | state;
+        if((first & ENTRYL_FLAG_PAT) != 0) big |= ENTRYH_FLAG_PAT;
+
+        // The table entry may have restricted the pages further
+        big &= ~((ENTRY_FLAG_RW | ENTRY_FLAG_USER) & ~entry);
+        big |= entry & ENTRY_FLAG_NX;
+
+        __atomic_store_n(&current_table[index], big, __ATOMIC_SEQ_CST);
+        table_unlock(table);
+        table_unlock(current_table);
+
+        // Lockless walkers may still be inside the table until the shootdown went around
+        shootdown(address_space, address, PAGE_SIZE_2M);
+        // Tables allocated before the page database are not tracked and never freed, see table_count
+        if(page_flags_test(PAGE(table_address), PAGE_FLAG_PAGETABLE)) pmm_free(&PAGE(table_address)->block);
+        count++;
+        continue;
+
+    next_unlock:
+        table_unlock(table);
+    next:
+        table_unlock(current_table);
     }
-    return true;
+    return count;
 }
 
 void x86_64_ptm_page_fault_handler(arch_interrupt_frame_t *frame) {
     vm_fault_t fault = VM_FAULT_UNKNOWN;
-    if((frame->err_code & PAGEFAULT_FLAG_PRESENT) == 0) fault = VM_FAULT_NOT_PRESENT;
+    if((frame->err_code & PAGEFAULT_FLAG_PRESENT) == 0) {
+        fault = (frame->err_code & PAGEFAULT_FLAG_WRITE) != 0 ? VM_FAULT_NOT_PRESENT_WRITE : VM_FAULT_NOT_PRESENT;
+    } else if((frame->err_code & PAGEFAULT_FLAG_WRITE) != 0) {
+        // A kernel access to user memory outside of stac/clac is a SMAP violation, not a write fault
+        bool smap_violation = !X86_64_INTERRUPT_IS_FROM_USER(frame) && g_x86_64_cpu_smap_support && (frame->rflags & (1 << 18)) == 0 && x86_64_cr2_read() < g_vm_global_address_space->start;
+        if(!smap_violation) fault = VM_FAULT_WRITE;
+    }
 
     if(ARCH_CPU_CURRENT_READ(flags.threaded) && vm_fault(x86_64_cr2_read(), fault)) return;
+
+    uintptr_t fixup = x86_64_exception_fixup(frame->rip);
+    if(!X86_64_INTERRUPT_IS_FROM_USER(frame) && fixup != 0) {
+        frame->rip = fixup;
+        return;
+    }
+
     x86_64_exception_unhandled(frame);
 }
 
 INIT_TARGET(ptm, INIT_STAGE_EARLY, INIT_SCOPE_BSP, INIT_DEPS()) {
-    g_global_address_space.common.lock = SPINLOCK_INIT;
+    g_global_address_space.common.lock = RWLOCK_INIT;
     g_global_address_space.common.regions = vm_create_regions();
+    g_global_address_space.common.lookup_cache = nullptr;
     g_global_address_space.common.start = KERNELSPACE_START;
     g_global_address_space.common.end = KERNELSPACE_END;
     g_global_address_space.pt_top = alloc_page();
-    g_global_address_space.pt_lock = SPINLOCK_INIT;
+    g_global_address_space.pcid_owner = __atomic_fetch_add(&g_next_pcid_owner, 1, __ATOMIC_RELAXED);
+    g_global_address_space.tlb_generation = 0;
 
     uint64_t *pml4 = (uint64_t *) HHDM(g_global_address_space.pt_top);
     for(int i = 256; i < 512; i++) {
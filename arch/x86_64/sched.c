@@ -4,6 +4,7 @@
 #include "arch/interrupt.h"
 #include "arch/page.h"
 #include "arch/ptm.h"
+#include "arch/time.h"
 #include "common/assert.h"
 #include "common/lock/spinlock.h"
 #include "common/log.h"
@@ -30,6 +31,8 @@
 
 #define INTERVAL 100000
 #define KERNEL_STACK_SIZE_PG 16
+#define KERNEL_STACK_SLOT_COUNT 4096
+#define KERNEL_STACK_SLOT_SIZE ((KERNEL_STACK_SIZE_PG + 1) * ARCH_PAGE_GRANULARITY) /* The lowest page of a slot is the guard page */
 
 #define IDLE_TID 0
 #define BOOTSTRAP_TID 1
@@ -59,6 +62,61 @@ extern void x86_64_sched_userspace_init();
 
 static long g_next_tid = BOOTSTRAP_TID + 1;
 
+static spinlock_t g_kernel_stack_lock = SPINLOCK_INIT;
+static uintptr_t g_kernel_stack_area = 0;
+static uint64_t g_kernel_stack_slots[KERNEL_STACK_SLOT_COUNT / 64];
+
+/// Allocate a kernel stack from order 0 pages in the kernel stack area.
+/// The page below every stack stays unmapped, an overflow faults instead of corrupting memory.
+static x86_64_thread_stack_t kernel_stack_alloc() {
+    spinlock_acquire_nodw(&g_kernel_stack_lock);
+    if(g_kernel_stack_area == 0) {
+        // Dynamically backed so the guard pages are never populated, kernel faults are not resolved
+        void *area = vm_map_anon(g_vm_global_address_space, nullptr, KERNEL_STACK_SLOT_COUNT * KERNEL_STACK_SLOT_SIZE, VM_PROT_RW, VM_CACHE_STANDARD, VM_FLAG_DYNAMICALLY_BACKED);
+        if(area == nullptr) panic("SCHED", "failed to reserve kernel stack area");
+        g_kernel_stack_area = (uintptr_t) area;
+    }
+
+    size_t slot = 0;
+    for(; slot < KERNEL_STACK_SLOT_COUNT; slot += 64) {
+        uint64_t free_slots = ~g_kernel_stack_slots[slot / 64];
+        if(free_slots == 0) continue;
+        slot += __builtin_ctzll(free_slots);
+        break;
+    }
+    if(slot >= KERNEL_STACK_SLOT_COUNT) panic("SCHED", "out of kernel stacks");
+    g_kernel_stack_slots[slot / 64] |= (uint64_t) 1 << (slot % 64);
+    spinlock_release_nodw(&g_kernel_stack_lock);
+
+    uintptr_t bottom = g_kernel_stack_area + slot * KERNEL_STACK_SLOT_SIZE + ARCH_PAGE_GRANULARITY;
+    uintptr_t physical_addresses[KERNEL_STACK_SIZE_PG];
+    for(size_t i = 0; i < KERNEL_STACK_SIZE_PG; i++) physical_addresses[i] = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_ZERO)));
+    arch_ptm_map_pages(g_vm_global_address_space, bottom, physical_addresses, KERNEL_STACK_SIZE_PG, VM_PROT_RW, VM_CACHE_STANDARD, VM_PRIVILEGE_KERNEL, true);
+
+    return (x86_64_thread_stack_t) { .base = bottom + KERNEL_STACK_SIZE_PG * ARCH_PAGE_GRANULARITY, .size = KERNEL_STACK_SIZE_PG * ARCH_PAGE_GRANULARITY };
+}
+
+/// Return a kernel stack to the kernel stack area.
+static void kernel_stack_free(x86_64_thread_stack_t stack) {
+    uintptr_t bottom = stack.base - stack.size;
+    ASSERT(bottom >= g_kernel_stack_area + ARCH_PAGE_GRANULARITY);
+
+    // The pages are freed once the whole stack is unmapped and shot down
+    uintptr_t physical_addresses[KERNEL_STACK_SIZE_PG];
+    ASSERT(stack.size == KERNEL_STACK_SIZE_PG * ARCH_PAGE_GRANULARITY);
+    for(size_t i = 0; i < KERNEL_STACK_SIZE_PG; i++) {
+        bool success = arch_ptm_physical(g_vm_global_address_space, bottom + i * ARCH_PAGE_GRANULARITY, &physical_addresses[i]);
+        ASSERT(success);
+    }
+    arch_ptm_unmap(g_vm_global_address_space, bottom, stack.size);
+    for(size_t i = 0; i < KERNEL_STACK_SIZE_PG; i++) pmm_free(&PAGE(physical_addresses[i])->block);
+
+    size_t slot = (bottom - ARCH_PAGE_GRANULARITY - g_kernel_stack_area) / KERNEL_STACK_SLOT_SIZE;
+    spinlock_acquire_nodw(&g_kernel_stack_lock);
+    g_kernel_stack_slots[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+    spinlock_release_nodw(&g_kernel_stack_lock);
+}
+
 /// @warning The prev parameter relies on the fact
 /// that sched_context_switch takes a thread "this" which
 /// will stay in RDI throughout the asm routine and will still
@@ -98,6 +156,10 @@ static void sched_entry([[maybe_unused]] void *data) {
         arch_ptm_load_address_space(g_vm_global_address_space);
     }
 
+    time_t now = arch_time_monotonic();
+    this->common.accounting.cpu_time += now - this->common.switched_in;
+    next->common.switched_in = now;
+
     ARCH_CPU_CURRENT_WRITE(arch.current_thread, next);
     x86_64_tss_set_rsp0(ARCH_CPU_CURRENT_READ(arch.tss), next->kernel_stack.base);
 
@@ -127,7 +189,11 @@ static x86_64_thread_t *create_thread(process_t *proc, size_t id, sched_t *sched
     thread->common.state = THREAD_STATE_READY;
     thread->common.proc = proc;
     thread->common.scheduler = scheduler;
+    thread->common.accounting = (accounting_t) {};
+    thread->common.switched_in = 0;
     thread->common.vm_fault.in_flight = false;
+    thread->common.vm_fault.failed = false;
+    thread->common.vm_fault.type = VM_FAULT_UNKNOWN;
     thread->rsp = rsp;
     thread->kernel_stack = kernel_stack;
     thread->state.fs = 0;
@@ -165,7 +231,7 @@ static x86_64_thread_t *create_thread(process_t *proc, size_t id, sched_t *sched
 }
 
 thread_t *arch_sched_thread_create_kernel(void (*func)()) {
-    x86_64_thread_stack_t kernel_stack = { .base = HHDM(PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_pages(KERNEL_STACK_SIZE_PG, PMM_FLAG_ZERO))) + KERNEL_STACK_SIZE_PG * ARCH_PAGE_GRANULARITY), .size = KERNEL_STACK_SIZE_PG * ARCH_PAGE_GRANULARITY };
+    x86_64_thread_stack_t kernel_stack = kernel_stack_alloc();
 
     init_stack_kernel_t *init_stack = (init_stack_kernel_t *) (kernel_stack.base - sizeof(init_stack_kernel_t));
     init_stack->entry = func;
@@ -176,7 +242,7 @@ thread_t *arch_sched_thread_create_kernel(void (*func)()) {
 }
 
 thread_t *arch_sched_thread_create_user(process_t *proc, uintptr_t ip, uintptr_t sp) {
-    x86_64_thread_stack_t kernel_stack = { .base = HHDM(PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_pages(KERNEL_STACK_SIZE_PG, PMM_FLAG_ZERO))) + KERNEL_STACK_SIZE_PG * ARCH_PAGE_GRANULARITY), .size = KERNEL_STACK_SIZE_PG * ARCH_PAGE_GRANULARITY };
+    x86_64_thread_stack_t kernel_stack = kernel_stack_alloc();
 
     init_stack_user_t *init_stack = (init_stack_user_t *) (kernel_stack.base - sizeof(init_stack_user_t));
     init_stack->entry = (void (*)()) ip;
@@ -187,6 +253,16 @@ thread_t *arch_sched_thread_create_user(process_t *proc, uintptr_t ip, uintptr_t
     return &create_thread(proc, __atomic_fetch_add(&g_next_tid, 1, __ATOMIC_RELAXED), pick_next_scheduler(), kernel_stack, (uintptr_t) init_stack)->common;
 }
 
+void arch_sched_thread_destroy(thread_t *thread) {
+    x86_64_thread_t *arch_thread = X86_64_THREAD(thread);
+
+    // The bootstrap thread runs on the stack the bootloader provided and has no FPU area
+    if(arch_thread->kernel_stack.size != 0) kernel_stack_free(arch_thread->kernel_stack);
+    if(arch_thread->state.fpu_area != nullptr) pmm_free(&PAGE(HHDM_TO_PHYS(arch_thread->state.fpu_area))->block);
+
+    heap_free(arch_thread, sizeof(x86_64_thread_t));
+}
+
 thread_t *arch_sched_thread_current() {
     x86_64_thread_t *thread = ARCH_CPU_CURRENT_THREAD();
     ASSERT(thread != nullptr);
@@ -215,7 +291,7 @@ void arch_sched_context_switch(thread_t *current, thread_t *next) {
 }
 
 INIT_TARGET(idle_thread, INIT_STAGE_LATE, INIT_SCOPE_ALL, INIT_DEPS()) {
-    x86_64_thread_stack_t kernel_stack = { .base = HHDM(PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_pages(KERNEL_STACK_SIZE_PG, PMM_FLAG_ZERO))) + KERNEL_STACK_SIZE_PG * ARCH_PAGE_GRANULARITY), .size = KERNEL_STACK_SIZE_PG * ARCH_PAGE_GRANULARITY };
+    x86_64_thread_stack_t kernel_stack = kernel_stack_alloc();
 
     init_stack_kernel_t *init_stack = (init_stack_kernel_t *) (kernel_stack.base - sizeof(init_stack_kernel_t));
     init_stack->entry = sched_idle;
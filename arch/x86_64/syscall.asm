@@ -3,6 +3,16 @@ extern syscall_debug
 extern syscall_system_info
 extern syscall_mem_anon_allocate
 extern syscall_mem_anon_free
+extern syscall_mem_anon_advise
+extern syscall_mem_shm_create
+extern syscall_mem_shm_resize
+extern syscall_mem_shm_map
+extern syscall_mem_ksm_configure
+extern syscall_mem_ksm_stats
+extern syscall_resource_usage
+extern syscall_mem_framebuffer_map
+extern syscall_mem_wss_configure
+extern syscall_mem_shm_destroy
 extern x86_64_syscall_fs_set
 
 section .rodata
@@ -13,6 +23,16 @@ syscall_table:
     dq syscall_mem_anon_allocate ; 3
     dq syscall_mem_anon_free ; 4
     dq x86_64_syscall_fs_set ; 5
+    dq syscall_mem_anon_advise ; 6
+    dq syscall_mem_shm_create ; 7
+    dq syscall_mem_shm_resize ; 8
+    dq syscall_mem_shm_map ; 9
+    dq syscall_mem_ksm_configure ; 10
+    dq syscall_mem_ksm_stats ; 11
+    dq syscall_resource_usage ; 12
+    dq syscall_mem_framebuffer_map ; 13
+    dq syscall_mem_wss_configure ; 14
+    dq syscall_mem_shm_destroy ; 15
 .length: dq ($ - syscall_table) / 8
 
 section .text
@@ -22,5 +22,5 @@ INIT_TARGET(syscalls, INIT_STAGE_LATE, INIT_SCOPE_ALL, INIT_DEPS()) {
     x86_64_msr_write(X86_64_MSR_EFER, x86_64_msr_read(X86_64_MSR_EFER) | MSR_EFER_SCE);
     x86_64_msr_write(X86_64_MSR_STAR, ((uint64_t) X86_64_GDT_SELECTOR_CODE64_RING0 << 32) | ((uint64_t) (X86_64_GDT_SELECTOR_DATA64_RING3 - 8) << 48));
     x86_64_msr_write(X86_64_MSR_LSTAR, (uint64_t) x86_64_syscall_entry);
-    x86_64_msr_write(X86_64_MSR_SFMASK, x86_64_msr_read(X86_64_MSR_SFMASK) | (1 << 9));
+    x86_64_msr_write(X86_64_MSR_SFMASK, x86_64_msr_read(X86_64_MSR_SFMASK) | (1 << 9) | (1 << 18)); /* RFLAGS.IF, RFLAGS.AC */
 }
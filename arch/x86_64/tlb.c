@@ -10,10 +10,15 @@
 #include "memory/heap.h"
 #include "sys/cpu.h"
 #include "sys/init.h"
+#include "sys/interrupt.h"
+#include "x86_64/cpu/cr.h"
 #include "x86_64/cpu/lapic.h"
 #include "x86_64/interrupt.h"
 
 #define RETRY_AFTER_NS 1'000
+#define FULL_FLUSH_PAGES 64 /* Ranges above this size flush the whole TLB instead of every page */
+
+#define CR4_PGE (1 << 7)
 
 static spinlock_t g_shootdown_lock = SPINLOCK_INIT;
 static uint8_t g_shootdown_vector;
@@ -27,6 +32,15 @@ static size_t g_shootdown_length;
 
 static void invalidate(uintptr_t addr, size_t length) {
     LOG_TRACE("PTM", "invalidating on CPU(%lu) for %#lx - %#lx", X86_64_CPU_CURRENT_READ(sequential_id), addr, addr + length);
+    if(length / ARCH_PAGE_GRANULARITY > FULL_FLUSH_PAGES) {
+        // Toggling global pages drops every entry, including global ones and those of other PCIDs
+        interrupt_state_t previous_state = interrupt_state_mask();
+        uint64_t cr4 = x86_64_cr4_read();
+        x86_64_cr4_write(cr4 & ~(uint64_t) CR4_PGE);
+        x86_64_cr4_write(cr4);
+        interrupt_state_restore(previous_state);
+        return;
+    }
     for(; length > 0; length -= ARCH_PAGE_GRANULARITY, addr += ARCH_PAGE_GRANULARITY) asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
 }
 
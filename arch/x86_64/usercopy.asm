@@ -0,0 +1,27 @@
+extern g_x86_64_cpu_smap_support
+
+section .text
+global arch_usercopy_to
+global arch_usercopy_from
+arch_usercopy_to:
+arch_usercopy_from:
+    mov rcx, rdx
+
+    cmp byte [rel g_x86_64_cpu_smap_support], 0
+    je usercopy_copy
+    stac
+
+usercopy_copy:
+    rep movsb
+
+usercopy_done:
+    cmp byte [rel g_x86_64_cpu_smap_support], 0
+    je .return
+    clac
+
+    .return:
+    mov rax, rcx ; RCX holds the remaining count, also when resumed from a fault
+    ret
+
+section extable progbits alloc noexec nowrite align=8
+    dq usercopy_copy, usercopy_done
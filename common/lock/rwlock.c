@@ -0,0 +1,118 @@
+#include "common/lock/rwlock.h"
+
+#include "arch/cpu.h"
+#include "common/assert.h"
+#include "sys/dw.h"
+
+#include <stdint.h>
+
+#define STATE_WRITER ((uint32_t) 1 << 31)
+#define STATE_WRITER_WAITING ((uint32_t) 1 << 30)
+#define STATE_READERS_MASK (STATE_WRITER_WAITING - 1)
+
+#define DEADLOCK_AT 100'000'000
+
+void rwlock_read_acquire_nodw(rwlock_t *lock) {
+    sched_preempt_inc();
+    dw_status_disable();
+    ASSERT(!ARCH_CPU_CURRENT_READ(flags.in_interrupt_hard));
+    rwlock_read_acquire_raw(lock);
+}
+
+void rwlock_read_release_nodw(rwlock_t *lock) {
+    rwlock_read_release_raw(lock);
+    ASSERT(!ARCH_CPU_CURRENT_READ(flags.in_interrupt_hard));
+    dw_status_enable();
+    sched_preempt_dec();
+}
+
+void rwlock_write_acquire_nodw(rwlock_t *lock) {
+    sched_preempt_inc();
+    dw_status_disable();
+    ASSERT(!ARCH_CPU_CURRENT_READ(flags.in_interrupt_hard));
+    rwlock_write_acquire_raw(lock);
+}
+
+void rwlock_write_release_nodw(rwlock_t *lock) {
+    rwlock_write_release_raw(lock);
+    ASSERT(!ARCH_CPU_CURRENT_READ(flags.in_interrupt_hard));
+    dw_status_enable();
+    sched_preempt_dec();
+}
+
+bool rwlock_read_try_acquire_nodw(rwlock_t *lock) {
+    sched_preempt_inc();
+    dw_status_disable();
+    ASSERT(!ARCH_CPU_CURRENT_READ(flags.in_interrupt_hard));
+
+    uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if((state & (STATE_WRITER | STATE_WRITER_WAITING)) == 0 && (state & STATE_READERS_MASK) != STATE_READERS_MASK) {
+        if(__atomic_compare_exchange_n(&lock->state, &state, state + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+    }
+
+    dw_status_enable();
+    sched_preempt_dec();
+    return false;
+}
+
+bool rwlock_write_try_acquire_nodw(rwlock_t *lock) {
+    sched_preempt_inc();
+    dw_status_disable();
+    ASSERT(!ARCH_CPU_CURRENT_READ(flags.in_interrupt_hard));
+
+    uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if((state & ~STATE_WRITER_WAITING) == 0 && __atomic_compare_exchange_n(&lock->state, &state, STATE_WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+
+    dw_status_enable();
+    sched_preempt_dec();
+    return false;
+}
+
+void rwlock_read_acquire_raw(rwlock_t *lock) {
+#ifdef __ENV_DEBUG
+    uint64_t dead = 0;
+#endif
+    while(true) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if((state & (STATE_WRITER | STATE_WRITER_WAITING)) == 0) {
+            ASSERT((state & STATE_READERS_MASK) != STATE_READERS_MASK);
+            if(__atomic_compare_exchange_n(&lock->state, &state, state + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+            continue;
+        }
+
+        arch_cpu_relax();
+#ifdef __ENV_DEBUG
+        ASSERT(dead++ != DEADLOCK_AT);
+#endif
+    }
+}
+
+void rwlock_read_release_raw(rwlock_t *lock) {
+    ASSERT((__atomic_load_n(&lock->state, __ATOMIC_RELAXED) & STATE_READERS_MASK) != 0);
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+void rwlock_write_acquire_raw(rwlock_t *lock) {
+#ifdef __ENV_DEBUG
+    uint64_t dead = 0;
+#endif
+    while(true) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if((state & ~STATE_WRITER_WAITING) == 0) {
+            if(__atomic_compare_exchange_n(&lock->state, &state, STATE_WRITER, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+            continue;
+        }
+
+        if((state & STATE_WRITER_WAITING) == 0) __atomic_fetch_or(&lock->state, STATE_WRITER_WAITING, __ATOMIC_RELAXED);
+
+        arch_cpu_relax();
+#ifdef __ENV_DEBUG
+        ASSERT(dead++ != DEADLOCK_AT);
+#endif
+    }
+}
+
+void rwlock_write_release_raw(rwlock_t *lock) {
+    ASSERT((__atomic_load_n(&lock->state, __ATOMIC_RELAXED) & STATE_WRITER) != 0);
+    __atomic_fetch_and(&lock->state, ~STATE_WRITER, __ATOMIC_RELEASE);
+}
@@ -112,6 +112,8 @@ static pcie_segment_t *g_segments;
 spinlock_t g_pci_devices_lock = SPINLOCK_INIT;
 list_t g_pci_devices = LIST_INIT;
 
+static list_t g_drivers = LIST_INIT;
+
 static pci_device_t *(*g_create_device)(uint16_t segment, uint8_t bus, uint8_t slot, uint8_t func);
 static void (*g_free_device)(pci_device_t *device);
 
@@ -258,15 +260,24 @@ static void enumerate_function(uint16_t segment, uint8_t bus, uint8_t slot, uint
         return;
     }
 
-    // TODO: register devices
-    // dev_driver_t *driver;
-    // DEV_FOREACH(driver) {
-    //     if(driver->type != DEV_DRIVER_PCI) continue;
-    //     if((driver->pci->match & PCI_DRIVER_MATCH_CLASS) && driver->pci->class != class) continue;
-    //     if((driver->pci->match & PCI_DRIVER_MATCH_SUBCLASS) && driver->pci->subclass != sub_class) continue;
-    //     if((driver->pci->match & PCI_DRIVER_MATCH_FUNCTION) && driver->pci->prog_if != prog_if) continue;
-    //     driver->pci->initialize(device);
-    // }
+    uint16_t device_id = readw(device, offsetof(pci_device_header_t, device_id));
+    LIST_ITERATE(&g_drivers, node) {
+        pci_driver_t *driver = CONTAINER_OF(node, pci_driver_t, list_node);
+        if((driver->match & PCI_DRIVER_MATCH_CLASS) && driver->class != class) continue;
+        if((driver->match & PCI_DRIVER_MATCH_SUBCLASS) && driver->subclass != sub_class) continue;
+        if((driver->match & PCI_DRIVER_MATCH_FUNCTION) && driver->prog_if != prog_if) continue;
+        if((driver->match & PCI_DRIVER_MATCH_VENDOR) && driver->vendor_id != vendor_id) continue;
+        if(driver->match & PCI_DRIVER_MATCH_DEVICE) {
+            bool matched = false;
+            for(size_t i = 0; i < sizeof(driver->device_ids) / sizeof(uint16_t); i++) {
+                if(driver->device_ids[i] != 0 && driver->device_ids[i] == device_id) matched = true;
+            }
+            if(!matched) continue;
+        }
+
+        log(LOG_LEVEL_INFO, "PCI", "Initializing driver `%s`", driver->name);
+        driver->initialize(device);
+    }
 }
 
 static void enumerate_bus(uint16_t segment, uint8_t bus) {
@@ -316,6 +327,10 @@ void pci_config_write_double(pci_device_t *device, uint8_t offset, uint32_t data
     writed(device, offset, data);
 }
 
+void pci_driver_register(pci_driver_t *driver) {
+    list_push_back(&g_drivers, &driver->list_node);
+}
+
 pci_bar_t *pci_config_read_bar(pci_device_t *device, uint8_t index) {
     if(index > 5) return nullptr;
 
@@ -0,0 +1,219 @@
+#include "dev/virtio.h"
+
+#include "arch/mmio.h"
+#include "arch/page.h"
+#include "common/assert.h"
+#include "common/log.h"
+#include "lib/math.h"
+#include "memory/heap.h"
+#include "memory/mmio.h"
+
+#define PCI_REG_COMMAND 0x4
+#define PCI_REG_STATUS 0x6
+#define PCI_REG_CAPABILITIES 0x34
+#define PCI_COMMAND_MEMORY (1 << 1)
+#define PCI_COMMAND_BUSMASTER (1 << 2)
+#define PCI_STATUS_CAPABILITIES (1 << 4)
+
+#define PCI_CAP_VENDOR 0x9
+
+#define CAP_TYPE_COMMON 1
+#define CAP_TYPE_NOTIFY 2
+#define CAP_TYPE_DEVICE 4
+
+#define CAP_OFFSET_TYPE 3
+#define CAP_OFFSET_BAR 4
+#define CAP_OFFSET_OFFSET 8
+#define CAP_OFFSET_LENGTH 12
+#define CAP_OFFSET_NOTIFY_MULTIPLIER 16
+
+#define COMMON_DEVICE_FEATURE_SELECT 0
+#define COMMON_DEVICE_FEATURE 4
+#define COMMON_DRIVER_FEATURE_SELECT 8
+#define COMMON_DRIVER_FEATURE 12
+#define COMMON_DEVICE_STATUS 20
+#define COMMON_QUEUE_SELECT 22
+#define COMMON_QUEUE_SIZE 24
+#define COMMON_QUEUE_ENABLE 28
+#define COMMON_QUEUE_NOTIFY_OFF 30
+#define COMMON_QUEUE_DESC 32
+#define COMMON_QUEUE_DRIVER 40
+#define COMMON_QUEUE_DEVICE 48
+
+#define STATUS_ACKNOWLEDGE (1 << 0)
+#define STATUS_DRIVER (1 << 1)
+#define STATUS_DRIVER_OK (1 << 2)
+#define STATUS_FEATURES_OK (1 << 3)
+#define STATUS_FAILED (1 << 7)
+
+#define DESCRIPTOR_FLAG_NEXT (1 << 0)
+#define DESCRIPTOR_FLAG_WRITE (1 << 1)
+
+static void write64(void *address, uint64_t value) {
+    arch_mmio_write32(address, (uint32_t) value);
+    arch_mmio_write32(address + sizeof(uint32_t), (uint32_t) (value >> 32));
+}
+
+/// Map the structure a virtio capability points at.
+static void *capability_map(pci_device_t *pci_device, uint8_t capability) {
+    pci_bar_t *bar = pci_config_read_bar(pci_device, pci_config_read_byte(pci_device, capability + CAP_OFFSET_BAR));
+    if(bar == nullptr) return nullptr;
+    if(bar->iospace) {
+        heap_free(bar, sizeof(pci_bar_t));
+        return nullptr;
+    }
+
+    uint32_t offset = pci_config_read_double(pci_device, capability + CAP_OFFSET_OFFSET);
+    uint32_t length = pci_config_read_double(pci_device, capability + CAP_OFFSET_LENGTH);
+    void *address = mmio_map(bar->address + offset, length);
+    heap_free(bar, sizeof(pci_bar_t));
+    return address;
+}
+
+bool virtio_device_initialize(pci_device_t *pci_device, uint64_t features, PARAM_OUT(virtio_device_t *) device) {
+    device->pci_device = pci_device;
+    device->common_config = nullptr;
+    device->device_config = nullptr;
+    device->notify_base = nullptr;
+
+    // Modern devices describe their structures in vendor capabilities, the first of every type is used
+    if((pci_config_read_word(pci_device, PCI_REG_STATUS) & PCI_STATUS_CAPABILITIES) == 0) return false;
+    for(uint8_t capability = pci_config_read_byte(pci_device, PCI_REG_CAPABILITIES) & ~0b11; capability != 0; capability = pci_config_read_byte(pci_device, capability + 1) & ~0b11) {
+        if(pci_config_read_byte(pci_device, capability) != PCI_CAP_VENDOR) continue;
+        switch(pci_config_read_byte(pci_device, capability + CAP_OFFSET_TYPE)) {
+            case CAP_TYPE_COMMON:
+                if(device->common_config == nullptr) device->common_config = capability_map(pci_device, capability);
+                break;
+            case CAP_TYPE_NOTIFY:
+                if(device->notify_base != nullptr) break;
+                device->notify_base = capability_map(pci_device, capability);
+                device->notify_multiplier = pci_config_read_double(pci_device, capability + CAP_OFFSET_NOTIFY_MULTIPLIER);
+                break;
+            case CAP_TYPE_DEVICE:
+                if(device->device_config == nullptr) device->device_config = capability_map(pci_device, capability);
+                break;
+        }
+    }
+    if(device->common_config == nullptr || device->notify_base == nullptr) {
+        log(LOG_LEVEL_WARN, "VIRTIO", "device is missing modern capabilities");
+        return false;
+    }
+
+    pci_config_write_word(pci_device, PCI_REG_COMMAND, pci_config_read_word(pci_device, PCI_REG_COMMAND) | PCI_COMMAND_MEMORY | PCI_COMMAND_BUSMASTER);
+
+    void *common = device->common_config;
+    arch_mmio_write8(common + COMMON_DEVICE_STATUS, 0);
+    while(arch_mmio_read8(common + COMMON_DEVICE_STATUS) != 0);
+    arch_mmio_write8(common + COMMON_DEVICE_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+
+    arch_mmio_write32(common + COMMON_DEVICE_FEATURE_SELECT, 0);
+    uint64_t device_features = arch_mmio_read32(common + COMMON_DEVICE_FEATURE);
+    arch_mmio_write32(common + COMMON_DEVICE_FEATURE_SELECT, 1);
+    device_features |= (uint64_t) arch_mmio_read32(common + COMMON_DEVICE_FEATURE) << 32;
+
+    device->features = device_features & (features | VIRTIO_F_VERSION_1);
+    arch_mmio_write32(common + COMMON_DRIVER_FEATURE_SELECT, 0);
+    arch_mmio_write32(common + COMMON_DRIVER_FEATURE, (uint32_t) device->features);
+    arch_mmio_write32(common + COMMON_DRIVER_FEATURE_SELECT, 1);
+    arch_mmio_write32(common + COMMON_DRIVER_FEATURE, (uint32_t) (device->features >> 32));
+
+    arch_mmio_write8(common + COMMON_DEVICE_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK);
+    if((device->features & VIRTIO_F_VERSION_1) == 0 || (arch_mmio_read8(common + COMMON_DEVICE_STATUS) & STATUS_FEATURES_OK) == 0) {
+        log(LOG_LEVEL_WARN, "VIRTIO", "device rejected features %#lx", device->features);
+        arch_mmio_write8(common + COMMON_DEVICE_STATUS, STATUS_FAILED);
+        return false;
+    }
+    return true;
+}
+
+void virtio_device_ready(virtio_device_t *device) {
+    arch_mmio_write8(device->common_config + COMMON_DEVICE_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK | STATUS_DRIVER_OK);
+}
+
+uint32_t virtio_config_read32(virtio_device_t *device, size_t offset) {
+    ASSERT(device->device_config != nullptr);
+    return arch_mmio_read32(device->device_config + offset);
+}
+
+void virtio_config_write32(virtio_device_t *device, size_t offset, uint32_t value) {
+    ASSERT(device->device_config != nullptr);
+    arch_mmio_write32(device->device_config + offset, value);
+}
+
+bool virtio_queue_initialize(virtio_device_t *device, uint16_t index, PARAM_OUT(virtio_queue_t *) queue) {
+    void *common = device->common_config;
+    arch_mmio_write16(common + COMMON_QUEUE_SELECT, index);
+
+    uint16_t size = arch_mmio_read16(common + COMMON_QUEUE_SIZE);
+    if(size == 0) return false;
+    size = MATH_MIN(size, VIRTIO_QUEUE_MAX_SIZE);
+    arch_mmio_write16(common + COMMON_QUEUE_SIZE, size);
+
+    // Descriptors, available ring and used ring share one buffer
+    size_t available_offset = sizeof(virtio_descriptor_t) * size;
+    size_t used_offset = MATH_CEIL(available_offset + sizeof(virtio_available_t) + sizeof(uint16_t) * (size + 1), (size_t) 4);
+    size_t used_size = sizeof(virtio_used_t) + sizeof(((virtio_used_t *) nullptr)->ring[0]) * size + sizeof(uint16_t);
+    if(!dma_alloc_coherent(used_offset + used_size, DMA_MASK_64BIT, VM_CACHE_STANDARD, &queue->buffer)) return false;
+
+    queue->index = index;
+    queue->size = size;
+    queue->descriptors = queue->buffer.virtual_address;
+    queue->available = queue->buffer.virtual_address + available_offset;
+    queue->used = queue->buffer.virtual_address + used_offset;
+    queue->free_head = 0;
+    queue->free_count = size;
+    queue->last_used_index = 0;
+    for(uint16_t i = 0; i < size; i++) queue->descriptors[i].next = i + 1;
+
+    write64(common + COMMON_QUEUE_DESC, queue->buffer.device_address);
+    write64(common + COMMON_QUEUE_DRIVER, queue->buffer.device_address + available_offset);
+    write64(common + COMMON_QUEUE_DEVICE, queue->buffer.device_address + used_offset);
+    queue->notify = device->notify_base + arch_mmio_read16(common + COMMON_QUEUE_NOTIFY_OFF) * device->notify_multiplier;
+    arch_mmio_write16(common + COMMON_QUEUE_ENABLE, 1);
+    return true;
+}
+
+bool virtio_queue_submit(virtio_queue_t *queue, virtio_buffer_t *buffers, size_t count) {
+    ASSERT(count > 0);
+    if(queue->free_count < count) return false;
+
+    uint16_t head = queue->free_head;
+    uint16_t index = head;
+    for(size_t i = 0; i < count; i++) {
+        virtio_descriptor_t *descriptor = &queue->descriptors[index];
+        descriptor->address = buffers[i].address;
+        descriptor->length = buffers[i].length;
+        descriptor->flags = (buffers[i].device_writable ? DESCRIPTOR_FLAG_WRITE : 0) | (i + 1 < count ? DESCRIPTOR_FLAG_NEXT : 0);
+        if(i + 1 < count) index = descriptor->next;
+    }
+    queue->free_head = queue->descriptors[index].next;
+    queue->free_count -= count;
+
+    // The ring entry has to be visible before the index that publishes it
+    uint16_t available_index = queue->available->index;
+    queue->available->ring[available_index % queue->size] = head;
+    __atomic_store_n(&queue->available->index, available_index + 1, __ATOMIC_RELEASE);
+
+    arch_mmio_write16(queue->notify, queue->index);
+    return true;
+}
+
+bool virtio_queue_poll(virtio_queue_t *queue, PARAM_OUT(uint32_t *) length) {
+    if(__atomic_load_n(&queue->used->index, __ATOMIC_ACQUIRE) == queue->last_used_index) return false;
+
+    uint16_t head = (uint16_t) queue->used->ring[queue->last_used_index % queue->size].id;
+    if(length != nullptr) *length = queue->used->ring[queue->last_used_index % queue->size].length;
+    queue->last_used_index++;
+
+    // Return the chain to the free list
+    uint16_t tail = head;
+    uint16_t count = 1;
+    while(queue->descriptors[tail].flags & DESCRIPTOR_FLAG_NEXT) {
+        tail = queue->descriptors[tail].next;
+        count++;
+    }
+    queue->descriptors[tail].next = queue->free_head;
+    queue->free_head = head;
+    queue->free_count += count;
+    return true;
+}
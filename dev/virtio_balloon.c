@@ -0,0 +1,204 @@
+#include "arch/page.h"
+#include "arch/sched.h"
+#include "common/assert.h"
+#include "common/log.h"
+#include "dev/pci.h"
+#include "dev/virtio.h"
+#include "lib/container.h"
+#include "lib/list.h"
+#include "lib/math.h"
+#include "memory/dma.h"
+#include "memory/heap.h"
+#include "memory/page.h"
+#include "memory/pmm.h"
+#include "sched/sched.h"
+#include "sys/init.h"
+
+/// The balloon thread polls the target size the host sets in the device config and inflates or
+/// deflates towards it in batches. While idle it reports max order free blocks to the host, the
+/// blocks are taken off the free lists until the host has discarded their contents.
+/// OPTIMIZE: config change interrupts would make the polling unnecessary
+/// OPTIMIZE: blocks that were reported and not allocated since are reported again
+
+#define DEVICE_ID_TRANSITIONAL 0x1002
+#define DEVICE_ID_MODERN 0x1045
+
+#define FEATURE_STATS_VQ (1 << 1)
+#define FEATURE_PAGE_REPORTING (1 << 5)
+
+#define CONFIG_NUM_PAGES 0
+#define CONFIG_ACTUAL 4
+
+#define QUEUE_INFLATE 0
+#define QUEUE_DEFLATE 1
+
+#define PFN_SHIFT 12
+#define PFN_BATCH 256
+#define REPORT_BATCH 16
+
+#define THREAD_INTERVAL (100 * (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND))
+#define POLL_INTERVAL (1 * (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND))
+#define REPORT_ROUNDS 20
+
+static_assert(ARCH_PAGE_GRANULARITY == (1 << PFN_SHIFT), "balloon pages are the size of a page");
+
+typedef struct {
+    virtio_device_t device;
+    virtio_queue_t inflate_queue;
+    virtio_queue_t deflate_queue;
+    virtio_queue_t reporting_queue;
+    bool reporting;
+
+    dma_buffer_t pfns;
+    list_t pages;
+    uint32_t actual;
+} balloon_t;
+
+static balloon_t *g_balloon = nullptr;
+
+/// Submit a request and wait for the device to complete it.
+static void transfer(virtio_queue_t *queue, virtio_buffer_t *buffers, size_t count) {
+    bool submitted = virtio_queue_submit(queue, buffers, count);
+    ASSERT(submitted);
+    while(!virtio_queue_poll(queue, nullptr)) sched_sleep(POLL_INTERVAL);
+}
+
+/// Hand pages to the host, stops early if the allocator runs low.
+static void inflate(balloon_t *balloon, size_t page_count) {
+    uint32_t *pfns = balloon->pfns.virtual_address;
+
+    size_t count = 0;
+    for(; count < page_count; count++) {
+        if(__atomic_load_n(&g_pmm_zone_normal.free_page_count, __ATOMIC_RELAXED) <= g_pmm_zone_normal.watermarks.low) break;
+
+        pmm_block_t *block = pmm_alloc_page(PMM_FLAG_NO_RECLAIM);
+        if(block == nullptr) break;
+
+        pfns[count] = (uint32_t) (PAGE_PADDR(PAGE_FROM_BLOCK(block)) >> PFN_SHIFT);
+        list_push(&balloon->pages, &block->list_node);
+    }
+    if(count == 0) return;
+
+    virtio_buffer_t buffer = { .address = balloon->pfns.device_address, .length = count * sizeof(uint32_t), .device_writable = false };
+    transfer(&balloon->inflate_queue, &buffer, 1);
+
+    balloon->actual += count;
+    virtio_config_write32(&balloon->device, CONFIG_ACTUAL, balloon->actual);
+}
+
+/// Take pages back from the host.
+static void deflate(balloon_t *balloon, size_t page_count) {
+    uint32_t *pfns = balloon->pfns.virtual_address;
+
+    list_t pages = LIST_INIT;
+    size_t count = 0;
+    for(; count < page_count && balloon->pages.count > 0; count++) {
+        pmm_block_t *block = CONTAINER_OF(list_pop(&balloon->pages), pmm_block_t, list_node);
+        pfns[count] = (uint32_t) (PAGE_PADDR(PAGE_FROM_BLOCK(block)) >> PFN_SHIFT);
+        list_push(&pages, &block->list_node);
+    }
+    if(count == 0) return;
+
+    // The host is told before the pages are used again, whether or not it asked for that
+    virtio_buffer_t buffer = { .address = balloon->pfns.device_address, .length = count * sizeof(uint32_t), .device_writable = false };
+    transfer(&balloon->deflate_queue, &buffer, 1);
+
+    while(pages.count > 0) pmm_free(CONTAINER_OF(list_pop(&pages), pmm_block_t, list_node));
+
+    balloon->actual -= count;
+    virtio_config_write32(&balloon->device, CONFIG_ACTUAL, balloon->actual);
+}
+
+/// Report free max order blocks, memory above the high watermark is fair game.
+static void report(balloon_t *balloon) {
+    size_t block_page_count = PMM_ORDER_TO_PAGECOUNT(PMM_MAX_ORDER);
+
+    pmm_block_t *blocks[REPORT_BATCH];
+    virtio_buffer_t buffers[REPORT_BATCH];
+    size_t count = 0;
+    for(; count < REPORT_BATCH; count++) {
+        if(__atomic_load_n(&g_pmm_zone_normal.free_page_count, __ATOMIC_RELAXED) < g_pmm_zone_normal.watermarks.high + block_page_count) break;
+
+        pmm_block_t *block = pmm_alloc(PMM_MAX_ORDER, PMM_FLAG_NO_RECLAIM);
+        if(block == nullptr) break;
+
+        blocks[count] = block;
+        buffers[count] = (virtio_buffer_t) { .address = PAGE_PADDR(PAGE_FROM_BLOCK(block)), .length = block_page_count * ARCH_PAGE_GRANULARITY, .device_writable = true };
+    }
+    if(count == 0) return;
+
+    transfer(&balloon->reporting_queue, buffers, count);
+    for(size_t i = 0; i < count; i++) pmm_free(blocks[i]);
+
+    LOG_TRACE("BALLOON", "reported %lu free pages", count * block_page_count);
+}
+
+static void balloon_thread() {
+    balloon_t *balloon = g_balloon;
+
+    size_t idle_rounds = 0;
+    while(true) {
+        uint32_t target = virtio_config_read32(&balloon->device, CONFIG_NUM_PAGES);
+        if(target > balloon->actual) {
+            inflate(balloon, MATH_MIN((size_t) (target - balloon->actual), (size_t) PFN_BATCH));
+            idle_rounds = 0;
+        } else if(target < balloon->actual) {
+            deflate(balloon, MATH_MIN((size_t) (balloon->actual - target), (size_t) PFN_BATCH));
+            idle_rounds = 0;
+        } else if(balloon->reporting && ++idle_rounds >= REPORT_ROUNDS) {
+            report(balloon);
+            idle_rounds = 0;
+        }
+
+        sched_sleep(THREAD_INTERVAL);
+    }
+}
+
+static void balloon_initialize(pci_device_t *pci_device) {
+    if(g_balloon != nullptr) {
+        log(LOG_LEVEL_WARN, "BALLOON", "only a single balloon device is supported");
+        return;
+    }
+
+    balloon_t *balloon = heap_alloc(sizeof(balloon_t));
+    balloon->pages = LIST_INIT;
+    balloon->actual = 0;
+
+    // The statsq is left unused, it is only negotiated so the reporting queue sits at the index QEMU and Linux expect
+    if(!virtio_device_initialize(pci_device, FEATURE_STATS_VQ | FEATURE_PAGE_REPORTING, &balloon->device)) goto fail;
+    if(!virtio_queue_initialize(&balloon->device, QUEUE_INFLATE, &balloon->inflate_queue)) goto fail;
+    if(!virtio_queue_initialize(&balloon->device, QUEUE_DEFLATE, &balloon->deflate_queue)) goto fail;
+
+    balloon->reporting = (balloon->device.features & FEATURE_PAGE_REPORTING) != 0;
+    if(balloon->reporting) {
+        uint16_t index = (balloon->device.features & FEATURE_STATS_VQ) != 0 ? 3 : 2;
+        balloon->reporting = virtio_queue_initialize(&balloon->device, index, &balloon->reporting_queue);
+    }
+
+    if(!dma_alloc_coherent(PFN_BATCH * sizeof(uint32_t), DMA_MASK_64BIT, VM_CACHE_STANDARD, &balloon->pfns)) goto fail;
+
+    virtio_device_ready(&balloon->device);
+    virtio_config_write32(&balloon->device, CONFIG_ACTUAL, 0);
+
+    g_balloon = balloon;
+    sched_thread_schedule(arch_sched_thread_create_kernel(balloon_thread));
+
+    log(LOG_LEVEL_INFO, "BALLOON", "initialized (reporting: %u)", balloon->reporting);
+    return;
+
+fail:
+    log(LOG_LEVEL_WARN, "BALLOON", "failed to initialize device");
+    heap_free(balloon, sizeof(balloon_t));
+}
+
+static pci_driver_t g_driver = {
+    .name = "virtio-balloon",
+    .initialize = balloon_initialize,
+    .match = PCI_DRIVER_MATCH_VENDOR | PCI_DRIVER_MATCH_DEVICE,
+    .vendor_id = VIRTIO_PCI_VENDOR_ID,
+    .device_ids = { DEVICE_ID_TRANSITIONAL, DEVICE_ID_MODERN },
+};
+
+INIT_TARGET(virtio_balloon, INIT_STAGE_BEFORE_DEV, INIT_SCOPE_BSP, INIT_DEPS()) {
+    pci_driver_register(&g_driver);
+}
@@ -1,9 +1,11 @@
 #include "fs/rdsk.h"
 
+#include "arch/page.h"
 #include "fs/vfs.h"
 #include "lib/mem.h"
 #include "lib/string.h"
 #include "memory/heap.h"
+#include "memory/hhdm.h"
 
 #include <stdint.h>
 
@@ -233,6 +235,18 @@ static vfs_result_t rdsk_truncate([[maybe_unused]] vfs_node_t *node, [[maybe_unu
     return VFS_RESULT_ERR_READ_ONLY_FS;
 }
 
+static vfs_result_t rdsk_page(vfs_node_t *node, size_t offset, PARAM_OUT(uintptr_t *) physical_address) {
+    if(node->type != VFS_NODE_TYPE_FILE) return VFS_RESULT_ERR_NOT_FILE;
+    if(offset % ARCH_PAGE_GRANULARITY != 0 || offset >= FILE(node)->size || FILE(node)->size - offset < ARCH_PAGE_GRANULARITY) return VFS_RESULT_ERR_UNSUPPORTED;
+
+    // The image is loaded as a module, physically contiguous and reachable through the HHDM
+    uintptr_t address = HHDM_TO_PHYS((uintptr_t) INFO(node->vfs)->header + FILE(node)->data_offset + offset);
+    if(address % ARCH_PAGE_GRANULARITY != 0) return VFS_RESULT_ERR_UNSUPPORTED;
+
+    *physical_address = address;
+    return VFS_RESULT_OK;
+}
+
 static vfs_result_t rdsk_mount(vfs_t *vfs) {
     rdsk_header_t *header = (rdsk_header_t *) vfs->private_data;
     if(header->revision > SUPPORTED_REVISION) return VFS_RESULT_ERR_UNSUPPORTED;
@@ -255,6 +269,6 @@ static vfs_result_t rdsk_root(vfs_t *vfs, PARAM_OUT(vfs_node_t **) root_node) {
     return VFS_RESULT_OK;
 }
 
-static vfs_node_ops_t g_node_ops = { .attr = rdsk_attr, .name = rdsk_name, .lookup = rdsk_lookup, .rw = rdsk_rw, .mkdir = rdsk_mkdir, .readdir = rdsk_readdir, .mkfile = rdsk_mkfile, .truncate = rdsk_truncate };
+static vfs_node_ops_t g_node_ops = { .attr = rdsk_attr, .name = rdsk_name, .lookup = rdsk_lookup, .rw = rdsk_rw, .mkdir = rdsk_mkdir, .readdir = rdsk_readdir, .mkfile = rdsk_mkfile, .truncate = rdsk_truncate, .page = rdsk_page };
 
 vfs_ops_t g_rdsk_ops = { .mount = rdsk_mount, .root_node = rdsk_root };
@@ -1,10 +1,16 @@
 #include "fs/tmpfs.h"
 
+#include "arch/page.h"
 #include "common/assert.h"
+#include "common/lock/spinlock.h"
 #include "fs/vfs.h"
+#include "lib/math.h"
 #include "lib/mem.h"
 #include "lib/string.h"
 #include "memory/heap.h"
+#include "memory/hhdm.h"
+#include "memory/page.h"
+#include "memory/pmm.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -35,8 +41,10 @@ struct tmpfs_node {
 };
 
 struct tmpfs_file {
-    void *base;
+    spinlock_t lock;
     size_t size;
+    size_t page_count;
+    uintptr_t *pages; /* Physical addresses of the file pages, 0 for pages that were never written */
 };
 
 static vfs_node_ops_t g_tmpfs_node_ops;
@@ -57,8 +65,10 @@ static tmpfs_node_t *make_tmpfs_node(tmpfs_node_t *parent, vfs_t *vfs, bool is_d
         tmpfs_node->dir.children = nullptr;
     } else {
         tmpfs_node->file = heap_alloc(sizeof(tmpfs_file_t));
+        tmpfs_node->file->lock = SPINLOCK_INIT;
         tmpfs_node->file->size = 0;
-        tmpfs_node->file->base = nullptr;
+        tmpfs_node->file->page_count = 0;
+        tmpfs_node->file->pages = nullptr;
     }
 
     vfs_node_t *vnode = heap_alloc(sizeof(vfs_node_t));
@@ -82,28 +92,64 @@ static tmpfs_node_t *dir_find(tmpfs_node_t *dir_node, const char *name) {
     return nullptr;
 }
 
+/// Grow the page table of a file to hold at least page_count pages.
+/// @warning Assumes file lock is acquired.
+static void file_reserve(tmpfs_file_t *file, size_t page_count) {
+    ASSERT(page_count <= TMPFS_MAX_FILE_SIZE / ARCH_PAGE_GRANULARITY);
+    if(page_count <= file->page_count) return;
+    file->pages = heap_reallocarray(file->pages, sizeof(uintptr_t), file->page_count, page_count);
+    mem_set(&file->pages[file->page_count], 0, (page_count - file->page_count) * sizeof(uintptr_t));
+    file->page_count = page_count;
+}
+
+/// Get the page at index, allocating it if it was never written.
+/// @warning Assumes file lock is acquired.
+static uintptr_t file_page(tmpfs_file_t *file, size_t index) {
+    ASSERT(index < file->page_count);
+    if(file->pages[index] == 0) file->pages[index] = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_ZERO)));
+    return file->pages[index];
+}
+
 static vfs_result_t tmpfs_rw(vfs_node_t *node, vfs_rw_t *rw, PARAM_OUT(size_t *) rw_count) {
     if(node->type != VFS_NODE_TYPE_FILE) return VFS_RESULT_ERR_NOT_FILE;
 
     tmpfs_file_t *file = TMPFS_NODE(node)->file;
     *rw_count = 0;
+    if(rw->rw == VFS_RW_WRITE && (rw->offset > TMPFS_MAX_FILE_SIZE || rw->size > TMPFS_MAX_FILE_SIZE - rw->offset)) return VFS_RESULT_ERR_TOO_LARGE;
+
+    spinlock_acquire_nodw(&file->lock);
+    size_t count = rw->size;
     switch(rw->rw) {
         case VFS_RW_READ:
-            if(rw->offset >= file->size) return VFS_RESULT_OK;
-            size_t count = file->size - rw->offset;
-            if(count > rw->size) count = rw->size;
-            mem_copy(rw->buffer, file->base + rw->offset, count);
-            *rw_count = count;
+            count = rw->offset < file->size ? MATH_MIN(count, file->size - rw->offset) : 0;
             break;
         case VFS_RW_WRITE:
-            if(rw->offset + rw->size > file->size) {
-                file->base = heap_realloc(file->base, file->size, rw->offset + rw->size);
-                file->size = rw->offset + rw->size;
+            if(rw->offset + count > file->size) {
+                file_reserve(file, MATH_DIV_CEIL(rw->offset + count, ARCH_PAGE_GRANULARITY));
+                file->size = rw->offset + count;
             }
-            mem_copy(file->base + rw->offset, rw->buffer, rw->size);
-            *rw_count = rw->size;
             break;
     }
+
+    for(size_t i = 0; i < count;) {
+        size_t index = (rw->offset + i) / ARCH_PAGE_GRANULARITY;
+        size_t page_offset = (rw->offset + i) % ARCH_PAGE_GRANULARITY;
+        size_t chunk = MATH_MIN(count - i, (size_t) ARCH_PAGE_GRANULARITY - page_offset);
+
+        switch(rw->rw) {
+            case VFS_RW_READ:
+                if(file->pages[index] == 0) {
+                    mem_set(rw->buffer + i, 0, chunk);
+                } else {
+                    mem_copy(rw->buffer + i, (void *) HHDM(file->pages[index] + page_offset), chunk);
+                }
+                break;
+            case VFS_RW_WRITE: mem_copy((void *) HHDM(file_page(file, index) + page_offset), rw->buffer + i, chunk); break;
+        }
+        i += chunk;
+    }
+    *rw_count = count;
+    spinlock_release_nodw(&file->lock);
     return VFS_RESULT_OK;
 }
 
@@ -172,18 +218,49 @@ static vfs_result_t tmpfs_mkfile(vfs_node_t *node, const char *name, PARAM_OUT(v
 
 static vfs_result_t tmpfs_truncate(vfs_node_t *node, size_t length) {
     if(node->type != VFS_NODE_TYPE_FILE) return VFS_RESULT_ERR_NOT_FILE;
+    if(length > TMPFS_MAX_FILE_SIZE) return VFS_RESULT_ERR_TOO_LARGE;
 
     tmpfs_file_t *file = TMPFS_NODE(node)->file;
-    void *buffer = nullptr;
-    if(length > 0) {
-        buffer = heap_alloc(length);
-        mem_set(buffer, 0, length);
-        if(file->base != nullptr) mem_copy(buffer, file->base, file->size < length ? file->size : length);
-    }
+    spinlock_acquire_nodw(&file->lock);
+    if(length < file->size) {
+        // Mappings hold their own reference, a page still mapped is freed once it is unmapped
+        size_t page_count = MATH_DIV_CEIL(length, ARCH_PAGE_GRANULARITY);
+        for(size_t i = page_count; i < file->page_count; i++) {
+            if(file->pages[i] == 0) continue;
+            page_put(PAGE(file->pages[i]));
+            file->pages[i] = 0;
+        }
+
+        // Data past the end of the file has to read back as zero when it grows again
+        size_t tail = length % ARCH_PAGE_GRANULARITY;
+        if(tail != 0 && file->pages[page_count - 1] != 0) mem_set((void *) HHDM(file->pages[page_count - 1] + tail), 0, ARCH_PAGE_GRANULARITY - tail);
 
-    if(file->base != nullptr) heap_free(file->base, file->size);
-    file->base = buffer;
+        if(length == 0) {
+            heap_free(file->pages, file->page_count * sizeof(uintptr_t));
+            file->pages = nullptr;
+            file->page_count = 0;
+        }
+    } else {
+        file_reserve(file, MATH_DIV_CEIL(length, ARCH_PAGE_GRANULARITY));
+    }
     file->size = length;
+    spinlock_release_nodw(&file->lock);
+    return VFS_RESULT_OK;
+}
+
+static vfs_result_t tmpfs_page(vfs_node_t *node, size_t offset, PARAM_OUT(uintptr_t *) physical_address) {
+    if(node->type != VFS_NODE_TYPE_FILE) return VFS_RESULT_ERR_NOT_FILE;
+    if(offset % ARCH_PAGE_GRANULARITY != 0) return VFS_RESULT_ERR_UNSUPPORTED;
+
+    tmpfs_file_t *file = TMPFS_NODE(node)->file;
+    spinlock_acquire_nodw(&file->lock);
+    if(offset >= file->size) {
+        spinlock_release_nodw(&file->lock);
+        return VFS_RESULT_ERR_UNSUPPORTED;
+    }
+    *physical_address = file_page(file, offset / ARCH_PAGE_GRANULARITY);
+    page_get(PAGE(*physical_address));
+    spinlock_release_nodw(&file->lock);
     return VFS_RESULT_OK;
 }
 
@@ -200,6 +277,10 @@ static vfs_result_t tmpfs_root(vfs_t *vfs, PARAM_OUT(vfs_node_t **) root_node) {
     return VFS_RESULT_OK;
 }
 
-static vfs_node_ops_t g_tmpfs_node_ops = { .rw = tmpfs_rw, .attr = tmpfs_attr, .name = tmpfs_name, .lookup = tmpfs_lookup, .readdir = tmpfs_readdir, .mkdir = tmpfs_mkdir, .mkfile = tmpfs_mkfile, .truncate = tmpfs_truncate };
+static vfs_node_ops_t g_tmpfs_node_ops = { .rw = tmpfs_rw, .attr = tmpfs_attr, .name = tmpfs_name, .lookup = tmpfs_lookup, .readdir = tmpfs_readdir, .mkdir = tmpfs_mkdir, .mkfile = tmpfs_mkfile, .truncate = tmpfs_truncate, .page = tmpfs_page };
 
 vfs_ops_t g_tmpfs_ops = { .mount = tmpfs_mount, .root_node = tmpfs_root };
+
+vfs_node_t *tmpfs_create_anonymous(vfs_t *vfs) {
+    return make_tmpfs_node(nullptr, vfs, false, "anonymous")->vnode;
+}
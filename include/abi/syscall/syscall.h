@@ -8,12 +8,65 @@
 #define SYSCALL_ANON_ALLOC 3
 #define SYSCALL_ANON_FREE 4
 #define SYSCALL_SET_TCB 5
+#define SYSCALL_ANON_ADVISE 6
+#define SYSCALL_SHM_CREATE 7
+#define SYSCALL_SHM_RESIZE 8
+#define SYSCALL_SHM_MAP 9
+#define SYSCALL_KSM_CONFIGURE 10
+#define SYSCALL_KSM_STATS 11
+#define SYSCALL_RESOURCE_USAGE 12
+#define SYSCALL_FRAMEBUFFER_MAP 13
+#define SYSCALL_WSS_CONFIGURE 14
+#define SYSCALL_SHM_DESTROY 15
+
+#define SYSCALL_ANON_FLAG_LAZY (1 << 0) /* Back pages on first access instead of up front */
+#define SYSCALL_ANON_FLAG_POPULATE (1 << 1) /* Back every page before returning, only meaningful with LAZY */
+#define SYSCALL_ANON_FLAG_HUGE (1 << 2) /* Hint that the range is a good candidate for huge pages, recorded but not acted on yet */
+
+#define SYSCALL_ADVICE_NORMAL 0
+#define SYSCALL_ADVICE_WILLNEED 1
+#define SYSCALL_ADVICE_DONTNEED 2
+#define SYSCALL_ADVICE_FREE 3
+#define SYSCALL_ADVICE_HUGEPAGE 4 /* HUGEPAGE and NOHUGEPAGE only set the hint of SYSCALL_ANON_FLAG_HUGE */
+#define SYSCALL_ADVICE_NOHUGEPAGE 5
+#define SYSCALL_ADVICE_MERGEABLE 6
+#define SYSCALL_ADVICE_UNMERGEABLE 7
+
+#define SYSCALL_SHM_MAP_FLAG_READ_ONLY (1 << 0)
+
+#define SYSCALL_RESOURCE_USAGE_THREAD 0
+#define SYSCALL_RESOURCE_USAGE_PROCESS 1 /* Includes the threads that exited */
 
 typedef struct {
     char release[32];
     char version[64];
 } syscall_system_info_t;
 
+typedef struct {
+    uint64_t pages_shared;
+    uint64_t pages_sharing;
+    uint64_t pages_scanned;
+    uint64_t full_scans;
+} syscall_ksm_stats_t;
+
+typedef struct {
+    uint64_t cpu_time; /* Nanoseconds */
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    uint64_t minor_faults;
+    uint64_t pages_allocated;
+    uint64_t resident_pages; /* Only reported for processes */
+    uint64_t working_set_pages; /* Estimate of the pages in active use, only reported for processes */
+} syscall_resource_usage_t;
+
+typedef struct {
+    uint64_t address; /* First pixel in the mapping */
+    uint64_t size;
+    uint64_t width;
+    uint64_t height;
+    uint64_t pitch; /* Bytes per row */
+} syscall_framebuffer_info_t;
+
 typedef uint64_t syscall_int_t;
 
 typedef enum : syscall_int_t {
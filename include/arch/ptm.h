@@ -9,18 +9,51 @@
 /// @warning Depends on heap.
 vm_address_space_t *arch_ptm_address_space_create();
 
+/// Destroy an address space, freeing its page tables.
+/// @warning The address space has to be empty and not loaded on any CPU.
+void arch_ptm_address_space_destroy(vm_address_space_t *address_space);
+
 /// Load a virtual address space.
 void arch_ptm_load_address_space(vm_address_space_t *address_space);
 
 /// Map virtual addresses to physical addresses.
 void arch_ptm_map(vm_address_space_t *address_space, uintptr_t vaddr, uintptr_t paddr, size_t length, vm_protection_t prot, vm_cache_t cache, vm_privilege_t privilege, bool global);
 
+/// Map pages that are not physically contiguous to consecutive virtual addresses.
+/// @param paddrs Physical address of every page
+void arch_ptm_map_pages(vm_address_space_t *address_space, uintptr_t vaddr, const uintptr_t *paddrs, size_t count, vm_protection_t prot, vm_cache_t cache, vm_privilege_t privilege, bool global);
+
 // Rewrite flags for given addresses.
 void arch_ptm_rewrite(vm_address_space_t *address_space, uintptr_t vaddr, size_t length, vm_protection_t prot, vm_cache_t cache, vm_privilege_t privilege, bool global);
 
-/// Unmap virtual addresses from address space.
+/// Unmap virtual addresses from address space, page tables left empty are freed.
 void arch_ptm_unmap(vm_address_space_t *address_space, uintptr_t vaddr, size_t length);
 
 /// Translate a virtual address to a physical address.
 /// @returns true on success
 bool arch_ptm_physical(vm_address_space_t *address_space, uintptr_t vaddr, PARAM_OUT(uintptr_t *) paddr);
+
+/// Test and clear the accessed flag of a page.
+/// @returns true if the page was accessed since the last call
+bool arch_ptm_accessed(vm_address_space_t *address_space, uintptr_t vaddr);
+
+/// Replace the 4K entry of a page with a swap entry, a present page is taken out in place.
+/// Never allocates, the page tables are left as they are.
+/// @returns false if the page is not covered by a 4K page table
+bool arch_ptm_swap_set(vm_address_space_t *address_space, uintptr_t vaddr, uint64_t swap_entry);
+
+/// Retrieve the swap entry stored for a page.
+/// @returns true if the page is swapped out
+bool arch_ptm_swap_get(vm_address_space_t *address_space, uintptr_t vaddr, PARAM_OUT(uint64_t *) swap_entry);
+
+/// Test and clear the accessed and dirty flags of the pages in a range, with a single shootdown for the range.
+/// The state moves to PAGE_FLAG_REFERENCED and PAGE_FLAG_DIRTY of the frames.
+/// @warning Only for mappings of frames that have a page descriptor.
+/// @param dirty Amount of pages that were written
+/// @returns amount of pages that were accessed
+size_t arch_ptm_harvest(vm_address_space_t *address_space, uintptr_t vaddr, size_t length, PARAM_OUT(size_t *) dirty);
+
+/// Merge page tables mapping physically contiguous pages with identical attributes back into big pages.
+/// @warning Only for mappings that are not tracked per page, such as direct mappings.
+/// @returns amount of page tables freed
+size_t arch_ptm_collapse(vm_address_space_t *address_space, uintptr_t vaddr, size_t length);
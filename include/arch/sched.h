@@ -13,6 +13,10 @@ thread_t *arch_sched_thread_create_user(process_t *proc, uintptr_t ip, uintptr_t
 /// Create a new kernel thread.
 thread_t *arch_sched_thread_create_kernel(void (*func)());
 
+/// Free a thread that has been destroyed, including its stacks.
+/// @warning The thread may not be running on any CPU.
+void arch_sched_thread_destroy(thread_t *thread);
+
 /// Return the active thread on the current CPU.
 thread_t *arch_sched_thread_current();
 
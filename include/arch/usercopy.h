@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+/// Copy memory into userspace, faults on the user side are recovered from.
+/// @warning Does not validate that `dest` is a user address.
+/// @returns Amount of bytes that were not copied, zero on success
+size_t arch_usercopy_to(void *dest, const void *src, size_t count);
+
+/// Copy memory out of userspace, faults on the user side are recovered from.
+/// @warning Does not validate that `src` is a user address.
+/// @returns Amount of bytes that were not copied, zero on success
+size_t arch_usercopy_from(void *dest, const void *src, size_t count);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#define RWLOCK_INIT ((rwlock_t) { .state = 0 })
+
+typedef struct {
+    uint32_t state;
+} rwlock_t;
+
+/// Acquire read side of rwlock (preemption, deferred work).
+void rwlock_read_acquire_nodw(rwlock_t *lock);
+
+/// Release read side of rwlock (preemption, deferred work).
+void rwlock_read_release_nodw(rwlock_t *lock);
+
+/// Acquire write side of rwlock (preemption, deferred work).
+void rwlock_write_acquire_nodw(rwlock_t *lock);
+
+/// Release write side of rwlock (preemption, deferred work).
+void rwlock_write_release_nodw(rwlock_t *lock);
+
+/// Attempt to acquire read side of rwlock (preemption, deferred work).
+/// @warning Does not spin, only attempts to acquire the lock once.
+/// @returns true = acquired the lock, release it with `rwlock_read_release_nodw`
+bool rwlock_read_try_acquire_nodw(rwlock_t *lock);
+
+/// Attempt to acquire write side of rwlock (preemption, deferred work).
+/// @warning Does not spin, only attempts to acquire the lock once.
+/// @returns true = acquired the lock, release it with `rwlock_write_release_nodw`
+bool rwlock_write_try_acquire_nodw(rwlock_t *lock);
+
+/// Acquire read side of rwlock with no side effects.
+void rwlock_read_acquire_raw(rwlock_t *lock);
+
+/// Release read side of rwlock with no side effects.
+void rwlock_read_release_raw(rwlock_t *lock);
+
+/// Acquire write side of rwlock with no side effects.
+/// @note Waiting writers block new readers from entering.
+void rwlock_write_acquire_raw(rwlock_t *lock);
+
+/// Release write side of rwlock with no side effects.
+void rwlock_write_release_raw(rwlock_t *lock);
@@ -8,6 +8,8 @@
 #define PCI_DRIVER_MATCH_CLASS (1 << 0)
 #define PCI_DRIVER_MATCH_SUBCLASS (1 << 1)
 #define PCI_DRIVER_MATCH_FUNCTION (1 << 2)
+#define PCI_DRIVER_MATCH_VENDOR (1 << 3)
+#define PCI_DRIVER_MATCH_DEVICE (1 << 4)
 
 typedef struct {
     uint64_t address;
@@ -24,16 +26,24 @@ typedef struct pci_device {
 } pci_device_t;
 
 typedef struct {
+    const char *name;
     void (*initialize)(pci_device_t *device);
     uint8_t match;
     uint16_t class;
     uint16_t subclass;
     uint16_t prog_if;
+    uint16_t vendor_id;
+    uint16_t device_ids[4]; /* Matches any of the non-zero ids */
+    list_node_t list_node;
 } pci_driver_t;
 
 extern spinlock_t g_pci_devices_lock;
 extern list_t g_pci_devices;
 
+/// Register a driver to be initialized for matching devices.
+/// @warning Only devices enumerated after registration are matched, register before `INIT_STAGE_DEV`.
+void pci_driver_register(pci_driver_t *driver);
+
 /// Read byte from device config.
 uint8_t pci_config_read_byte(pci_device_t *device, uint8_t offset);
 
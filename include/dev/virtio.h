@@ -0,0 +1,92 @@
+#pragma once
+
+#include "dev/pci.h"
+#include "lib/param.h"
+#include "memory/dma.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VIRTIO_PCI_VENDOR_ID 0x1AF4
+
+#define VIRTIO_F_VERSION_1 (1llu << 32)
+
+#define VIRTIO_QUEUE_MAX_SIZE 128
+
+typedef struct [[gnu::packed]] {
+    uint64_t address;
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next;
+} virtio_descriptor_t;
+
+typedef struct [[gnu::packed]] {
+    uint16_t flags;
+    uint16_t index;
+    uint16_t ring[];
+} virtio_available_t;
+
+typedef struct [[gnu::packed]] {
+    uint16_t flags;
+    uint16_t index;
+    struct [[gnu::packed]] {
+        uint32_t id;
+        uint32_t length;
+    } ring[];
+} virtio_used_t;
+
+/// Split virtqueue, see section 2.7 of the virtio specification.
+typedef struct {
+    uint16_t index;
+    uint16_t size;
+    dma_buffer_t buffer;
+    virtio_descriptor_t *descriptors;
+    virtio_available_t *available;
+    virtio_used_t *used;
+    uint16_t free_head;
+    uint16_t free_count;
+    uint16_t last_used_index;
+    void *notify;
+} virtio_queue_t;
+
+typedef struct {
+    pci_device_t *pci_device;
+    uint64_t features;
+    void *common_config;
+    void *device_config;
+    void *notify_base;
+    uint32_t notify_multiplier;
+} virtio_device_t;
+
+typedef struct {
+    uintptr_t address;
+    uint32_t length;
+    bool device_writable;
+} virtio_buffer_t;
+
+/// Reset a modern virtio PCI device and negotiate features.
+/// @param features Features the driver supports, VIRTIO_F_VERSION_1 is always requested
+/// @returns false if the device is not a modern device or rejected the features
+bool virtio_device_initialize(pci_device_t *pci_device, uint64_t features, PARAM_OUT(virtio_device_t *) device);
+
+/// Tell the device the driver is set up, queues have to be initialized before.
+void virtio_device_ready(virtio_device_t *device);
+
+/// Read from the device specific config.
+uint32_t virtio_config_read32(virtio_device_t *device, size_t offset);
+
+/// Write to the device specific config.
+void virtio_config_write32(virtio_device_t *device, size_t offset, uint32_t value);
+
+/// Allocate and enable a queue.
+/// @returns false if the device does not have the queue
+bool virtio_queue_initialize(virtio_device_t *device, uint16_t index, PARAM_OUT(virtio_queue_t *) queue);
+
+/// Chain buffers into a single request and notify the device.
+/// @returns false if there are not enough free descriptors
+bool virtio_queue_submit(virtio_queue_t *queue, virtio_buffer_t *buffers, size_t count);
+
+/// Collect a request the device has completed.
+/// @param length Amount of bytes the device wrote, may be nullptr
+/// @returns false if no request has completed
+bool virtio_queue_poll(virtio_queue_t *queue, PARAM_OUT(uint32_t *) length);
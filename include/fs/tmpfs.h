@@ -1,5 +1,15 @@
 #pragma once
 
+#include "arch/page.h"
 #include "fs/vfs.h"
+#include "memory/pmm.h"
+
+#include <stdint.h>
+
+/// Largest file, the page array of a file has to fit in one physical allocation.
+#define TMPFS_MAX_FILE_SIZE (PMM_ORDER_TO_PAGECOUNT(PMM_MAX_ORDER) * ARCH_PAGE_GRANULARITY / sizeof(uintptr_t) * ARCH_PAGE_GRANULARITY)
 
 extern vfs_ops_t g_tmpfs_ops;
+
+/// Create a file that is not linked into any directory of a tmpfs.
+vfs_node_t *tmpfs_create_anonymous(vfs_t *vfs);
@@ -20,7 +20,8 @@ typedef enum {
     VFS_RESULT_ERR_NOT_DIR,
     VFS_RESULT_ERR_NOT_FOUND,
     VFS_RESULT_ERR_EXISTS,
-    VFS_RESULT_ERR_READ_ONLY_FS
+    VFS_RESULT_ERR_READ_ONLY_FS,
+    VFS_RESULT_ERR_TOO_LARGE
 } vfs_result_t;
 
 typedef enum {
@@ -105,6 +106,11 @@ struct vfs_node_ops {
 
     /// Truncate a file.
     vfs_result_t (*truncate)(vfs_node_t *node, size_t length);
+
+    /// Retrieve the physical page holding file data, for mapping it without a copy.
+    /// @note Optional, a reference to the page is taken for the caller unless the page is reserved. It may only be written to through shared mappings.
+    /// @param offset Page aligned file offset, a whole page of data has to be available
+    vfs_result_t (*page)(vfs_node_t *node, size_t offset, PARAM_OUT(uintptr_t *) physical_address);
 };
 
 extern list_t g_vfs_all;
@@ -5,6 +5,7 @@
 
 typedef struct {
     void *address;
+    uintptr_t physical_address;
     size_t size;
     uint64_t height, width, pitch;
 } framebuffer_t;
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+/// Largest input the compressor accepts, match offsets are 16 bit.
+#define LZ_MAX_INPUT 65536
+
+/// Compress a buffer with a fast LZ77 class codec.
+/// @param src_size At most LZ_MAX_INPUT
+/// @returns Compressed size, 0 if it does not fit in dest_capacity
+size_t lz_compress(const void *src, size_t src_size, void *dest, size_t dest_capacity);
+
+/// Decompress a buffer produced by `lz_compress`.
+/// @param dest_size Exact size of the uncompressed data
+/// @returns false on malformed input
+bool lz_decompress(const void *src, size_t src_size, void *dest, size_t dest_size);
@@ -2,7 +2,8 @@
 
 #include <stddef.h>
 
-#define RB_TREE_INIT(VALUE_FN) ((rb_tree_t) { .value = (VALUE_FN), .root = nullptr, .count = 0 })
+#define RB_TREE_INIT(VALUE_FN) ((rb_tree_t) { .value = (VALUE_FN), .update = nullptr, .root = nullptr, .count = 0 })
+#define RB_TREE_INIT_AUGMENTED(VALUE_FN, UPDATE_FN) ((rb_tree_t) { .value = (VALUE_FN), .update = (UPDATE_FN), .root = nullptr, .count = 0 })
 
 typedef size_t rb_value_t;
 static_assert((rb_value_t) -1 > 0, "rb_value_t must be unsigned");
@@ -30,6 +31,7 @@ struct rb_node {
 
 typedef struct {
     rb_value_t (*value)(rb_node_t *node);
+    void (*update)(rb_node_t *node); /* Optional, recomputes the augmented data of a node from its children */
     rb_node_t *root;
     size_t count;
 } rb_tree_t;
@@ -41,6 +43,10 @@ void rb_insert(rb_tree_t *tree, rb_node_t *node);
 /// Remove a node from red black tree.
 void rb_remove(rb_tree_t *tree, rb_node_t *node);
 
+/// Propagate a change of a node's augmented data up to the root.
+/// @note Has to be called after modifying a node in a way that affects its augmented data.
+void rb_update(rb_tree_t *tree, rb_node_t *node);
+
 /// Binary search for a node.
 /// @returns Pointer to found node or `nullptr`
 rb_node_t *rb_search(rb_tree_t *tree, rb_value_t search_value, rb_search_type_t search_type);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "sched/thread.h"
+
+/// Create the thread that merges split big pages of the global address space back together in the background.
+thread_t *collapse_thread_create();
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "lib/param.h"
+#include "memory/vm.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DMA_MASK_32BIT 0xFFFF'FFFF
+#define DMA_MASK_64BIT 0xFFFF'FFFF'FFFF'FFFF
+
+typedef enum {
+    DMA_DIRECTION_TO_DEVICE,
+    DMA_DIRECTION_FROM_DEVICE,
+    DMA_DIRECTION_BIDIRECTIONAL
+} dma_direction_t;
+
+typedef struct {
+    void *virtual_address;
+    uintptr_t device_address;
+    size_t size;
+    vm_cache_t cache;
+    bool pooled;
+} dma_buffer_t;
+
+typedef struct {
+    uintptr_t device_address;
+    size_t size;
+    dma_direction_t direction;
+    void *buffer;
+    void *bounce; /* nullptr if the device accesses the buffer directly */
+} dma_mapping_t;
+
+/// Reserve the contiguous pool from early memory.
+/// @warning Has to be called before early memory is released to the PMM.
+void dma_pool_carve();
+
+/// Check whether a page belongs to the contiguous pool.
+bool dma_pool_contains(uintptr_t physical_address);
+
+/// Allocate a zeroed, physically contiguous buffer addressable by a device.
+/// @param mask Highest address the device can access
+/// @returns false if no suitable memory is available
+bool dma_alloc_coherent(size_t size, uintptr_t mask, vm_cache_t cache, PARAM_OUT(dma_buffer_t *) buffer);
+
+/// Free a buffer allocated with `dma_alloc_coherent`.
+void dma_free_coherent(dma_buffer_t *buffer);
+
+/// Map a kernel buffer for a single transfer, bouncing it through the pool if the device cannot access it directly.
+/// @param mask Highest address the device can access
+/// @returns false if the buffer has to be bounced and the pool is exhausted or out of reach
+bool dma_map(void *buffer, size_t size, uintptr_t mask, dma_direction_t direction, PARAM_OUT(dma_mapping_t *) mapping);
+
+/// Unmap a buffer mapped with `dma_map`, the CPU owns the buffer again.
+void dma_unmap(dma_mapping_t *mapping);
+
+/// Hand a mapped buffer back to the CPU without unmapping it.
+void dma_sync_for_cpu(dma_mapping_t *mapping);
+
+/// Hand a mapped buffer back to the device after the CPU accessed it.
+void dma_sync_for_device(dma_mapping_t *mapping);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "lib/param.h"
+#include "sched/thread.h"
+#include "sys/time.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    bool run; /* Periodically scan mergeable regions */
+    size_t pages_to_scan; /* Pages scanned per round */
+    time_t interval; /* Delay between rounds */
+} ksm_tunables_t;
+
+typedef struct {
+    size_t pages_shared; /* Merged frames in use */
+    size_t pages_sharing; /* Mappings of merged frames beyond the first, that is the frames saved */
+    size_t pages_scanned;
+    size_t full_scans;
+} ksm_stats_t;
+
+/// Create the thread that scans mergeable regions for identical pages.
+thread_t *ksm_thread_create();
+
+/// Hash the contents of a frame.
+uint64_t ksm_hash(uintptr_t physical_address);
+
+/// Check whether any merged frames exist.
+bool ksm_active();
+
+/// Check whether a frame is a merged frame.
+bool ksm_frame(uintptr_t physical_address);
+
+/// Look up a merged frame by the hash of its contents and take a reference to it.
+/// @note The contents still have to be compared, hashes might collide.
+/// @returns true if a merged frame with room for another mapping was found
+bool ksm_lookup(uint64_t hash, PARAM_OUT(uintptr_t *) physical_address);
+
+/// Remember a frame seen during the current pass.
+/// @returns true if a different frame with the same hash was seen already
+bool ksm_candidate(uintptr_t physical_address, uint64_t hash);
+
+/// Turn a frame into a merged frame with a single reference.
+/// @warning The frame has to be mapped read-only in every place it is mapped.
+void ksm_promote(uintptr_t physical_address, uint64_t hash);
+
+/// Drop a reference to a merged frame, the frame is freed with the last one.
+void ksm_release(uintptr_t physical_address);
+
+/// Mark the end of a pass over all mergeable memory.
+void ksm_pass_complete();
+
+/// Retrieve the current tunables.
+ksm_tunables_t ksm_tunables_get();
+
+/// Apply tunables, the scanner picks them up after its current round.
+/// @returns false if the tunables are invalid
+bool ksm_tunables_set(ksm_tunables_t tunables);
+
+/// Retrieve merge statistics.
+ksm_stats_t ksm_stats();
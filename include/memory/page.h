@@ -1,17 +1,80 @@
 #pragma once
 
 #include "arch/page.h"
+#include "common/assert.h"
 #include "lib/container.h"
 #include "memory/pmm.h"
 
+#include <stdint.h>
+
 #define PAGE(PHYSICAL_ADDRESS) (&(g_page_db[(PHYSICAL_ADDRESS) / ARCH_PAGE_GRANULARITY]))
 #define PAGE_PADDR(PAGE) (((uintptr_t) (PAGE) - (uintptr_t) g_page_db) / sizeof(page_t) * ARCH_PAGE_GRANULARITY)
 
 #define PAGE_FROM_BLOCK(BLOCK) (CONTAINER_OF((BLOCK), page_t, block))
 
+#define PAGE_FLAG_DIRTY (1 << 0)
+#define PAGE_FLAG_LOCKED (1 << 1)
+#define PAGE_FLAG_SLAB (1 << 2)
+#define PAGE_FLAG_PAGETABLE (1 << 3)
+#define PAGE_FLAG_RESERVED (1 << 4) /* never returned to the PMM */
+#define PAGE_FLAG_REFERENCED (1 << 5) /* Accessed bit harvested from a mapping of the page, consumed by reclaim */
+
+typedef uint16_t page_flags_t;
+
+/// Only the first page of an allocated block carries a reference count, mapping count and flags.
 typedef struct {
     pmm_block_t block;
+    uint32_t refcount;
+    union {
+        uint16_t mapcount; /* Mappings of the page, maintained by users that share it between mappings */
+        uint16_t entry_count; /* Non-empty entries of a page table page */
+    };
+    page_flags_t flags;
 } page_t;
 
+static_assert(sizeof(page_t) == 32, "page descriptors should pack into cache lines");
+
 extern page_t *g_page_db;
 extern size_t g_page_db_size;
+
+/// Take a reference to a page.
+static inline void page_get(page_t *page) {
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/// Drop a reference to a page, the block is freed to the PMM with the last one.
+static inline void page_put(page_t *page) {
+    ASSERT((__atomic_load_n(&page->flags, __ATOMIC_RELAXED) & PAGE_FLAG_RESERVED) == 0);
+
+    uint32_t refcount = __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+    ASSERT(refcount != UINT32_MAX);
+    if(refcount == 0) pmm_free(&page->block);
+}
+
+static inline void page_flags_set(page_t *page, page_flags_t flags) {
+    __atomic_or_fetch(&page->flags, flags, __ATOMIC_RELAXED);
+}
+
+static inline void page_flags_clear(page_t *page, page_flags_t flags) {
+    __atomic_and_fetch(&page->flags, (page_flags_t) ~flags, __ATOMIC_RELAXED);
+}
+
+static inline bool page_flags_test(page_t *page, page_flags_t flags) {
+    return (__atomic_load_n(&page->flags, __ATOMIC_RELAXED) & flags) != 0;
+}
+
+/// Clear flags of a page.
+/// @returns true if any of the flags was set
+static inline bool page_flags_test_clear(page_t *page, page_flags_t flags) {
+    return (__atomic_fetch_and(&page->flags, (page_flags_t) ~flags, __ATOMIC_RELAXED) & flags) != 0;
+}
+
+/// Attempt to lock a page.
+/// @returns true = acquired the lock
+static inline bool page_try_lock(page_t *page) {
+    return (__atomic_fetch_or(&page->flags, PAGE_FLAG_LOCKED, __ATOMIC_ACQUIRE) & PAGE_FLAG_LOCKED) == 0;
+}
+
+static inline void page_unlock(page_t *page) {
+    __atomic_and_fetch(&page->flags, (page_flags_t) ~PAGE_FLAG_LOCKED, __ATOMIC_RELEASE);
+}
@@ -13,6 +13,7 @@
 #define PMM_FLAG_NONE (0)
 #define PMM_FLAG_ZERO (1 << 0)
 #define PMM_FLAG_ZONE_LOW (1 << 1)
+#define PMM_FLAG_NO_RECLAIM (1 << 2) /* Fail instead of reclaiming when the zone runs low */
 
 typedef uint8_t pmm_flags_t;
 typedef uint8_t pmm_order_t;
@@ -26,6 +27,12 @@ typedef struct {
 
     size_t total_page_count;
     size_t free_page_count;
+
+    struct {
+        size_t min; /* Allocations below this reclaim directly */
+        size_t low; /* The reclaim thread starts below this */
+        size_t high; /* The reclaim thread stops at this */
+    } watermarks;
 } pmm_zone_t;
 
 typedef struct pmm_block {
@@ -44,6 +51,7 @@ extern pmm_zone_t g_pmm_zone_low;
 void pmm_region_add(uintptr_t base, size_t size, bool is_free);
 
 /// Allocates a block of size order^2 pages.
+/// @returns nullptr only if PMM_FLAG_NO_RECLAIM is set and the zone is out of memory
 pmm_block_t *pmm_alloc(pmm_order_t order, pmm_flags_t flags);
 
 /// Allocates the smallest block of size N^2 pages to fit size.
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "lib/list.h"
+#include "sched/thread.h"
+
+#include <stddef.h>
+
+typedef struct {
+    const char *name;
+
+    /// Give memory back to the physical allocator.
+    /// @warning Runs in the allocation slow path and may not allocate. Shrinkers acquire the shrinker list, address space
+    /// list and slab cache list locks, the zswap and KSM locks, and the page table lock of an address space whose write
+    /// lock they hold, so none of these may be held while allocating. Any other lock may be held by the caller and may
+    /// only be tried.
+    /// @param page_count Amount of pages the caller would like to see freed
+    /// @returns amount of pages freed
+    size_t (*shrink)(size_t page_count);
+
+    list_node_t list_node;
+} reclaim_shrinker_t;
+
+/// Register a shrinker to be run under memory pressure.
+void reclaim_shrinker_register(reclaim_shrinker_t *shrinker);
+
+/// Run the shrinkers until page_count pages are freed or all of them ran.
+/// @returns amount of pages freed
+size_t reclaim_shrink(size_t page_count);
+
+/// Create the thread that reclaims memory in the background once a zone drops below its low watermark.
+thread_t *reclaim_thread_create();
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "common/lock/spinlock.h"
+#include "fs/vfs.h"
+#include "lib/list.h"
+#include "memory/vm.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    long id;
+    long owner; /* Process allowed to resize and destroy the object, any process knowing the id may map it */
+    uint32_t refcount;
+    spinlock_t lock;
+    vfs_node_t *node; /* Anonymous tmpfs file holding the pages */
+    size_t size;
+    list_node_t list_node;
+} shm_t;
+
+/// Create a shared memory object.
+/// @param size Page aligned size
+/// @returns nullptr if the size is invalid, otherwise the object with a reference for the caller
+shm_t *shm_create(size_t size, long owner);
+
+/// Look up a shared memory object by id.
+/// @returns nullptr if there is no such object, otherwise the object with a reference for the caller
+shm_t *shm_lookup(long id);
+
+/// Drop a reference to a shared memory object.
+void shm_put(shm_t *shm);
+
+/// Remove a shared memory object, its pages are dropped once the last reference is.
+/// @note Pages that are still mapped stay until they are unmapped.
+/// @returns false if there is no such object or it belongs to another process
+bool shm_destroy(long id, long owner);
+
+/// Grow a shared memory object.
+/// @note Shrinking is refused, the frames might still be mapped.
+/// @param size Page aligned size
+bool shm_resize(shm_t *shm, size_t size);
+
+/// Map a range of a shared memory object into an address space.
+/// @param offset Page aligned offset into the object
+/// @param length Page aligned length
+void *shm_map(shm_t *shm, vm_address_space_t *address_space, size_t offset, size_t length, vm_protection_t prot);
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "common/lock/rwlock.h"
 #include "common/lock/spinlock.h"
+#include "fs/vfs.h"
 #include "lib/list.h"
 #include "lib/rb.h"
 
@@ -10,6 +12,8 @@
 #define VM_FLAG_NONE 0
 #define VM_FLAG_FIXED (1 << 1)
 #define VM_FLAG_DYNAMICALLY_BACKED (1 << 2)
+#define VM_FLAG_HUGE_HINT (1 << 3)
+#define VM_FLAG_SHARED (1 << 4) /* only applies to file mappings */
 #define VM_FLAG_ZERO (1 << 10) /* only applies to anonymous mappings */
 
 #define VM_PROT_NONE ((vm_protection_t) {})
@@ -36,24 +40,60 @@ typedef enum {
 
 typedef enum {
     VM_FAULT_UNKNOWN,
-    VM_FAULT_NOT_PRESENT
+    VM_FAULT_NOT_PRESENT,
+    VM_FAULT_NOT_PRESENT_WRITE, /* Write to a page that is not present */
+    VM_FAULT_WRITE /* Write to a present page that is mapped read-only */
 } vm_fault_t;
 
 typedef enum {
     VM_REGION_TYPE_ANON,
-    VM_REGION_TYPE_DIRECT
+    VM_REGION_TYPE_DIRECT,
+    VM_REGION_TYPE_FILE
 } vm_region_type_t;
 
+typedef enum {
+    VM_ADVICE_NORMAL,
+    VM_ADVICE_WILLNEED, /* Populate the range */
+    VM_ADVICE_DONTNEED, /* Release the backing of anonymous memory, it reads back as freshly mapped memory */
+    VM_ADVICE_HUGEPAGE, /* Set the huge page hint, see vm_region_t */
+    VM_ADVICE_NOHUGEPAGE,
+    VM_ADVICE_MERGEABLE, /* Let the same page merging scanner merge identical anonymous pages */
+    VM_ADVICE_UNMERGEABLE /* Stop merging and break the sharing of merged pages */
+} vm_advice_t;
+
 typedef uint64_t vm_flags_t;
 
+typedef struct vm_region vm_region_t;
+
+typedef union {
+    struct {
+        bool back_zeroed;
+    } anon;
+    struct {
+        uintptr_t physical_address;
+    } direct;
+    struct {
+        vfs_node_t *node;
+        size_t offset; /* File offset at the region base */
+        size_t size; /* Bytes of file data from the region base, the rest of the region is zero filled */
+        bool shared; /* Writes go to the file pages instead of private copies */
+    } file;
+} vm_region_type_data_t;
+
 typedef struct {
-    spinlock_t lock;
+    rwlock_t lock; /* Write side protects the regions tree, read side is enough for lookups and faults */
     rb_tree_t regions;
     uintptr_t start, end;
+    vm_region_t *lookup_cache; /* Last region found by an address lookup */
+    list_node_t list_node; /* Used for the reclaim list */
+    uintptr_t merge_cursor; /* Where the same page merging scanner continues */
+    size_t resident_pages; /* Pages of anonymous and file regions that are mapped, the zero page is not counted */
+    size_t working_set_pages; /* Sum of the working set estimates of the regions */
 } vm_address_space_t;
 
-typedef struct {
+struct vm_region {
     vm_address_space_t *address_space;
+    spinlock_t lock; /* Serializes populating the region under the read side of the address space lock */
 
     uintptr_t base;
     size_t length;
@@ -63,19 +103,25 @@ typedef struct {
     vm_cache_t cache_behavior;
 
     bool dynamically_backed : 1;
+    bool huge_hint : 1; /* Range is a good candidate for big pages, a hint nothing acts on yet */
+    bool mergeable : 1; /* Identical anonymous pages may be merged, see memory/ksm.h */
 
     rb_node_t rb_node; /* Used for regions list */
-    list_node_t list_node; /* Used for region cache */
-
-    union {
-        struct {
-            bool back_zeroed;
-        } anon;
-        struct {
-            uintptr_t physical_address;
-        } direct;
-    } type_data;
-} vm_region_t;
+    list_node_t list_node; /* Used for region reserve */
+
+    struct {
+        uintptr_t start, end;
+        size_t max_gap;
+    } subtree; /* Augmented data of the regions tree, bounds and largest hole of this subtree */
+
+    struct {
+        size_t accessed; /* Pages accessed during the last sampling period */
+        size_t dirty; /* Pages written during the last sampling period */
+        size_t estimate; /* Moving average of the accessed pages */
+    } working_set; /* Maintained by the working set sampler, see memory/wss.h */
+
+    vm_region_type_data_t type_data;
+};
 
 extern vm_address_space_t *g_vm_global_address_space;
 
@@ -89,6 +135,15 @@ void *vm_map_anon(vm_address_space_t *address_space, void *hint, size_t length,
 /// @param length Page aligned length
 void *vm_map_direct(vm_address_space_t *address_space, void *hint, size_t length, vm_protection_t prot, vm_cache_t cache, uintptr_t physical_address, vm_flags_t flags);
 
+/// Map a region of a file. Pages the filesystem can provide directly are shared
+/// with the file, writable mappings receive private copies on write unless VM_FLAG_SHARED is set.
+/// @note Shared mappings require the filesystem to provide its pages
+/// @param hint Page aligned address
+/// @param length Page aligned length
+/// @param offset Page aligned file offset at the start of the region
+/// @param size Amount of file data mapped, the remainder of the region is zero filled
+void *vm_map_file(vm_address_space_t *address_space, void *hint, size_t length, vm_protection_t prot, vm_cache_t cache, vfs_node_t *node, size_t offset, size_t size, vm_flags_t flags);
+
 /// Unmap a region of memory.
 /// @param address Page aligned address
 /// @param length Page aligned length
@@ -100,9 +155,15 @@ void vm_rewrite_prot(vm_address_space_t *address_space, void *address, size_t le
 /// Rewrite cacheability of a region of memory.
 void vm_rewrite_cache(vm_address_space_t *address_space, void *address, size_t length, vm_cache_t cache);
 
+/// Advise on the expected use of a range of memory.
+/// @param address Page aligned address
+/// @param length Page aligned length
+/// @returns false if the range is not fully mapped
+bool vm_advise(vm_address_space_t *address_space, void *address, size_t length, vm_advice_t advice);
+
 /// Handle a virtual memory fault
 /// @param fault Cause of the fault
-/// @returns Is fault handled
+/// @returns Is fault handled, a fault that could not be resolved is reported once the faulting access is retried
 bool vm_fault(uintptr_t address, vm_fault_t fault);
 
 /// Copy data to another address space.
@@ -111,5 +172,20 @@ size_t vm_copy_to(vm_address_space_t *dest_as, uintptr_t dest_addr, void *src, s
 /// Copy data from another address space.
 size_t vm_copy_from(void *dest, vm_address_space_t *src_as, uintptr_t src_addr, size_t count);
 
+/// Destroy an address space, unmapping all of its regions.
+/// @warning The address space may not be loaded on any CPU.
+void vm_address_space_destroy(vm_address_space_t *address_space);
+
+/// Make the anonymous memory of an address space reclaimable.
+void vm_address_space_register(vm_address_space_t *address_space);
+
+/// Scan the mergeable regions of user address spaces for pages to merge, continuing where the last scan stopped.
+/// @returns amount of pages scanned
+size_t vm_merge_scan(size_t page_count);
+
+/// Sample the accessed and dirty state of the anonymous and file regions of user address spaces and update their working set estimates.
+/// @returns amount of pages sampled
+size_t vm_working_set_sample();
+
 /// Create a regions rbtree.
 rb_tree_t vm_create_regions();
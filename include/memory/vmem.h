@@ -0,0 +1,53 @@
+#pragma once
+
+#include "common/lock/spinlock.h"
+#include "lib/list.h"
+#include "lib/param.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VMEM_FREELIST_COUNT 64
+#define VMEM_HASH_BUCKET_COUNT 256
+#define VMEM_QCACHE_COUNT 8 /* Quantum caches cover allocations of 1 to VMEM_QCACHE_COUNT quanta */
+#define VMEM_QCACHE_DEPTH 16
+
+/// Resource arena in the style of Bonwick's vmem, used to hand out kernel virtual address space.
+/// Free segments are kept on power of two freelists for instant fit, allocated segments are hashed by base.
+typedef struct {
+    const char *name;
+    spinlock_t lock;
+
+    uintptr_t base;
+    size_t size;
+    size_t quantum;
+
+    list_t segments; /* All segments in address order */
+    uint64_t freemap; /* Bit N is set when freelist N is not empty */
+    list_t freelists[VMEM_FREELIST_COUNT]; /* Freelist N holds free segments of [2^N, 2^(N+1)) bytes */
+    list_t hash[VMEM_HASH_BUCKET_COUNT];
+
+    struct {
+        size_t count;
+        uintptr_t addresses[VMEM_QCACHE_DEPTH];
+    } qcaches[VMEM_QCACHE_COUNT]; /* Recently freed small ranges, they stay allocated in the arena */
+
+    size_t in_use;
+} vmem_t;
+
+/// Initialize an arena spanning a range.
+/// @param quantum Granularity of the arena, base and size have to be multiples of it
+void vmem_initialize(vmem_t *vmem, const char *name, uintptr_t base, size_t size, size_t quantum);
+
+/// Allocate from an arena.
+/// @param size Multiple of the quantum
+/// @returns false if the arena has no free segment that fits
+bool vmem_alloc(vmem_t *vmem, size_t size, PARAM_OUT(uintptr_t *) address);
+
+/// Allocate a specific range from an arena.
+/// @returns false if any part of the range is allocated
+bool vmem_xalloc(vmem_t *vmem, uintptr_t address, size_t size);
+
+/// Free a range to an arena.
+/// @note The range may cover parts of allocations or span several of them, but has to be fully allocated
+void vmem_free(vmem_t *vmem, uintptr_t address, size_t size);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "sched/thread.h"
+#include "sys/time.h"
+
+typedef struct {
+    bool run; /* Periodically sample the working sets of user memory */
+    time_t interval; /* Sampling period */
+} wss_tunables_t;
+
+/// Create the thread that samples the accessed and dirty state of user memory to estimate working sets.
+thread_t *wss_thread_create();
+
+/// Retrieve the current tunables.
+wss_tunables_t wss_tunables_get();
+
+/// Apply tunables, the sampler picks them up after its current period.
+/// @returns false if the tunables are invalid
+bool wss_tunables_set(wss_tunables_t tunables);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "lib/param.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Compress a page into the zswap pool.
+/// @note On success the frame is owned by the pool, it is either freed or reused as pool page.
+/// @param entry Swap entry identifying the compressed page
+/// @returns false if the page does not compress well enough
+bool zswap_store(uintptr_t physical_address, PARAM_OUT(uint64_t *) entry);
+
+/// Decompress a page from the zswap pool into a frame and release the entry.
+void zswap_load(uint64_t entry, uintptr_t physical_address);
+
+/// Release an entry without reading it.
+void zswap_release(uint64_t entry);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "sys/time.h"
+
+#include <stddef.h>
+
+typedef struct {
+    time_t cpu_time; /* Time spent running */
+    size_t voluntary_switches; /* Switched out after yielding or blocking */
+    size_t involuntary_switches; /* Switched out by preemption */
+    size_t minor_faults; /* Faults resolved without waiting on IO */
+    size_t pages_allocated; /* Pages allocated for user memory */
+} accounting_t;
+
+/// Add the counters of `src` to `dest`.
+static inline void accounting_add(accounting_t *dest, accounting_t *src) {
+    dest->cpu_time += src->cpu_time;
+    dest->voluntary_switches += src->voluntary_switches;
+    dest->involuntary_switches += src->involuntary_switches;
+    dest->minor_faults += src->minor_faults;
+    dest->pages_allocated += src->pages_allocated;
+}
@@ -2,6 +2,7 @@
 
 #include "common/lock/spinlock.h"
 #include "lib/list.h"
+#include "sched/accounting.h"
 #include "memory/vm.h"
 
 typedef struct {
@@ -9,11 +10,15 @@ typedef struct {
     spinlock_t lock;
     vm_address_space_t *address_space;
     list_t threads;
+    accounting_t accounting; /* Totals of the threads that exited */
     list_node_t list_sched; /* used by scheduler/reaper */
 } process_t;
 
 /// Create a process.
 process_t *process_create(vm_address_space_t *address_space);
 
+/// Sum up the accounting of a process and its live threads, the address space holds the resident set size.
+accounting_t process_accounting(process_t *process);
+
 /// Destroy a process.
 void process_destroy(process_t *process);
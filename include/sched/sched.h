@@ -3,6 +3,7 @@
 #include "common/lock/spinlock.h"
 #include "lib/list.h"
 #include "sched/thread.h"
+#include "sys/time.h"
 
 typedef struct sched {
     spinlock_t lock;
@@ -25,6 +26,9 @@ struct thread *sched_thread_next(sched_t *sched);
 /// Yield.
 void sched_yield(enum thread_state yield_state);
 
+/// Block the current thread for a while.
+void sched_sleep(time_t delay);
+
 /// Increment the preempt counter, effectively disables preemtion.
 /// Meant to be paired up with a `dec` call.
 void sched_preempt_inc();
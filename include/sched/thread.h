@@ -4,6 +4,7 @@ typedef enum thread_state thread_state_t;
 typedef struct thread thread_t;
 
 #include "lib/list.h"
+#include "sched/accounting.h"
 #include "sched/process.h"
 #include "sched/sched.h"
 #include "sys/dw.h"
@@ -22,9 +23,14 @@ struct thread {
 
     struct sched *scheduler;
 
+    accounting_t accounting; /* Only updated by the CPU the thread runs on */
+    time_t switched_in; /* When the thread last started running */
+
     struct {
         bool in_flight;
+        bool failed; /* The last soft fault on `address` could not be resolved */
         uintptr_t address;
+        vm_fault_t type;
         dw_item_t dw_item;
     } vm_fault;
 
@@ -20,6 +20,7 @@ typedef struct cpu {
         bool threaded;
         bool in_interrupt_hard;
         bool in_interrupt_soft;
+        bool in_reclaim;
     } flags;
     arch_cpu_data_t arch;
 } cpu_t;
@@ -6,9 +6,9 @@
 /// @warning Only intended for syscall handlers
 int syscall_buffer_out(void *dest, void *src, size_t count);
 
-/// Read a buffer from userspace safely.
+/// Read a buffer from userspace safely into a kernel buffer.
 /// @warning Only intended for syscall handlers
-void *syscall_buffer_in(void *src, size_t count);
+int syscall_buffer_in(void *dest, void *src, size_t count);
 
 /// Write a string to userspace safely.
 /// @warning Only intended for syscall handlers
@@ -16,5 +16,6 @@ void *syscall_buffer_in(void *src, size_t count);
 int syscall_string_out(char *dest, char *src, size_t max);
 
 /// Read a string from userspace safely.
+/// @note The only helper that allocates, the string is freed by the caller with heap_free(str, length + 1)
 /// @warning Only intended for syscall handlers
 char *syscall_string_in(char *src, size_t length);
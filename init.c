@@ -14,11 +14,16 @@
 #include "lib/math.h"
 #include "lib/mem.h"
 #include "lib/string.h"
+#include "memory/collapse.h"
+#include "memory/dma.h"
 #include "memory/earlymem.h"
 #include "memory/hhdm.h"
+#include "memory/ksm.h"
 #include "memory/page.h"
 #include "memory/pmm.h"
+#include "memory/reclaim.h"
 #include "memory/vm.h"
+#include "memory/wss.h"
 #include "sched/reaper.h"
 #include "sys/event.h"
 #include "sys/kernel_symbol.h"
@@ -108,6 +113,7 @@ static void thread_init() {
     // TODO: handle pixel format... and the entire way we deal with framebuffers in general
     tartarus_framebuffer_t *framebuffer = &boot_info->framebuffers[0];
     g_framebuffer.address = framebuffer->vaddr;
+    g_framebuffer.physical_address = framebuffer->paddr;
     g_framebuffer.size = framebuffer->size;
     g_framebuffer.width = framebuffer->width;
     g_framebuffer.height = framebuffer->height;
@@ -223,7 +229,7 @@ static void thread_init() {
     }
 
     // Map the framebuffer
-    arch_ptm_map(g_vm_global_address_space, (uintptr_t) g_framebuffer.address, framebuffer->paddr, MATH_CEIL(g_framebuffer.size, ARCH_PAGE_GRANULARITY), VM_PROT_RW, VM_CACHE_NONE, VM_PRIVILEGE_KERNEL, true);
+    arch_ptm_map(g_vm_global_address_space, (uintptr_t) g_framebuffer.address, framebuffer->paddr, MATH_CEIL(g_framebuffer.size, ARCH_PAGE_GRANULARITY), VM_PROT_RW, VM_CACHE_WRITE_COMBINE, VM_PRIVILEGE_KERNEL, true);
 
     // Load the new address space
     log(LOG_LEVEL_DEBUG, "INIT", "Loading global address space...");
@@ -248,15 +254,18 @@ static void thread_init() {
         pmm_region_add(entry->base, entry->length, is_free);
     }
 
+    dma_pool_carve();
+
     // TODO: release reclaimable regions into pmm as well as
     //       merging with free ones for max order to settle properly.
     LIST_ITERATE(&g_earlymem_regions, node) {
         earlymem_region_t *region = CONTAINER_OF(node, earlymem_region_t, list_node);
         for(size_t offset = 0; offset < region->length; offset += ARCH_PAGE_GRANULARITY) {
-            if(!earlymem_region_isfree(region, offset)) continue;
+            if(!earlymem_region_isfree(region, offset) || dma_pool_contains(region->base + offset)) continue;
             pmm_free(&PAGE(region->base + offset)->block);
         }
     }
+    g_earlymem_active = false;
 
     // log(LOG_LEVEL_DEBUG, "INIT", "Physical Memory Map");
     // pmm_zone_t *zones[] = { &g_pmm_zone_low, &g_pmm_zone_normal };
@@ -336,6 +345,10 @@ static void thread_init() {
 
     // Schedule init threads
     sched_thread_schedule(reaper_create());
+    sched_thread_schedule(reclaim_thread_create());
+    sched_thread_schedule(collapse_thread_create());
+    sched_thread_schedule(wss_thread_create());
+    sched_thread_schedule(ksm_thread_create());
     sched_thread_schedule(arch_sched_thread_create_kernel(thread_init));
 
     // Scheduler handoff
@@ -0,0 +1,134 @@
+#include "lib/lz.h"
+
+#include "common/assert.h"
+#include "lib/mem.h"
+
+#include <stdint.h>
+
+/// Sequences are encoded as a token byte, literals, and a back reference (LZ4 style).
+/// The high nibble of the token holds the literal count, the low nibble the match length minus MIN_MATCH.
+/// A nibble of 15 is followed by extension bytes that are added until one is below 255.
+/// The last sequence only carries literals.
+
+#define HASH_BITS 10
+#define MIN_MATCH 4
+#define NIBBLE_MAX 15
+
+static inline uint32_t read32(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint32_t hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static bool write_length(uint8_t **out, uint8_t *out_end, size_t length) {
+    for(; length >= 255; length -= 255) {
+        if(*out >= out_end) return false;
+        *(*out)++ = 255;
+    }
+    if(*out >= out_end) return false;
+    *(*out)++ = (uint8_t) length;
+    return true;
+}
+
+static bool write_sequence(uint8_t **out, uint8_t *out_end, const uint8_t *literals, size_t literal_count, size_t offset, size_t match_length) {
+    if(*out >= out_end) return false;
+    uint8_t *token = (*out)++;
+
+    *token = (literal_count >= NIBBLE_MAX ? NIBBLE_MAX : literal_count) << 4;
+    if(literal_count >= NIBBLE_MAX && !write_length(out, out_end, literal_count - NIBBLE_MAX)) return false;
+
+    if((size_t) (out_end - *out) < literal_count) return false;
+    mem_copy(*out, literals, literal_count);
+    *out += literal_count;
+
+    if(match_length == 0) return true;
+
+    if(out_end - *out < 2) return false;
+    *(*out)++ = (uint8_t) offset;
+    *(*out)++ = (uint8_t) (offset >> 8);
+
+    match_length -= MIN_MATCH;
+    *token |= match_length >= NIBBLE_MAX ? NIBBLE_MAX : match_length;
+    if(match_length >= NIBBLE_MAX && !write_length(out, out_end, match_length - NIBBLE_MAX)) return false;
+    return true;
+}
+
+static bool read_length(const uint8_t **in, const uint8_t *in_end, size_t *length) {
+    uint8_t byte;
+    do {
+        if(*in >= in_end) return false;
+        byte = *(*in)++;
+        *length += byte;
+    } while(byte == 255);
+    return true;
+}
+
+size_t lz_compress(const void *src, size_t src_size, void *dest, size_t dest_capacity) {
+    ASSERT(src_size <= LZ_MAX_INPUT);
+
+    const uint8_t *in = src;
+    uint8_t *out = dest;
+    uint8_t *out_end = out + dest_capacity;
+
+    uint16_t table[1 << HASH_BITS] = {};
+
+    size_t anchor = 0;
+    size_t i = 0;
+    while(i + MIN_MATCH <= src_size) {
+        uint32_t sequence = read32(&in[i]);
+        uint32_t h = hash(sequence);
+        size_t candidate = table[h];
+        table[h] = (uint16_t) i;
+
+        if(candidate >= i || i - candidate > UINT16_MAX || read32(&in[candidate]) != sequence) {
+            i++;
+            continue;
+        }
+
+        size_t match_length = MIN_MATCH;
+        while(i + match_length < src_size && in[candidate + match_length] == in[i + match_length]) match_length++;
+
+        if(!write_sequence(&out, out_end, &in[anchor], i - anchor, i - candidate, match_length)) return 0;
+        i += match_length;
+        anchor = i;
+    }
+
+    if(!write_sequence(&out, out_end, &in[anchor], src_size - anchor, 0, 0)) return 0;
+    return out - (uint8_t *) dest;
+}
+
+bool lz_decompress(const void *src, size_t src_size, void *dest, size_t dest_size) {
+    const uint8_t *in = src;
+    const uint8_t *in_end = in + src_size;
+    uint8_t *out = dest;
+    uint8_t *out_end = out + dest_size;
+
+    while(in < in_end) {
+        uint8_t token = *in++;
+
+        size_t literal_count = token >> 4;
+        if(literal_count == NIBBLE_MAX && !read_length(&in, in_end, &literal_count)) return false;
+        if(literal_count > (size_t) (in_end - in) || literal_count > (size_t) (out_end - out)) return false;
+        mem_copy(out, in, literal_count);
+        in += literal_count;
+        out += literal_count;
+
+        if(in == in_end) break;
+
+        if(in_end - in < 2) return false;
+        size_t offset = (size_t) in[0] | ((size_t) in[1] << 8);
+        in += 2;
+        if(offset == 0 || offset > (size_t) (out - (uint8_t *) dest)) return false;
+
+        size_t match_length = token & NIBBLE_MAX;
+        if(match_length == NIBBLE_MAX && !read_length(&in, in_end, &match_length)) return false;
+        match_length += MIN_MATCH;
+        if(match_length > (size_t) (out_end - out)) return false;
+
+        // Byte wise, the match may overlap the bytes it produces
+        for(size_t j = 0; j < match_length; j++, out++) *out = *(out - offset);
+    }
+    return out == out_end;
+}
@@ -26,6 +26,12 @@ static void transplant(rb_tree_t *tree, rb_node_t *u, rb_node_t *v) {
     if(v != nullptr) v->parent = u->parent;
 }
 
+/// Recompute augmented data from node up to the root.
+static void propagate(rb_tree_t *tree, rb_node_t *node) {
+    if(tree->update == nullptr) return;
+    for(; node != nullptr; node = node->parent) tree->update(node);
+}
+
 static rb_node_t *rotate(rb_tree_t *tree, rb_node_t *node, rb_direction_t direction) {
     rb_node_t *rotation_parent = node->parent;
     rb_node_t *new_root = node->children[1 - direction];
@@ -43,6 +49,11 @@ static rb_node_t *rotate(rb_tree_t *tree, rb_node_t *node, rb_direction_t direct
         tree->root = new_root;
     }
 
+    if(tree->update != nullptr) {
+        tree->update(node);
+        tree->update(new_root);
+    }
+
     return new_root;
 }
 
@@ -112,9 +123,11 @@ void rb_insert(rb_tree_t *tree, rb_node_t *node) {
     if(node->parent == nullptr) {
         tree->root = node;
         node->red = false;
+        propagate(tree, node);
         return;
     }
     node->parent->children[direction] = node;
+    propagate(tree, node);
 
     if(node->parent->parent == nullptr) return;
 
@@ -160,6 +173,8 @@ void rb_remove(rb_tree_t *tree, rb_node_t *node) {
 
     ASSERT(x_p == nullptr || x == x_p->left || x == x_p->right);
 
+    propagate(tree, x_p);
+
     if(original_is_red) return;
 
     while(x != tree->root && !IS_RED(x)) {
@@ -219,6 +234,10 @@ void rb_remove(rb_tree_t *tree, rb_node_t *node) {
     if(x) x->red = false;
 }
 
+void rb_update(rb_tree_t *tree, rb_node_t *node) {
+    propagate(tree, node);
+}
+
 rb_node_t *rb_search(rb_tree_t *tree, rb_value_t search_value, rb_search_type_t search_type) {
     rb_node_t *nearest_node = nullptr;
     rb_value_t nearest_value = 0;
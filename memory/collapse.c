@@ -0,0 +1,38 @@
+#include "memory/collapse.h"
+
+#include "arch/ptm.h"
+#include "arch/sched.h"
+#include "common/log.h"
+#include "lib/container.h"
+#include "memory/vm.h"
+#include "sched/sched.h"
+
+#define THREAD_INTERVAL (5'000 * (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND))
+
+/// Attribute changes to part of a big page split it for good, once the pages of a split page
+/// agree again they are merged back. Only direct regions are collapsed, the pages of other
+/// regions are tracked one by one.
+/// OPTIMIZE: regions that did not change since the last pass are scanned again
+static void collapse_thread() {
+    vm_address_space_t *address_space = g_vm_global_address_space;
+    while(true) {
+        size_t count = 0;
+
+        rwlock_read_acquire_nodw(&address_space->lock);
+        rb_node_t *node = rb_search(&address_space->regions, address_space->start, RB_SEARCH_TYPE_NEAREST_GTE);
+        while(node != nullptr) {
+            vm_region_t *region = CONTAINER_OF(node, vm_region_t, rb_node);
+            if(region->type == VM_REGION_TYPE_DIRECT) count += arch_ptm_collapse(address_space, region->base, region->length);
+            node = rb_search(&address_space->regions, region->base + region->length, RB_SEARCH_TYPE_NEAREST_GTE);
+        }
+        rwlock_read_release_nodw(&address_space->lock);
+
+        if(count > 0) log(LOG_LEVEL_DEBUG, "COLLAPSE", "collapsed %lu page tables", count);
+
+        sched_sleep(THREAD_INTERVAL);
+    }
+}
+
+thread_t *collapse_thread_create() {
+    return arch_sched_thread_create_kernel(collapse_thread);
+}
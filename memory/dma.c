@@ -0,0 +1,196 @@
+#include "memory/dma.h"
+
+#include "arch/mem.h"
+#include "arch/page.h"
+#include "arch/ptm.h"
+#include "common/assert.h"
+#include "common/lock/spinlock.h"
+#include "common/log.h"
+#include "lib/container.h"
+#include "lib/math.h"
+#include "lib/mem.h"
+#include "memory/earlymem.h"
+#include "memory/hhdm.h"
+#include "memory/page.h"
+#include "memory/pmm.h"
+
+/// The pool is a contiguous run of early memory above the low zone and below 4 GiB, it backs
+/// coherent buffers that do not fit a buddy block or the device mask, and bounce buffers.
+/// OPTIMIZE: without page migration the pool cannot be lent to movable allocations while idle
+
+#define POOL_PAGE_COUNT 1024
+#define POOL_LIMIT 0x1'0000'0000
+
+static spinlock_t g_pool_lock = SPINLOCK_INIT;
+static uintptr_t g_pool_base = 0;
+static size_t g_pool_page_count = 0;
+static uint64_t g_pool_bitmap[POOL_PAGE_COUNT / 64] = {};
+
+static bool pool_bit(size_t i) {
+    return (g_pool_bitmap[i / 64] & (1llu << (i % 64))) != 0;
+}
+
+static void pool_bits_set(size_t start, size_t count, bool value) {
+    for(size_t i = start; i < start + count; i++) {
+        if(value) {
+            g_pool_bitmap[i / 64] |= 1llu << (i % 64);
+        } else {
+            g_pool_bitmap[i / 64] &= ~(1llu << (i % 64));
+        }
+    }
+}
+
+/// First fit allocation of contiguous pool pages.
+/// @returns physical address or 0 if the pool is exhausted
+static uintptr_t pool_alloc(size_t page_count) {
+    spinlock_acquire_nodw(&g_pool_lock);
+    size_t run = 0;
+    for(size_t i = 0; i < g_pool_page_count; i++) {
+        if(pool_bit(i)) {
+            run = 0;
+            continue;
+        }
+        if(++run < page_count) continue;
+
+        size_t start = i + 1 - page_count;
+        pool_bits_set(start, page_count, true);
+        spinlock_release_nodw(&g_pool_lock);
+        return g_pool_base + start * ARCH_PAGE_GRANULARITY;
+    }
+    spinlock_release_nodw(&g_pool_lock);
+    return 0;
+}
+
+static void pool_free(uintptr_t physical_address, size_t page_count) {
+    ASSERT(dma_pool_contains(physical_address));
+    spinlock_acquire_nodw(&g_pool_lock);
+    pool_bits_set((physical_address - g_pool_base) / ARCH_PAGE_GRANULARITY, page_count, false);
+    spinlock_release_nodw(&g_pool_lock);
+}
+
+void dma_pool_carve() {
+    LIST_ITERATE(&g_earlymem_regions, node) {
+        earlymem_region_t *region = CONTAINER_OF(node, earlymem_region_t, list_node);
+
+        size_t run = 0;
+        for(size_t offset = 0; offset < region->length; offset += ARCH_PAGE_GRANULARITY) {
+            uintptr_t address = region->base + offset;
+            if(address < ARCH_MEM_LOW_SIZE) continue;
+            if(address + ARCH_PAGE_GRANULARITY > POOL_LIMIT) break;
+
+            if(!earlymem_region_isfree(region, offset)) {
+                run = 0;
+                continue;
+            }
+            if(++run < POOL_PAGE_COUNT) continue;
+
+            g_pool_base = address + ARCH_PAGE_GRANULARITY - POOL_PAGE_COUNT * ARCH_PAGE_GRANULARITY;
+            g_pool_page_count = POOL_PAGE_COUNT;
+            log(LOG_LEVEL_DEBUG, "DMA", "pool %#lx -> %#lx", g_pool_base, g_pool_base + g_pool_page_count * ARCH_PAGE_GRANULARITY);
+            return;
+        }
+    }
+    log(LOG_LEVEL_WARN, "DMA", "no memory for the contiguous pool");
+}
+
+bool dma_pool_contains(uintptr_t physical_address) {
+    return physical_address >= g_pool_base && physical_address < g_pool_base + g_pool_page_count * ARCH_PAGE_GRANULARITY;
+}
+
+bool dma_alloc_coherent(size_t size, uintptr_t mask, vm_cache_t cache, PARAM_OUT(dma_buffer_t *) buffer) {
+    size = MATH_CEIL(size, ARCH_PAGE_GRANULARITY);
+    size_t page_count = size / ARCH_PAGE_GRANULARITY;
+
+    uintptr_t physical_address = 0;
+    bool pooled = false;
+    if(page_count <= PMM_ORDER_TO_PAGECOUNT(PMM_MAX_ORDER)) {
+        pmm_block_t *block = pmm_alloc_pages(page_count, PMM_FLAG_ZERO);
+        physical_address = PAGE_PADDR(PAGE_FROM_BLOCK(block));
+        if(physical_address + size - 1 > mask) {
+            pmm_free(block);
+            physical_address = 0;
+        }
+    }
+    if(physical_address == 0) {
+        physical_address = pool_alloc(page_count);
+        if(physical_address == 0) return false;
+        if(physical_address + size - 1 > mask) {
+            pool_free(physical_address, page_count);
+            return false;
+        }
+        mem_clear((void *) HHDM(physical_address), size);
+        pooled = true;
+    }
+
+    void *virtual_address = (void *) HHDM(physical_address);
+    if(cache != VM_CACHE_STANDARD) virtual_address = vm_map_direct(g_vm_global_address_space, nullptr, size, VM_PROT_RW, cache, physical_address, VM_FLAG_NONE);
+
+    buffer->virtual_address = virtual_address;
+    buffer->device_address = physical_address;
+    buffer->size = size;
+    buffer->cache = cache;
+    buffer->pooled = pooled;
+    return true;
+}
+
+void dma_free_coherent(dma_buffer_t *buffer) {
+    if(buffer->cache != VM_CACHE_STANDARD) vm_unmap(g_vm_global_address_space, buffer->virtual_address, buffer->size);
+
+    if(buffer->pooled) {
+        pool_free(buffer->device_address, buffer->size / ARCH_PAGE_GRANULARITY);
+    } else {
+        pmm_free(&PAGE(buffer->device_address)->block);
+    }
+}
+
+bool dma_map(void *buffer, size_t size, uintptr_t mask, dma_direction_t direction, PARAM_OUT(dma_mapping_t *) mapping) {
+    ASSERT(size > 0);
+
+    mapping->size = size;
+    mapping->direction = direction;
+    mapping->buffer = buffer;
+    mapping->bounce = nullptr;
+
+    // The device can access the buffer directly if it is physically contiguous and within the mask
+    uintptr_t device_address;
+    bool direct = arch_ptm_physical(g_vm_global_address_space, (uintptr_t) buffer, &device_address);
+    for(uintptr_t address = MATH_FLOOR((uintptr_t) buffer, ARCH_PAGE_GRANULARITY) + ARCH_PAGE_GRANULARITY; direct && address < (uintptr_t) buffer + size; address += ARCH_PAGE_GRANULARITY) {
+        uintptr_t physical_address;
+        if(!arch_ptm_physical(g_vm_global_address_space, address, &physical_address) || physical_address != device_address + (address - (uintptr_t) buffer)) direct = false;
+    }
+    if(direct && device_address + size - 1 <= mask) {
+        mapping->device_address = device_address;
+        return true;
+    }
+
+    uintptr_t bounce = pool_alloc(MATH_DIV_CEIL(size, ARCH_PAGE_GRANULARITY));
+    if(bounce == 0) return false;
+    if(bounce + size - 1 > mask) {
+        pool_free(bounce, MATH_DIV_CEIL(size, ARCH_PAGE_GRANULARITY));
+        return false;
+    }
+
+    mapping->device_address = bounce;
+    mapping->bounce = (void *) HHDM(bounce);
+    dma_sync_for_device(mapping);
+    return true;
+}
+
+void dma_unmap(dma_mapping_t *mapping) {
+    if(mapping->bounce == nullptr) return;
+
+    dma_sync_for_cpu(mapping);
+    pool_free(mapping->device_address, MATH_DIV_CEIL(mapping->size, ARCH_PAGE_GRANULARITY));
+    mapping->bounce = nullptr;
+}
+
+void dma_sync_for_cpu(dma_mapping_t *mapping) {
+    // DMA is cache coherent on x86_64, only bounce buffers need syncing
+    if(mapping->bounce == nullptr || mapping->direction == DMA_DIRECTION_TO_DEVICE) return;
+    mem_copy(mapping->buffer, mapping->bounce, mapping->size);
+}
+
+void dma_sync_for_device(dma_mapping_t *mapping) {
+    if(mapping->bounce == nullptr || mapping->direction == DMA_DIRECTION_FROM_DEVICE) return;
+    mem_copy(mapping->bounce, mapping->buffer, mapping->size);
+}
@@ -11,6 +11,8 @@
 #include "memory/slab.h"
 #include "sys/hook.h"
 
+#include <stdint.h>
+
 #define SLAB_8X_COUNT (sizeof(g_slab_8x_sizes) / sizeof(*g_slab_8x_sizes))
 #define SLAB_128X_COUNT (sizeof(g_slab_128x_sizes) / sizeof(*g_slab_128x_sizes))
 #define SLAB_OTHER_COUNT (sizeof(g_slab_other_sizes) / sizeof(*g_slab_other_sizes))
@@ -63,6 +65,7 @@ void *heap_realloc(void *address, size_t current_size, size_t new_size) {
 }
 
 void *heap_reallocarray(void *array, size_t element_size, size_t current_count, size_t new_count) {
+    ASSERT(element_size == 0 || new_count <= SIZE_MAX / element_size);
     return heap_realloc(array, current_count * element_size, new_count * element_size);
 }
 
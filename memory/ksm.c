@@ -0,0 +1,227 @@
+#include "memory/ksm.h"
+
+#include "arch/page.h"
+#include "arch/sched.h"
+#include "common/assert.h"
+#include "common/lock/spinlock.h"
+#include "common/log.h"
+#include "lib/container.h"
+#include "lib/rb.h"
+#include "memory/heap.h"
+#include "memory/hhdm.h"
+#include "memory/page.h"
+#include "memory/pmm.h"
+#include "memory/vm.h"
+#include "sched/sched.h"
+
+/// Merged frames are kept in a stable tree keyed by the hash of their contents, and looked
+/// up by address through a second tree. Candidates are only remembered by hash for the
+/// duration of a pass, a frame is promoted once a second frame with the same hash shows up,
+/// the other frame is merged into it when the scanner gets to it again. Every mapping of a
+/// merged frame holds a reference to its page and is counted in its mapcount.
+///
+/// Nothing here allocates with the lock held, reclaim looks up merged frames.
+
+#define DEFAULT_PAGES_TO_SCAN 100
+#define MAX_PAGE_SHARING UINT16_MAX /* Bounded by the page mapcount */
+#define DEFAULT_INTERVAL (20 * (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND))
+
+typedef struct {
+    uint64_t hash;
+    uintptr_t physical_address;
+    rb_node_t rb_node_hash;
+    rb_node_t rb_node_address;
+} merged_frame_t;
+
+typedef struct {
+    uint64_t hash;
+    uintptr_t physical_address;
+    rb_node_t rb_node;
+} candidate_t;
+
+static rb_value_t merged_frame_hash_value(rb_node_t *node) {
+    return CONTAINER_OF(node, merged_frame_t, rb_node_hash)->hash;
+}
+
+static rb_value_t merged_frame_address_value(rb_node_t *node) {
+    return CONTAINER_OF(node, merged_frame_t, rb_node_address)->physical_address;
+}
+
+static rb_value_t candidate_value(rb_node_t *node) {
+    return CONTAINER_OF(node, candidate_t, rb_node)->hash;
+}
+
+static spinlock_t g_ksm_lock = SPINLOCK_INIT;
+static rb_tree_t g_stable_by_hash = RB_TREE_INIT(merged_frame_hash_value);
+static rb_tree_t g_stable_by_address = RB_TREE_INIT(merged_frame_address_value);
+static rb_tree_t g_candidates = RB_TREE_INIT(candidate_value);
+
+static ksm_tunables_t g_tunables = { .run = false, .pages_to_scan = DEFAULT_PAGES_TO_SCAN, .interval = DEFAULT_INTERVAL };
+static ksm_stats_t g_stats = {};
+
+/// @warning Assumes ksm lock is acquired.
+static merged_frame_t *merged_frame_find(uintptr_t physical_address) {
+    rb_node_t *node = rb_search(&g_stable_by_address, physical_address, RB_SEARCH_TYPE_EXACT);
+    if(node == nullptr) return nullptr;
+    return CONTAINER_OF(node, merged_frame_t, rb_node_address);
+}
+
+static void ksm_thread() {
+    while(true) {
+        ksm_tunables_t tunables = ksm_tunables_get();
+        if(tunables.run) {
+            size_t count = vm_merge_scan(tunables.pages_to_scan);
+
+            spinlock_acquire_nodw(&g_ksm_lock);
+            g_stats.pages_scanned += count;
+            spinlock_release_nodw(&g_ksm_lock);
+        }
+
+        sched_sleep(tunables.interval);
+    }
+}
+
+thread_t *ksm_thread_create() {
+    return arch_sched_thread_create_kernel(ksm_thread);
+}
+
+uint64_t ksm_hash(uintptr_t physical_address) {
+    uint64_t *data = (uint64_t *) HHDM(physical_address);
+
+    uint64_t hash = 0xCBF2'9CE4'8422'2325;
+    for(size_t i = 0; i < ARCH_PAGE_GRANULARITY / sizeof(uint64_t); i++) {
+        hash ^= data[i];
+        hash *= 0x100'0000'01B3;
+    }
+    return hash;
+}
+
+bool ksm_active() {
+    return __atomic_load_n(&g_stats.pages_shared, __ATOMIC_RELAXED) != 0;
+}
+
+bool ksm_frame(uintptr_t physical_address) {
+    // Frames are promoted and mapped under the region lock, which callers hold, so this is not racy for their pages
+    if(!ksm_active()) return false;
+
+    spinlock_acquire_nodw(&g_ksm_lock);
+    bool found = merged_frame_find(physical_address) != nullptr;
+    spinlock_release_nodw(&g_ksm_lock);
+    return found;
+}
+
+bool ksm_lookup(uint64_t hash, PARAM_OUT(uintptr_t *) physical_address) {
+    spinlock_acquire_nodw(&g_ksm_lock);
+    rb_node_t *node = rb_search(&g_stable_by_hash, hash, RB_SEARCH_TYPE_EXACT);
+    if(node == nullptr) {
+        spinlock_release_nodw(&g_ksm_lock);
+        return false;
+    }
+
+    merged_frame_t *frame = CONTAINER_OF(node, merged_frame_t, rb_node_hash);
+    page_t *page = PAGE(frame->physical_address);
+    if(page->mapcount == MAX_PAGE_SHARING) {
+        spinlock_release_nodw(&g_ksm_lock);
+        return false;
+    }
+    page->mapcount++;
+    page_get(page);
+    g_stats.pages_sharing++;
+    *physical_address = frame->physical_address;
+    spinlock_release_nodw(&g_ksm_lock);
+    return true;
+}
+
+bool ksm_candidate(uintptr_t physical_address, uint64_t hash) {
+    candidate_t *candidate = heap_alloc(sizeof(candidate_t));
+    candidate->hash = hash;
+    candidate->physical_address = physical_address;
+
+    spinlock_acquire_nodw(&g_ksm_lock);
+    rb_node_t *node = rb_search(&g_candidates, hash, RB_SEARCH_TYPE_EXACT);
+    if(node == nullptr) {
+        rb_insert(&g_candidates, &candidate->rb_node);
+        spinlock_release_nodw(&g_ksm_lock);
+        return false;
+    }
+    bool match = CONTAINER_OF(node, candidate_t, rb_node)->physical_address != physical_address;
+    spinlock_release_nodw(&g_ksm_lock);
+
+    heap_free(candidate, sizeof(candidate_t));
+    return match;
+}
+
+void ksm_promote(uintptr_t physical_address, uint64_t hash) {
+    merged_frame_t *frame = heap_alloc(sizeof(merged_frame_t));
+    frame->hash = hash;
+    frame->physical_address = physical_address;
+
+    spinlock_acquire_nodw(&g_ksm_lock);
+    ASSERT(merged_frame_find(physical_address) == nullptr);
+    PAGE(physical_address)->mapcount = 1;
+    rb_insert(&g_stable_by_hash, &frame->rb_node_hash);
+    rb_insert(&g_stable_by_address, &frame->rb_node_address);
+    __atomic_add_fetch(&g_stats.pages_shared, 1, __ATOMIC_RELAXED);
+    spinlock_release_nodw(&g_ksm_lock);
+
+    LOG_TRACE("KSM", "promoted %#lx (hash: %#lx)", physical_address, hash);
+}
+
+void ksm_release(uintptr_t physical_address) {
+    spinlock_acquire_nodw(&g_ksm_lock);
+    merged_frame_t *frame = merged_frame_find(physical_address);
+    page_t *page = PAGE(physical_address);
+    ASSERT(frame != nullptr && page->mapcount > 0);
+    if(--page->mapcount > 0) {
+        g_stats.pages_sharing--;
+        spinlock_release_nodw(&g_ksm_lock);
+        page_put(page);
+        return;
+    }
+    rb_remove(&g_stable_by_hash, &frame->rb_node_hash);
+    rb_remove(&g_stable_by_address, &frame->rb_node_address);
+    __atomic_sub_fetch(&g_stats.pages_shared, 1, __ATOMIC_RELAXED);
+    spinlock_release_nodw(&g_ksm_lock);
+
+    page_put(page);
+    heap_free(frame, sizeof(merged_frame_t));
+}
+
+void ksm_pass_complete() {
+    spinlock_acquire_nodw(&g_ksm_lock);
+    rb_tree_t candidates = g_candidates;
+    g_candidates = RB_TREE_INIT(candidate_value);
+    g_stats.full_scans++;
+    spinlock_release_nodw(&g_ksm_lock);
+
+    rb_node_t *node;
+    while((node = rb_search(&candidates, 0, RB_SEARCH_TYPE_NEAREST)) != nullptr) {
+        rb_remove(&candidates, node);
+        heap_free(CONTAINER_OF(node, candidate_t, rb_node), sizeof(candidate_t));
+    }
+}
+
+ksm_tunables_t ksm_tunables_get() {
+    spinlock_acquire_nodw(&g_ksm_lock);
+    ksm_tunables_t tunables = g_tunables;
+    spinlock_release_nodw(&g_ksm_lock);
+    return tunables;
+}
+
+bool ksm_tunables_set(ksm_tunables_t tunables) {
+    if(tunables.pages_to_scan == 0 || tunables.interval == 0) return false;
+
+    spinlock_acquire_nodw(&g_ksm_lock);
+    g_tunables = tunables;
+    spinlock_release_nodw(&g_ksm_lock);
+
+    log(LOG_LEVEL_DEBUG, "KSM", "tunables (run: %u, pages_to_scan: %lu, interval: %lu)", tunables.run, tunables.pages_to_scan, tunables.interval);
+    return true;
+}
+
+ksm_stats_t ksm_stats() {
+    spinlock_acquire_nodw(&g_ksm_lock);
+    ksm_stats_t stats = g_stats;
+    spinlock_release_nodw(&g_ksm_lock);
+    return stats;
+}
@@ -1,17 +1,27 @@
 #include "memory/pmm.h"
 
+#include "arch/cpu.h"
+#include "arch/interrupt.h"
 #include "arch/mem.h"
 #include "arch/page.h"
 #include "common/assert.h"
 #include "common/log.h"
+#include "lib/expect.h"
+#include "lib/math.h"
 #include "lib/mem.h"
 #include "memory/hhdm.h"
 #include "memory/page.h"
+#include "memory/reclaim.h"
 
 #include <stdint.h>
 
 #define BLOCK_PADDR(BLOCK) PAGE_PADDR(PAGE_FROM_BLOCK(BLOCK))
 
+#define RECLAIM_PASSES 2 /* The first pass might only age pages */
+
+#define WATERMARK_MIN_DIVISOR 128
+#define WATERMARK_MIN_PAGES 16
+
 pmm_zone_t g_pmm_zone_low = {
     .name = "LOW",
     .start = ARCH_PAGE_GRANULARITY,
@@ -55,6 +65,11 @@ void pmm_region_add(uintptr_t base, size_t size, bool is_free) {
         size_t page_count = local_size / ARCH_PAGE_GRANULARITY;
 
         zone->total_page_count += page_count;
+        if(is_free) zone->free_page_count += page_count;
+
+        zone->watermarks.min = MATH_MAX(zone->total_page_count / WATERMARK_MIN_DIVISOR, (size_t) WATERMARK_MIN_PAGES);
+        zone->watermarks.low = zone->watermarks.min + zone->watermarks.min / 4;
+        zone->watermarks.high = zone->watermarks.min + zone->watermarks.min / 2;
 
         for(size_t j = 0; j < page_count;) {
             // Approximate the order
@@ -79,6 +94,9 @@ void pmm_region_add(uintptr_t base, size_t size, bool is_free) {
                 page->block.order = 0;
                 page->block.max_order = order;
                 page->block.free = is_free;
+                page->refcount = is_free ? 0 : 1;
+                page->mapcount = 0;
+                page->flags = is_free ? 0 : PAGE_FLAG_RESERVED;
                 if(is_free) list_push(&zone->lists[order], &page->block.list_node);
             }
 
@@ -87,16 +105,46 @@ void pmm_region_add(uintptr_t base, size_t size, bool is_free) {
     }
 }
 
+/// Run the shrinkers until memory is freed in the zone, aiming for the high watermark.
+/// @returns false if nothing could be reclaimed
+static bool reclaim(pmm_zone_t *zone) {
+    // Shrinkers take locks that may not be taken from interrupt handlers
+    if(ARCH_CPU_CURRENT_READ(flags.in_interrupt_hard)) return false;
+    // An allocation made by a shrinker cannot reclaim, the shrinkers lock is held
+    if(ARCH_CPU_CURRENT_READ(flags.in_reclaim)) return false;
+    // Swapping out shoots down TLB entries which needs interrupts, a masked caller makes do with what is free
+    if(!arch_interrupt_state()) return false;
+
+    size_t free_page_count = __atomic_load_n(&zone->free_page_count, __ATOMIC_RELAXED);
+    size_t target = zone->watermarks.high > free_page_count ? zone->watermarks.high - free_page_count : 1;
+    for(size_t i = 0; i < RECLAIM_PASSES; i++) {
+        reclaim_shrink(target);
+        if(__atomic_load_n(&zone->free_page_count, __ATOMIC_RELAXED) > free_page_count) return true;
+    }
+    return false;
+}
+
 pmm_block_t *pmm_alloc(pmm_order_t order, pmm_flags_t flags) {
     LOG_TRACE("PMM", "alloc(oder: %u, flags: %u)", order, flags);
     ASSERT(order <= PMM_MAX_ORDER);
 
     pmm_order_t avl_order = order;
     pmm_zone_t *zone = (flags & PMM_FLAG_ZONE_LOW) != 0 ? &g_pmm_zone_low : &g_pmm_zone_normal;
+
+    // Below the min watermark the allocation pays for reclaim, the rest is left to the reclaim thread
+    bool may_reclaim = (flags & PMM_FLAG_NO_RECLAIM) == 0;
+    if(EXPECT_UNLIKELY(may_reclaim && __atomic_load_n(&zone->free_page_count, __ATOMIC_RELAXED) < zone->watermarks.min + PMM_ORDER_TO_PAGECOUNT(order))) reclaim(zone);
+
     spinlock_acquire_nodw(&zone->lock);
     while(zone->lists[avl_order].count == 0) {
         avl_order++;
-        if(avl_order > PMM_MAX_ORDER) panic("PMM", "out of memory");
+        if(avl_order <= PMM_MAX_ORDER) continue;
+
+        spinlock_release_nodw(&zone->lock);
+        if(!may_reclaim) return nullptr;
+        if(!reclaim(zone)) panic("PMM", "out of memory");
+        spinlock_acquire_nodw(&zone->lock);
+        avl_order = order;
     }
 
     pmm_block_t *block = CONTAINER_OF(list_pop(&zone->lists[avl_order]), pmm_block_t, list_node);
@@ -106,11 +154,16 @@ pmm_block_t *pmm_alloc(pmm_order_t order, pmm_flags_t flags) {
         buddy->free = true;
         list_push(&zone->lists[avl_order - 1], &buddy->list_node);
     }
+    __atomic_sub_fetch(&zone->free_page_count, PMM_ORDER_TO_PAGECOUNT(order), __ATOMIC_RELAXED);
     spinlock_release_nodw(&zone->lock);
 
     block->order = order;
     block->free = false;
-    zone->free_page_count -= PMM_ORDER_TO_PAGECOUNT(order);
+
+    page_t *page = PAGE_FROM_BLOCK(block);
+    page->refcount = 1;
+    page->mapcount = 0;
+    page->flags = 0;
 
     if((flags & PMM_FLAG_ZERO) != 0) mem_clear((void *) HHDM(BLOCK_PADDR(block)), PMM_ORDER_TO_PAGECOUNT(order) * ARCH_PAGE_GRANULARITY);
 
@@ -130,11 +183,11 @@ pmm_block_t *pmm_alloc_page(pmm_flags_t flags) {
 void pmm_free(pmm_block_t *block) {
     LOG_TRACE("PMM", "free(%#lx, order: %u, max_order: %u)", BLOCK_PADDR(block), block->order, block->max_order);
     pmm_zone_t *zone = (BLOCK_PADDR(block) & ~ARCH_MEM_LOW_MASK) > 0 ? &g_pmm_zone_normal : &g_pmm_zone_low;
-    zone->free_page_count += PMM_ORDER_TO_PAGECOUNT(block->order);
 
     block->free = true;
 
     spinlock_acquire_nodw(&zone->lock);
+    __atomic_add_fetch(&zone->free_page_count, PMM_ORDER_TO_PAGECOUNT(block->order), __ATOMIC_RELAXED);
     while(block->order < block->max_order) {
         pmm_block_t *buddy = &PAGE(BLOCK_PADDR(block) ^ (PMM_ORDER_TO_PAGECOUNT(block->order) * ARCH_PAGE_GRANULARITY))->block;
         if(!buddy->free || buddy->order == buddy->max_order || buddy->order != block->order) break;
@@ -0,0 +1,65 @@
+#include "memory/reclaim.h"
+
+#include "arch/cpu.h"
+#include "arch/sched.h"
+#include "common/lock/spinlock.h"
+#include "common/log.h"
+#include "lib/container.h"
+#include "memory/pmm.h"
+#include "sched/sched.h"
+
+#define THREAD_INTERVAL (10 * (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND))
+
+static spinlock_t g_shrinkers_lock = SPINLOCK_INIT;
+static list_t g_shrinkers = LIST_INIT;
+
+/// Reclaim until every zone below its low watermark is back at its high watermark.
+/// OPTIMIZE: the allocator could wake the thread when a zone crosses the low watermark instead of it polling
+static void reclaim_thread() {
+    pmm_zone_t *zones[] = { &g_pmm_zone_low, &g_pmm_zone_normal };
+    while(true) {
+        for(size_t i = 0; i < sizeof(zones) / sizeof(pmm_zone_t *); i++) {
+            pmm_zone_t *zone = zones[i];
+            if(__atomic_load_n(&zone->free_page_count, __ATOMIC_RELAXED) >= zone->watermarks.low) continue;
+
+            size_t free_page_count;
+            while((free_page_count = __atomic_load_n(&zone->free_page_count, __ATOMIC_RELAXED)) < zone->watermarks.high) {
+                if(reclaim_shrink(zone->watermarks.high - free_page_count) == 0) break;
+            }
+            LOG_TRACE("RECLAIM", "zone %s at %lu free pages (low: %lu, high: %lu)", zone->name, free_page_count, zone->watermarks.low, zone->watermarks.high);
+        }
+
+        sched_sleep(THREAD_INTERVAL);
+    }
+}
+
+void reclaim_shrinker_register(reclaim_shrinker_t *shrinker) {
+    spinlock_acquire_nodw(&g_shrinkers_lock);
+    list_push_back(&g_shrinkers, &shrinker->list_node);
+    spinlock_release_nodw(&g_shrinkers_lock);
+
+    log(LOG_LEVEL_DEBUG, "RECLAIM", "registered shrinker `%s`", shrinker->name);
+}
+
+size_t reclaim_shrink(size_t page_count) {
+    size_t count = 0;
+
+    // Preemption is disabled while the lock is held, so the flag stays with this thread
+    if(ARCH_CPU_CURRENT_READ(flags.in_reclaim)) return 0;
+    spinlock_acquire_nodw(&g_shrinkers_lock);
+    ARCH_CPU_CURRENT_WRITE(flags.in_reclaim, true);
+    LIST_ITERATE(&g_shrinkers, node) {
+        reclaim_shrinker_t *shrinker = CONTAINER_OF(node, reclaim_shrinker_t, list_node);
+        count += shrinker->shrink(page_count - count);
+        if(count >= page_count) break;
+    }
+    ARCH_CPU_CURRENT_WRITE(flags.in_reclaim, false);
+    spinlock_release_nodw(&g_shrinkers_lock);
+
+    LOG_TRACE("RECLAIM", "shrinkers freed %lu of %lu pages", count, page_count);
+    return count;
+}
+
+thread_t *reclaim_thread_create() {
+    return arch_sched_thread_create_kernel(reclaim_thread);
+}
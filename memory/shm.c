@@ -0,0 +1,109 @@
+#include "memory/shm.h"
+
+#include "arch/page.h"
+#include "common/assert.h"
+#include "common/log.h"
+#include "fs/tmpfs.h"
+#include "lib/container.h"
+#include "memory/heap.h"
+
+static spinlock_t g_shm_lock = SPINLOCK_INIT;
+static list_t g_shm_objects = LIST_INIT;
+static long g_shm_next_id = 1;
+static vfs_t *g_shm_vfs = nullptr; /* Private tmpfs instance, not mounted anywhere */
+
+shm_t *shm_create(size_t size, long owner) {
+    if(size % ARCH_PAGE_GRANULARITY != 0 || size > TMPFS_MAX_FILE_SIZE) return nullptr;
+
+    spinlock_acquire_nodw(&g_shm_lock);
+    if(g_shm_vfs == nullptr) {
+        g_shm_vfs = heap_alloc(sizeof(vfs_t));
+        g_shm_vfs->ops = &g_tmpfs_ops;
+        g_shm_vfs->private_data = nullptr;
+        g_shm_vfs->mount_point = nullptr;
+        vfs_result_t res = g_shm_vfs->ops->mount(g_shm_vfs);
+        ASSERT(res == VFS_RESULT_OK);
+    }
+
+    shm_t *shm = heap_alloc(sizeof(shm_t));
+    shm->id = g_shm_next_id++;
+    shm->owner = owner;
+    shm->refcount = 2; /* One for the list and one for the caller */
+    shm->lock = SPINLOCK_INIT;
+    shm->node = tmpfs_create_anonymous(g_shm_vfs);
+    shm->size = 0;
+    list_push_back(&g_shm_objects, &shm->list_node);
+    spinlock_release_nodw(&g_shm_lock);
+
+    bool success = shm_resize(shm, size);
+    ASSERT(success);
+
+    LOG_TRACE("SHM", "create(size: %#lx) -> %li", size, shm->id);
+    return shm;
+}
+
+shm_t *shm_lookup(long id) {
+    shm_t *found = nullptr;
+    spinlock_acquire_nodw(&g_shm_lock);
+    LIST_ITERATE(&g_shm_objects, node) {
+        shm_t *shm = CONTAINER_OF(node, shm_t, list_node);
+        if(shm->id != id) continue;
+        __atomic_add_fetch(&shm->refcount, 1, __ATOMIC_RELAXED);
+        found = shm;
+        break;
+    }
+    spinlock_release_nodw(&g_shm_lock);
+    return found;
+}
+
+void shm_put(shm_t *shm) {
+    if(__atomic_sub_fetch(&shm->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    // The node stays behind for the mappings that still point at it, tmpfs has no way to delete it
+    vfs_result_t res = shm->node->ops->truncate(shm->node, 0);
+    ASSERT(res == VFS_RESULT_OK);
+    LOG_TRACE("SHM", "freed %li", shm->id);
+    heap_free(shm, sizeof(shm_t));
+}
+
+bool shm_destroy(long id, long owner) {
+    shm_t *found = nullptr;
+    spinlock_acquire_nodw(&g_shm_lock);
+    LIST_ITERATE(&g_shm_objects, node) {
+        shm_t *shm = CONTAINER_OF(node, shm_t, list_node);
+        if(shm->id != id || shm->owner != owner) continue;
+        list_node_delete(&g_shm_objects, &shm->list_node);
+        found = shm;
+        break;
+    }
+    spinlock_release_nodw(&g_shm_lock);
+    if(found == nullptr) return false;
+
+    shm_put(found);
+    return true;
+}
+
+bool shm_resize(shm_t *shm, size_t size) {
+    if(size % ARCH_PAGE_GRANULARITY != 0) return false;
+
+    spinlock_acquire_nodw(&shm->lock);
+    if(size < shm->size) {
+        spinlock_release_nodw(&shm->lock);
+        return false;
+    }
+
+    vfs_result_t res = shm->node->ops->truncate(shm->node, size);
+    if(res == VFS_RESULT_OK) shm->size = size;
+    spinlock_release_nodw(&shm->lock);
+    return res == VFS_RESULT_OK;
+}
+
+void *shm_map(shm_t *shm, vm_address_space_t *address_space, size_t offset, size_t length, vm_protection_t prot) {
+    if(length == 0 || offset % ARCH_PAGE_GRANULARITY != 0 || length % ARCH_PAGE_GRANULARITY != 0) return nullptr;
+
+    spinlock_acquire_nodw(&shm->lock);
+    void *address = nullptr;
+    if(offset <= shm->size && length <= shm->size - offset) address = vm_map_file(address_space, nullptr, length, prot, VM_CACHE_STANDARD, shm->node, offset, length, VM_FLAG_SHARED | VM_FLAG_DYNAMICALLY_BACKED);
+    spinlock_release_nodw(&shm->lock);
+    return address;
+}
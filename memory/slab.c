@@ -5,6 +5,7 @@
 #include "common/assert.h"
 #include "memory/hhdm.h"
 #include "memory/page.h"
+#include "memory/reclaim.h"
 #include "sys/hook.h"
 #include "sys/init.h"
 
@@ -17,10 +18,13 @@ static list_t g_slab_caches = LIST_INIT;
 static slab_cache_t g_alloc_cache;
 static slab_cache_t g_alloc_magazine;
 
-// TODO free slabs...
+static size_t slab_capacity(slab_cache_t *cache) {
+    return (PMM_ORDER_TO_PAGECOUNT(cache->block_order) * ARCH_PAGE_GRANULARITY - sizeof(slab_t)) / cache->object_size;
+}
 
 static slab_t *cache_make_slab(slab_cache_t *cache) {
     pmm_block_t *block = pmm_alloc(cache->block_order, PMM_FLAG_NONE);
+    page_flags_set(PAGE_FROM_BLOCK(block), PAGE_FLAG_SLAB);
 
     slab_t *slab = (slab_t *) HHDM(PAGE_PADDR(PAGE_FROM_BLOCK(block)));
     slab->cache = cache;
@@ -28,9 +32,8 @@ static slab_t *cache_make_slab(slab_cache_t *cache) {
     slab->freelist = nullptr;
     slab->free_count = 0;
 
-    size_t slab_size = PMM_ORDER_TO_PAGECOUNT(cache->block_order) * ARCH_PAGE_GRANULARITY - sizeof(slab_t);
-    ASSERT(slab_size / cache->object_size > 0);
-    for(size_t i = 0; i < slab_size / cache->object_size; i++) {
+    ASSERT(slab_capacity(cache) > 0);
+    for(size_t i = 0; i < slab_capacity(cache); i++) {
         void **obj = (void **) (((uintptr_t) slab) + sizeof(slab_t) + (i * cache->object_size));
         *obj = slab->freelist;
         slab->freelist = obj;
@@ -58,9 +61,8 @@ static void *slab_direct_alloc(slab_cache_t *cache) {
     return obj;
 }
 
-static void slab_direct_free(slab_cache_t *cache, void *obj) {
-    spinlock_acquire_nodw(&cache->slabs_lock);
-
+/// @warning Assumes slabs lock is acquired.
+static void slab_release(slab_cache_t *cache, void *obj) {
     slab_t *slab = (slab_t *) (((uintptr_t) obj) & ~(PMM_ORDER_TO_PAGECOUNT(cache->block_order) * ARCH_PAGE_GRANULARITY - 1));
     *(void **) obj = slab->freelist;
     slab->freelist = obj;
@@ -69,10 +71,54 @@ static void slab_direct_free(slab_cache_t *cache, void *obj) {
         list_push(&cache->slabs_partial, &slab->list_node);
     }
     slab->free_count++;
+}
 
+static void slab_direct_free(slab_cache_t *cache, void *obj) {
+    spinlock_acquire_nodw(&cache->slabs_lock);
+    slab_release(cache, obj);
     spinlock_release_nodw(&cache->slabs_lock);
 }
 
+/// Flush the full magazines of the depots into their slabs and free the slabs that end up empty.
+/// The allocating thread might be in the middle of a cache operation so cache locks are only ever tried.
+static size_t slab_shrink(size_t page_count) {
+    size_t count = 0;
+
+    spinlock_acquire_nodw(&g_slab_caches_lock);
+    LIST_ITERATE(&g_slab_caches, node) {
+        slab_cache_t *cache = CONTAINER_OF(node, slab_cache_t, list_node);
+        if(!spinlock_try_acquire(&cache->slabs_lock)) continue;
+
+        if(spinlock_try_acquire(&cache->magazines_lock)) {
+            while(cache->magazines_full.count != 0) {
+                slab_magazine_t *magazine = CONTAINER_OF(list_pop(&cache->magazines_full), slab_magazine_t, list_node);
+                while(magazine->round_count > 0) slab_release(cache, magazine->rounds[--magazine->round_count]);
+                list_push(&cache->magazines_empty, &magazine->list_node);
+            }
+            spinlock_release_raw(&cache->magazines_lock);
+        }
+
+        list_node_t *slab_node = cache->slabs_partial.head;
+        while(slab_node != nullptr) {
+            slab_t *slab = CONTAINER_OF(slab_node, slab_t, list_node);
+            slab_node = slab_node->next;
+            if(slab->free_count != slab_capacity(cache)) continue;
+
+            list_node_delete(&cache->slabs_partial, &slab->list_node);
+            pmm_free(slab->block);
+            count += PMM_ORDER_TO_PAGECOUNT(cache->block_order);
+        }
+        spinlock_release_raw(&cache->slabs_lock);
+
+        if(count >= page_count) break;
+    }
+    spinlock_release_nodw(&g_slab_caches_lock);
+
+    return count;
+}
+
+static reclaim_shrinker_t g_slab_shrinker = { .name = "slab", .shrink = slab_shrink };
+
 slab_cache_t *slab_cache_create(const char *name, size_t object_size, pmm_order_t order) {
     ASSERT(object_size >= 8);
 
@@ -223,4 +269,6 @@ INIT_TARGET(slab, INIT_STAGE_BEFORE_MAIN, INIT_SCOPE_BSP, INIT_DEPS()) {
     list_push(&g_slab_caches, &g_alloc_magazine.list_node);
 
     HOOK_RUN(init_slab_cache);
+
+    reclaim_shrinker_register(&g_slab_shrinker);
 }
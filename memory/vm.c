@@ -1,38 +1,69 @@
 #include "memory/vm.h"
 
+#include "arch/cpu.h"
 #include "arch/mem.h"
 #include "arch/page.h"
 #include "arch/ptm.h"
 #include "arch/sched.h"
 #include "common/assert.h"
 #include "common/log.h"
+#include "lib/expect.h"
 #include "lib/math.h"
 #include "lib/mem.h"
 #include "lib/param.h"
 #include "memory/hhdm.h"
+#include "memory/ksm.h"
 #include "memory/page.h"
 #include "memory/pmm.h"
+#include "memory/reclaim.h"
+#include "memory/slab.h"
+#include "memory/vmem.h"
+#include "memory/zswap.h"
 #include "sched/process.h"
+#include "sys/hook.h"
+#include "sys/init.h"
+
+#define REGION_RESERVE_COUNT 64
+#define RECLAIM_BATCH 32
+#define MAP_BATCH 32 /* Pages handed to the page table manager at once, at most 64 */
+#define WORKING_SET_WEIGHT 4 /* Samples a working set estimate is averaged over */
 
 #define ADDRESS_IN_BOUNDS(ADDRESS, START, END) ((ADDRESS) >= (START) && (ADDRESS) < (END))
 #define SEGMENT_IN_BOUNDS(BASE, LENGTH, START, END) (ADDRESS_IN_BOUNDS((BASE), (START), (END)) && ((END) - (BASE)) >= (LENGTH))
 #define ADDRESS_IN_SEGMENT(ADDRESS, BASE, LENGTH) ((ADDRESS) >= (BASE) && (ADDRESS) < ((BASE) + (LENGTH)))
 #define SEGMENT_INTERSECTS(BASE1, LENGTH1, BASE2, LENGTH2) ((BASE1) < ((BASE2) + (LENGTH2)) && (BASE2) < ((BASE1) + (LENGTH1)))
 
+#define GAP(END, BASE) ((BASE) > (END) ? (BASE) - (END) : 0)
+
 #define PROT_EQUALS(P1, P2) ((P1)->read == (P2)->read && (P1)->write == (P2)->write && (P1)->exec == (P2)->exec)
 
 typedef enum {
     REWRITE_TYPE_DELETE,
     REWRITE_TYPE_PROTECTION,
-    REWRITE_TYPE_CACHE
+    REWRITE_TYPE_CACHE,
+    REWRITE_TYPE_HUGE_HINT,
+    REWRITE_TYPE_MERGEABLE
 } rewrite_type_t;
 
 vm_address_space_t *g_vm_global_address_space;
 
-static spinlock_t g_region_cache_lock = SPINLOCK_INIT;
-static list_t g_region_cache = LIST_INIT;
+static slab_cache_t *g_region_cache;
+
+static spinlock_t g_region_reserve_lock = SPINLOCK_INIT;
+static list_t g_region_reserve = LIST_INIT;
+static vm_region_t g_region_reserve_pool[REGION_RESERVE_COUNT];
+static bool g_region_reserve_initialized = false;
+
+static spinlock_t g_address_spaces_lock = SPINLOCK_INIT;
+static list_t g_address_spaces = LIST_INIT;
 
-static_assert(ARCH_PAGE_GRANULARITY > (sizeof(vm_region_t) * 2));
+static spinlock_t g_merge_lock = SPINLOCK_INIT;
+static size_t g_merge_pass_remaining = 0; /* Address spaces that have to wrap around before a merge pass is complete */
+
+static uintptr_t g_zero_page = 0;
+
+static vmem_t g_global_arena; /* Hands out the address space of the global address space */
+static bool g_global_arena_initialized = false;
 
 static vm_region_t *region_insert(vm_address_space_t *address_space, vm_region_t *region);
 
@@ -40,6 +71,26 @@ static rb_value_t region_node_value(rb_node_t *node) {
     return CONTAINER_OF(node, vm_region_t, rb_node)->base;
 }
 
+static void region_node_update(rb_node_t *node) {
+    vm_region_t *region = CONTAINER_OF(node, vm_region_t, rb_node);
+
+    region->subtree.start = region->base;
+    region->subtree.end = region->base + region->length;
+    region->subtree.max_gap = 0;
+
+    if(node->left != nullptr) {
+        vm_region_t *left = CONTAINER_OF(node->left, vm_region_t, rb_node);
+        region->subtree.start = left->subtree.start;
+        region->subtree.max_gap = MATH_MAX(left->subtree.max_gap, GAP(left->subtree.end, region->base));
+    }
+
+    if(node->right != nullptr) {
+        vm_region_t *right = CONTAINER_OF(node->right, vm_region_t, rb_node);
+        region->subtree.end = right->subtree.end;
+        region->subtree.max_gap = MATH_MAX(region->subtree.max_gap, MATH_MAX(right->subtree.max_gap, GAP(region->base + region->length, right->subtree.start)));
+    }
+}
+
 /// Find last region within a segment.
 static vm_region_t *find_region(vm_address_space_t *address_space, uintptr_t address, size_t length) {
     rb_node_t *node = rb_search(&address_space->regions, address + length, RB_SEARCH_TYPE_NEAREST_LT);
@@ -60,19 +111,156 @@ static bool find_hole(vm_address_space_t *address_space, uintptr_t address, size
         return true;
     }
 
-    address = address_space->start;
+    rb_node_t *node = address_space->regions.root;
+    if(node == nullptr) {
+        if(!SEGMENT_IN_BOUNDS(address_space->start, length, address_space->start, address_space->end)) return false;
+        *hole = address_space->start;
+        return true;
+    }
+
+    vm_region_t *root = CONTAINER_OF(node, vm_region_t, rb_node);
+    if(GAP(address_space->start, root->subtree.start) >= length) {
+        *hole = address_space->start;
+        return true;
+    }
+
+    if(root->subtree.max_gap < length) {
+        if(!SEGMENT_IN_BOUNDS(root->subtree.end, length, address_space->start, address_space->end)) return false;
+        *hole = root->subtree.end;
+        return true;
+    }
+
+    // Descend towards the lowest gap that fits, the augmented max gap guarantees one exists in the subtree.
     while(true) {
-        if(!SEGMENT_IN_BOUNDS(address, length, address_space->start, address_space->end)) return false;
+        vm_region_t *region = CONTAINER_OF(node, vm_region_t, rb_node);
+
+        if(node->left != nullptr) {
+            vm_region_t *left = CONTAINER_OF(node->left, vm_region_t, rb_node);
+            if(left->subtree.max_gap >= length) {
+                node = node->left;
+                continue;
+            }
+
+            if(GAP(left->subtree.end, region->base) >= length) {
+                *hole = left->subtree.end;
+                return true;
+            }
+        }
 
-        vm_region_t *region = find_region(address_space, address, length);
-        if(region == nullptr) {
-            *hole = address;
+        ASSERT(node->right != nullptr);
+        vm_region_t *right = CONTAINER_OF(node->right, vm_region_t, rb_node);
+        if(GAP(region->base + region->length, right->subtree.start) >= length) {
+            *hole = region->base + region->length;
             return true;
         }
 
-        address = region->base + region->length;
+        node = node->right;
     }
-    return false;
+}
+
+/// Reserve a range of the global address space from its arena.
+/// The arena is set up on first use, regions inserted during boot are reserved in it then.
+/// @warning Assumes address space lock is acquired.
+/// @returns true = range reserved, false = no space or the fixed range is taken
+static bool global_reserve(uintptr_t address, size_t length, bool fixed, PARAM_OUT(uintptr_t *) hole) {
+    vm_address_space_t *address_space = g_vm_global_address_space;
+    if(!g_global_arena_initialized) {
+        vmem_initialize(&g_global_arena, "global", address_space->start, MATH_FLOOR(address_space->end - address_space->start, ARCH_PAGE_GRANULARITY), ARCH_PAGE_GRANULARITY);
+
+        rb_node_t *node = rb_search(&address_space->regions, address_space->start, RB_SEARCH_TYPE_NEAREST_GTE);
+        while(node != nullptr) {
+            vm_region_t *region = CONTAINER_OF(node, vm_region_t, rb_node);
+            uintptr_t base = MATH_FLOOR(region->base, ARCH_PAGE_GRANULARITY);
+            bool reserved = vmem_xalloc(&g_global_arena, base, MATH_CEIL(region->base + region->length, ARCH_PAGE_GRANULARITY) - base);
+            ASSERT(reserved);
+            node = rb_search(&address_space->regions, region->base + region->length, RB_SEARCH_TYPE_NEAREST_GTE);
+        }
+        g_global_arena_initialized = true;
+    }
+
+    if(SEGMENT_IN_BOUNDS(address, length, address_space->start, address_space->end) && find_region(address_space, address, length) == nullptr && vmem_xalloc(&g_global_arena, address, length)) {
+        *hole = address;
+        return true;
+    }
+    if(fixed) return false;
+    return vmem_alloc(&g_global_arena, length, hole);
+}
+
+/// Release a range of the global address space to its arena.
+/// @warning Assumes address space lock is acquired.
+static void global_release(vm_address_space_t *address_space, uintptr_t address, size_t length) {
+    if(address_space != g_vm_global_address_space || !g_global_arena_initialized) return;
+    vmem_free(&g_global_arena, address, length);
+}
+
+/// Account pages mapped into or unmapped from an address space.
+static void resident_add(vm_address_space_t *address_space, long page_count) {
+    __atomic_add_fetch(&address_space->resident_pages, (size_t) page_count, __ATOMIC_RELAXED);
+}
+
+/// Charge pages allocated for user memory to the current thread.
+static void charge_allocation(vm_region_t *region, size_t page_count) {
+    if(region->address_space == g_vm_global_address_space) return;
+    arch_sched_thread_current()->accounting.pages_allocated += page_count;
+}
+
+/// Physical address of the read-only page backing reads of untouched lazily backed anonymous memory.
+static uintptr_t zero_page() {
+    uintptr_t physical_address = __atomic_load_n(&g_zero_page, __ATOMIC_ACQUIRE);
+    if(EXPECT_LIKELY(physical_address != 0)) return physical_address;
+
+    uintptr_t new_address = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_ZERO)));
+    page_flags_set(PAGE(new_address), PAGE_FLAG_RESERVED);
+    if(!__atomic_compare_exchange_n(&g_zero_page, &physical_address, new_address, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pmm_free(&PAGE(new_address)->block);
+        return physical_address;
+    }
+    return new_address;
+}
+
+/// Drop the reference a mapping holds to a page of a file region.
+/// Pages of images loaded at boot are reserved, they are never freed and not counted.
+static void file_page_put(uintptr_t physical_address) {
+    page_t *page = PAGE(physical_address);
+    if(page_flags_test(page, PAGE_FLAG_RESERVED)) return;
+    page_put(page);
+}
+
+/// Look up the filesystem page a file region can share at address.
+/// @param reference Keep the reference taken by the filesystem, for mapping the page
+/// @returns true = the page belongs to the filesystem, only shared regions may map it writable
+static bool file_shared_page(vm_region_t *region, uintptr_t address, bool reference, PARAM_OUT(uintptr_t *) physical_address) {
+    vfs_node_t *node = region->type_data.file.node;
+    if(node->ops->page == nullptr || region->cache_behavior != VM_CACHE_STANDARD) return false;
+
+    size_t region_offset = address - region->base;
+    if(region_offset >= region->type_data.file.size || region->type_data.file.size - region_offset < ARCH_PAGE_GRANULARITY) return false;
+
+    if(node->ops->page(node, region->type_data.file.offset + region_offset, physical_address) != VFS_RESULT_OK) return false;
+    if(!reference) file_page_put(*physical_address);
+    return true;
+}
+
+/// Allocate a private page holding the data of a file region at address.
+static uintptr_t file_private_page(vm_region_t *region, uintptr_t address) {
+    uintptr_t physical_address = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_ZERO)));
+
+    size_t region_offset = address - region->base;
+    if(region_offset < region->type_data.file.size) {
+        vfs_node_t *node = region->type_data.file.node;
+        vfs_rw_t rw = {
+            .rw = VFS_RW_READ,
+            .offset = region->type_data.file.offset + region_offset,
+            .size = MATH_MIN(region->type_data.file.size - region_offset, (size_t) ARCH_PAGE_GRANULARITY),
+            .buffer = (void *) HHDM(physical_address),
+        };
+
+        size_t read_count;
+        vfs_result_t res = node->ops->rw(node, &rw, &read_count);
+        if(res != VFS_RESULT_OK || read_count != rw.size) log(LOG_LEVEL_WARN, "VM", "short read of file backed page %#lx (%i)", address, res);
+    }
+
+    return physical_address;
 }
 
 static void region_map(vm_region_t *region, uintptr_t address, uintptr_t length) {
@@ -82,15 +270,125 @@ static void region_map(vm_region_t *region, uintptr_t address, uintptr_t length)
     bool is_global = region->address_space == g_vm_global_address_space;
     switch(region->type) {
         case VM_REGION_TYPE_ANON:
-            for(size_t i = 0; i < length; i += ARCH_PAGE_GRANULARITY) {
-                uintptr_t virtual_address = address + i;
-                uintptr_t physical_address = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(region->type_data.anon.back_zeroed ? PMM_FLAG_ZERO : PMM_FLAG_NONE)));
-                arch_ptm_map(region->address_space, virtual_address, physical_address, ARCH_PAGE_GRANULARITY, region->protection, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
+            for(size_t i = 0; i < length;) {
+                uintptr_t physical_addresses[MAP_BATCH];
+                size_t count = MATH_MIN((length - i) / ARCH_PAGE_GRANULARITY, (size_t) MAP_BATCH);
+                for(size_t j = 0; j < count; j++) physical_addresses[j] = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(region->type_data.anon.back_zeroed ? PMM_FLAG_ZERO : PMM_FLAG_NONE)));
+                arch_ptm_map_pages(region->address_space, address + i, physical_addresses, count, region->protection, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
+                i += count * ARCH_PAGE_GRANULARITY;
             }
+            resident_add(region->address_space, length / ARCH_PAGE_GRANULARITY);
+            charge_allocation(region, length / ARCH_PAGE_GRANULARITY);
             break;
         case VM_REGION_TYPE_DIRECT:
             arch_ptm_map(region->address_space, address, region->type_data.direct.physical_address + (address - region->base), length, region->protection, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
             break;
+        case VM_REGION_TYPE_FILE: {
+            // Runs of pages with the same protection are mapped together
+            uintptr_t physical_addresses[MAP_BATCH];
+            size_t count = 0;
+            vm_protection_t batch_prot = region->protection;
+            for(size_t i = 0; i < length; i += ARCH_PAGE_GRANULARITY) {
+                uintptr_t virtual_address = address + i;
+                vm_protection_t prot = region->protection;
+
+                uintptr_t physical_address;
+                if(file_shared_page(region, virtual_address, true, &physical_address)) {
+                    if(!region->type_data.file.shared) prot.write = false; // Writes are resolved by copy-on-write
+                } else {
+                    physical_address = file_private_page(region, virtual_address);
+                    charge_allocation(region, 1);
+                }
+
+                if(count == MAP_BATCH || (count > 0 && !PROT_EQUALS(&prot, &batch_prot))) {
+                    arch_ptm_map_pages(region->address_space, virtual_address - count * ARCH_PAGE_GRANULARITY, physical_addresses, count, batch_prot, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
+                    count = 0;
+                }
+                batch_prot = prot;
+                physical_addresses[count++] = physical_address;
+            }
+            if(count > 0) arch_ptm_map_pages(region->address_space, address + length - count * ARCH_PAGE_GRANULARITY, physical_addresses, count, batch_prot, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
+            resident_add(region->address_space, length / ARCH_PAGE_GRANULARITY);
+            break;
+        }
+    }
+}
+
+/// Map the zero page for a read of lazily backed anonymous memory, the first write replaces it.
+/// @returns true if the zero page was mapped
+static bool region_map_zero(vm_region_t *region, uintptr_t address) {
+    if(region->type != VM_REGION_TYPE_ANON || !region->dynamically_backed || region->cache_behavior != VM_CACHE_STANDARD) return false;
+    if(region->address_space == g_vm_global_address_space) return false;
+
+    vm_protection_t prot = region->protection;
+    prot.write = false;
+    arch_ptm_map(region->address_space, address, zero_page(), ARCH_PAGE_GRANULARITY, prot, region->cache_behavior, VM_PRIVILEGE_USER, false);
+    return true;
+}
+
+/// Look up the page a region shares with others at address, that is the zero page, a merged page or a filesystem page.
+/// @returns true = writes to the page have to go to a private copy
+static bool region_shared_page(vm_region_t *region, uintptr_t address, PARAM_OUT(uintptr_t *) physical_address) {
+    switch(region->type) {
+        case VM_REGION_TYPE_ANON:
+            if(!arch_ptm_physical(region->address_space, address, physical_address)) return false;
+            if(*physical_address == __atomic_load_n(&g_zero_page, __ATOMIC_ACQUIRE)) return true;
+            return ksm_frame(*physical_address);
+        case VM_REGION_TYPE_DIRECT: return false;
+        case VM_REGION_TYPE_FILE:
+            if(region->type_data.file.shared) return false;
+            return file_shared_page(region, address, false, physical_address);
+    }
+    return false;
+}
+
+/// Replace a shared page by a private copy, see `region_shared_page`.
+/// @warning Assumes region lock is acquired.
+/// @returns true = page at address is private
+static bool region_unshare(vm_region_t *region, uintptr_t address) {
+    ASSERT(region->type != VM_REGION_TYPE_DIRECT);
+
+    uintptr_t current_address;
+    if(!arch_ptm_physical(region->address_space, address, &current_address)) return false;
+
+    // Another thread might have already made a copy
+    uintptr_t shared_address;
+    if(!region_shared_page(region, address, &shared_address) || shared_address != current_address) return true;
+
+    bool is_zero_page = region->type == VM_REGION_TYPE_ANON && shared_address == __atomic_load_n(&g_zero_page, __ATOMIC_ACQUIRE);
+
+    uintptr_t private_address;
+    if(is_zero_page) {
+        private_address = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_ZERO)));
+    } else {
+        private_address = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_NONE)));
+        mem_copy((void *) HHDM(private_address), (void *) HHDM(shared_address), ARCH_PAGE_GRANULARITY);
+    }
+
+    bool is_global = region->address_space == g_vm_global_address_space;
+    arch_ptm_map(region->address_space, address, private_address, ARCH_PAGE_GRANULARITY, region->protection, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
+    if(region->type == VM_REGION_TYPE_ANON && !is_zero_page) ksm_release(shared_address);
+    if(region->type == VM_REGION_TYPE_FILE) file_page_put(shared_address);
+    if(is_zero_page) resident_add(region->address_space, 1);
+    charge_allocation(region, 1);
+    return true;
+}
+
+/// Write protect the pages of a region that are still shared, see `region_shared_page`.
+static void region_protect_shared(vm_region_t *region, uintptr_t address, size_t length) {
+    ASSERT(region->type != VM_REGION_TYPE_DIRECT);
+    if(region->type == VM_REGION_TYPE_ANON && !region->dynamically_backed && !ksm_active()) return;
+    if(region->type == VM_REGION_TYPE_FILE && region->type_data.file.shared) return;
+
+    vm_protection_t prot = region->protection;
+    prot.write = false;
+
+    bool is_global = region->address_space == g_vm_global_address_space;
+    for(size_t i = 0; i < length; i += ARCH_PAGE_GRANULARITY) {
+        uintptr_t current_address, shared_address;
+        if(!arch_ptm_physical(region->address_space, address + i, &current_address)) continue;
+        if(!region_shared_page(region, address + i, &shared_address) || shared_address != current_address) continue;
+        arch_ptm_rewrite(region->address_space, address + i, ARCH_PAGE_GRANULARITY, prot, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
     }
 }
 
@@ -100,14 +398,140 @@ static void region_unmap(vm_region_t *region, uintptr_t address, uintptr_t lengt
 
     switch(region->type) {
         case VM_REGION_TYPE_ANON:
-            // OPTIMIZE: invent page cache for anon regions because the current way is extremely slow
-            // TODO: unmap phys mem
-            break;
+            // Pages are released once their batch is unmapped, so none is freed while still reachable through a stale TLB entry
+            for(size_t i = 0; i < length;) {
+                uintptr_t physical_addresses[MAP_BATCH];
+                uint64_t swap_entries[MAP_BATCH];
+                uint64_t resident = 0, swapped = 0; /* Bit N is set if page N of the batch has a frame or a swap entry */
+                size_t count = MATH_MIN((length - i) / ARCH_PAGE_GRANULARITY, (size_t) MAP_BATCH);
+                for(size_t j = 0; j < count; j++) {
+                    uintptr_t virtual_address = address + i + j * ARCH_PAGE_GRANULARITY;
+                    if(arch_ptm_physical(region->address_space, virtual_address, &physical_addresses[j])) {
+                        resident |= (uint64_t) 1 << j;
+                    } else if(arch_ptm_swap_get(region->address_space, virtual_address, &swap_entries[j])) {
+                        swapped |= (uint64_t) 1 << j;
+                    }
+                }
+                if(resident != 0 || swapped != 0) arch_ptm_unmap(region->address_space, address + i, count * ARCH_PAGE_GRANULARITY);
+
+                for(size_t j = 0; j < count; j++) {
+                    if((swapped & ((uint64_t) 1 << j)) != 0) zswap_release(swap_entries[j]);
+                    if((resident & ((uint64_t) 1 << j)) == 0) continue;
+
+                    uintptr_t physical_address = physical_addresses[j];
+                    if(physical_address == __atomic_load_n(&g_zero_page, __ATOMIC_ACQUIRE)) continue;
+                    resident_add(region->address_space, -1);
+                    if(ksm_frame(physical_address)) {
+                        ksm_release(physical_address);
+                        continue;
+                    }
+                    page_put(PAGE(physical_address));
+                }
+                i += count * ARCH_PAGE_GRANULARITY;
+            }
+            return;
         case VM_REGION_TYPE_DIRECT: break;
+        case VM_REGION_TYPE_FILE:
+            // Every mapped page holds a reference, whether it is shared with the filesystem or a private copy
+            for(size_t i = 0; i < length;) {
+                uintptr_t physical_addresses[MAP_BATCH];
+                size_t resident_count = 0;
+                size_t count = MATH_MIN((length - i) / ARCH_PAGE_GRANULARITY, (size_t) MAP_BATCH);
+                for(size_t j = 0; j < count; j++) {
+                    if(!arch_ptm_physical(region->address_space, address + i + j * ARCH_PAGE_GRANULARITY, &physical_addresses[resident_count])) continue;
+                    resident_count++;
+                }
+                arch_ptm_unmap(region->address_space, address + i, count * ARCH_PAGE_GRANULARITY);
+                resident_add(region->address_space, -(long) resident_count);
+                for(size_t j = 0; j < resident_count; j++) file_page_put(physical_addresses[j]);
+                i += count * ARCH_PAGE_GRANULARITY;
+            }
+            return;
     }
     arch_ptm_unmap(region->address_space, address, length);
 }
 
+/// Compress a cold page of an anonymous region into zswap.
+/// @warning Assumes the write side of the address space lock is acquired.
+/// @returns true if the page was swapped out
+static bool region_swap_out(vm_region_t *region, uintptr_t address) {
+    ASSERT(region->type == VM_REGION_TYPE_ANON);
+
+    uintptr_t physical_address;
+    if(!arch_ptm_physical(region->address_space, address, &physical_address)) return false;
+    if(physical_address == __atomic_load_n(&g_zero_page, __ATOMIC_ACQUIRE)) return false;
+    if(ksm_frame(physical_address)) return false;
+
+    // Recently used, leave it for the next round. The working set sampler moves the accessed bit to the page
+    bool referenced = page_flags_test_clear(PAGE(physical_address), PAGE_FLAG_REFERENCED);
+    if(arch_ptm_accessed(region->address_space, address) || referenced) return false;
+
+    // Take the page out first so no write can slip in while it is being compressed. This happens in place,
+    // unmapping could free the page table and putting the swap entry back would then allocate under reclaim.
+    // Faults wait on the address space lock so the placeholder entry is never seen
+    if(!arch_ptm_swap_set(region->address_space, address, 0)) return false;
+
+    uint64_t swap_entry;
+    if(!zswap_store(physical_address, &swap_entry)) {
+        // The page table is still there, mapping the page back does not allocate
+        bool is_global = region->address_space == g_vm_global_address_space;
+        arch_ptm_map(region->address_space, address, physical_address, ARCH_PAGE_GRANULARITY, region->protection, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
+        return false;
+    }
+
+    arch_ptm_swap_set(region->address_space, address, swap_entry);
+    resident_add(region->address_space, -1);
+    return true;
+}
+
+/// Bring a page of an anonymous region back from zswap.
+/// @warning Assumes region lock is acquired.
+static void region_swap_in(vm_region_t *region, uintptr_t address, uint64_t swap_entry) {
+    ASSERT(region->type == VM_REGION_TYPE_ANON);
+
+    uintptr_t physical_address = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_NONE)));
+    zswap_load(swap_entry, physical_address);
+
+    bool is_global = region->address_space == g_vm_global_address_space;
+    arch_ptm_map(region->address_space, address, physical_address, ARCH_PAGE_GRANULARITY, region->protection, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
+    resident_add(region->address_space, 1);
+    charge_allocation(region, 1);
+}
+
+/// Merge a page of a mergeable anonymous region with an identical page, see memory/ksm.h.
+/// @warning Assumes region lock is acquired.
+static void region_merge(vm_region_t *region, uintptr_t address) {
+    ASSERT(region->type == VM_REGION_TYPE_ANON && region->mergeable);
+
+    uintptr_t physical_address;
+    if(!arch_ptm_physical(region->address_space, address, &physical_address)) return;
+    if(physical_address == __atomic_load_n(&g_zero_page, __ATOMIC_ACQUIRE) || ksm_frame(physical_address)) return;
+
+    uint64_t hash = ksm_hash(physical_address);
+    uintptr_t merged_address;
+    bool merged = ksm_lookup(hash, &merged_address);
+    if(!merged && !ksm_candidate(physical_address, hash)) return;
+
+    // Write protect the page so the contents can not change once they are compared
+    vm_protection_t prot = region->protection;
+    prot.write = false;
+    arch_ptm_rewrite(region->address_space, address, ARCH_PAGE_GRANULARITY, prot, region->cache_behavior, VM_PRIVILEGE_USER, false);
+
+    if(merged) {
+        if(mem_compare((void *) HHDM(merged_address), (void *) HHDM(physical_address), ARCH_PAGE_GRANULARITY) == 0) {
+            arch_ptm_map(region->address_space, address, merged_address, ARCH_PAGE_GRANULARITY, prot, region->cache_behavior, VM_PRIVILEGE_USER, false);
+            page_put(PAGE(physical_address));
+            return;
+        }
+        ksm_release(merged_address);
+    } else if(ksm_hash(physical_address) == hash) {
+        ksm_promote(physical_address, hash);
+        return;
+    }
+
+    arch_ptm_rewrite(region->address_space, address, ARCH_PAGE_GRANULARITY, region->protection, region->cache_behavior, VM_PRIVILEGE_USER, false);
+}
+
 /// Check whether the flags of a region are compatible with each other.
 static bool regions_mergeable(vm_region_t *left, vm_region_t *right) {
     if(left->type != right->type) return false;
@@ -115,6 +539,8 @@ static bool regions_mergeable(vm_region_t *left, vm_region_t *right) {
     if(!PROT_EQUALS(&left->protection, &right->protection)) return false;
     if(left->cache_behavior != right->cache_behavior) return false;
     if(left->dynamically_backed != right->dynamically_backed) return false;
+    if(left->huge_hint != right->huge_hint) return false;
+    if(left->mergeable != right->mergeable) return false;
 
     switch(left->type) {
         case VM_REGION_TYPE_ANON:
@@ -124,61 +550,60 @@ static bool regions_mergeable(vm_region_t *left, vm_region_t *right) {
             if(!SEGMENT_IN_BOUNDS(left->type_data.direct.physical_address, left->length, 0, ARCH_MEM_PHYS_MAX)) return false;
             if(left->type_data.direct.physical_address + left->length != right->type_data.direct.physical_address) return false;
             break;
+        case VM_REGION_TYPE_FILE:
+            // Merging would have to join the zero filled tail of the left region with the file data of the right
+            return false;
     }
 
     return true;
 }
 
-/// Allocate a region from the internal vm region pool.
-static vm_region_t *region_alloc(bool global_lock_acquired) {
-    spinlock_acquire_nodw(&g_region_cache_lock);
-    if(g_region_cache.count == 0) {
-        spinlock_release_nodw(&g_region_cache_lock);
-
-        pmm_block_t *page = pmm_alloc_page(PMM_FLAG_ZERO);
-        if(!global_lock_acquired) spinlock_acquire_nodw(&g_vm_global_address_space->lock);
-
-        uintptr_t address;
-        if(!find_hole(g_vm_global_address_space, 0, ARCH_PAGE_GRANULARITY, &address)) panic("VM", "out of global address space");
-
-        arch_ptm_map(g_vm_global_address_space, address, PAGE_PADDR(PAGE_FROM_BLOCK(page)), ARCH_PAGE_GRANULARITY, VM_PROT_RW, VM_CACHE_STANDARD, VM_PRIVILEGE_KERNEL, true);
-
-        vm_region_t *region = (vm_region_t *) address;
-        region[0].address_space = g_vm_global_address_space;
-        region[0].type = VM_REGION_TYPE_ANON;
-        region[0].base = address;
-        region[0].length = ARCH_PAGE_GRANULARITY;
-        region[0].protection = VM_PROT_RW;
-        region[0].cache_behavior = VM_CACHE_STANDARD;
-        region[0].dynamically_backed = false;
-
-        region_insert(g_vm_global_address_space, &region[0]);
-        if(!global_lock_acquired) spinlock_release_nodw(&g_vm_global_address_space->lock);
-
-        spinlock_acquire_nodw(&g_region_cache_lock);
-        for(unsigned int i = 1; i < ARCH_PAGE_GRANULARITY / sizeof(vm_region_t); i++) list_push(&g_region_cache, &region[i].list_node);
+/// Allocate a region descriptor.
+/// Falls back to the static reserve when the slab cache is not available yet.
+static vm_region_t *region_alloc() {
+    vm_region_t *region = nullptr;
+    if(EXPECT_LIKELY(g_region_cache != nullptr)) {
+        region = slab_allocate(g_region_cache);
+    } else {
+        spinlock_acquire_nodw(&g_region_reserve_lock);
+        if(!g_region_reserve_initialized) {
+            for(size_t i = 0; i < REGION_RESERVE_COUNT; i++) list_push(&g_region_reserve, &g_region_reserve_pool[i].list_node);
+            g_region_reserve_initialized = true;
+        }
+        list_node_t *node = list_pop(&g_region_reserve);
+        spinlock_release_nodw(&g_region_reserve_lock);
+        if(node == nullptr) panic("VM", "region reserve exhausted");
+        region = CONTAINER_OF(node, vm_region_t, list_node);
     }
 
-    list_node_t *node = list_pop(&g_region_cache);
-    spinlock_release_nodw(&g_region_cache_lock);
-    return CONTAINER_OF(node, vm_region_t, list_node);
+    region->lock = SPINLOCK_INIT;
+    return region;
 }
 
-/// Free region into the internal vm region pool.
+/// Free a region descriptor.
 static void region_free(vm_region_t *region) {
-    spinlock_acquire_nodw(&g_region_cache_lock);
-    list_push(&g_region_cache, &region->list_node);
-    spinlock_release_nodw(&g_region_cache_lock);
+    if(region >= &g_region_reserve_pool[0] && region < &g_region_reserve_pool[REGION_RESERVE_COUNT]) {
+        spinlock_acquire_nodw(&g_region_reserve_lock);
+        list_push(&g_region_reserve, &region->list_node);
+        spinlock_release_nodw(&g_region_reserve_lock);
+        return;
+    }
+    slab_free(g_region_cache, region);
 }
 
 /// Create a region by cloning another to a new region.
-static vm_region_t *clone_to(bool global_lock_acquired, uintptr_t base, size_t length, vm_region_t *from) {
-    vm_region_t *region = region_alloc(global_lock_acquired);
+static vm_region_t *clone_to(uintptr_t base, size_t length, vm_region_t *from) {
+    vm_region_t *region = region_alloc();
     region->type = from->type;
     region->address_space = from->address_space;
     region->cache_behavior = from->cache_behavior;
     region->protection = from->protection;
     region->dynamically_backed = from->dynamically_backed;
+    region->huge_hint = from->huge_hint;
+    region->mergeable = from->mergeable;
+    region->working_set.accessed = 0;
+    region->working_set.dirty = 0;
+    region->working_set.estimate = from->working_set.estimate * (length / ARCH_PAGE_GRANULARITY) / (from->length / ARCH_PAGE_GRANULARITY);
 
     switch(from->type) {
         case VM_REGION_TYPE_ANON: region->type_data.anon.back_zeroed = from->type_data.anon.back_zeroed; break;
@@ -193,6 +618,14 @@ static vm_region_t *clone_to(bool global_lock_acquired, uintptr_t base, size_t l
             }
             region->type_data.direct.physical_address = new_physical_address;
             break;
+        case VM_REGION_TYPE_FILE:
+            ASSERT(base >= from->base);
+            size_t delta = base - from->base;
+            region->type_data.file.node = from->type_data.file.node;
+            region->type_data.file.shared = from->type_data.file.shared;
+            region->type_data.file.offset = from->type_data.file.offset + delta;
+            region->type_data.file.size = from->type_data.file.size > delta ? from->type_data.file.size - delta : 0;
+            break;
     }
 
     region->base = base;
@@ -201,6 +634,8 @@ static vm_region_t *clone_to(bool global_lock_acquired, uintptr_t base, size_t l
 }
 
 static vm_region_t *region_insert(vm_address_space_t *address_space, vm_region_t *region) {
+    address_space->lookup_cache = nullptr;
+
     rb_node_t *right_node = rb_search(&address_space->regions, region->base, RB_SEARCH_TYPE_NEAREST_GT);
     if(right_node != nullptr) {
         vm_region_t *right = CONTAINER_OF(right_node, vm_region_t, rb_node);
@@ -218,6 +653,7 @@ static vm_region_t *region_insert(vm_address_space_t *address_space, vm_region_t
         if(regions_mergeable(left, region)) {
             left->length += region->length;
             rb_remove(&address_space->regions, &region->rb_node);
+            rb_update(&address_space->regions, &left->rb_node);
             region_free(region);
             return left;
         }
@@ -226,23 +662,67 @@ static vm_region_t *region_insert(vm_address_space_t *address_space, vm_region_t
     return region;
 }
 
+/// @warning Assumes address space lock is acquired.
 static vm_region_t *addr_to_region(vm_address_space_t *address_space, uintptr_t address) {
     if(!ADDRESS_IN_BOUNDS(address, address_space->start, address_space->end)) return nullptr;
 
+    vm_region_t *region = __atomic_load_n(&address_space->lookup_cache, __ATOMIC_RELAXED);
+    if(region != nullptr && ADDRESS_IN_SEGMENT(address, region->base, region->length)) return region;
+
     rb_node_t *node = rb_search(&address_space->regions, address, RB_SEARCH_TYPE_NEAREST_LTE);
     if(node == nullptr) return nullptr;
 
-    vm_region_t *region = CONTAINER_OF(node, vm_region_t, rb_node);
+    region = CONTAINER_OF(node, vm_region_t, rb_node);
     if(!ADDRESS_IN_SEGMENT(address, region->base, region->length)) return nullptr;
 
+    __atomic_store_n(&address_space->lookup_cache, region, __ATOMIC_RELAXED);
     return region;
 }
 
-static bool address_space_fix_page(vm_address_space_t *address_space, uintptr_t vaddr) {
+/// @warning Assumes address space lock is acquired, the read side is sufficient.
+static bool address_space_fix_page(vm_address_space_t *address_space, uintptr_t vaddr, vm_fault_t fault) {
     vm_region_t *region = addr_to_region(address_space, vaddr);
-    if(region == nullptr || !region->dynamically_backed) return false;
-    region_map(region, MATH_FLOOR(vaddr, ARCH_PAGE_GRANULARITY), ARCH_PAGE_GRANULARITY);
-    return true;
+    if(region == nullptr) return false;
+
+    uintptr_t page_address = MATH_FLOOR(vaddr, ARCH_PAGE_GRANULARITY);
+
+    bool handled = false;
+    spinlock_acquire_nodw(&region->lock);
+    switch(fault) {
+        case VM_FAULT_NOT_PRESENT:
+        case VM_FAULT_NOT_PRESENT_WRITE:
+            // Another thread might have populated the page while we were waiting on the region lock.
+            uintptr_t physical_address;
+            if(arch_ptm_physical(address_space, page_address, &physical_address)) {
+                handled = true;
+            } else {
+                uint64_t swap_entry;
+                if(region->type == VM_REGION_TYPE_ANON && arch_ptm_swap_get(address_space, page_address, &swap_entry)) {
+                    region_swap_in(region, page_address, swap_entry);
+                    handled = true;
+                    break;
+                }
+
+                if(!region->dynamically_backed) break;
+                if(fault == VM_FAULT_NOT_PRESENT && region_map_zero(region, page_address)) {
+                    handled = true;
+                    break;
+                }
+                region_map(region, page_address, ARCH_PAGE_GRANULARITY);
+                handled = true;
+            }
+
+            // Resolve the write right away instead of taking a second fault on a shared page
+            if(fault == VM_FAULT_NOT_PRESENT_WRITE && region->protection.write && region->type != VM_REGION_TYPE_DIRECT) handled = region_unshare(region, page_address);
+            break;
+        case VM_FAULT_WRITE:
+            if(!region->protection.write || region->type == VM_REGION_TYPE_DIRECT) break;
+            handled = region_unshare(region, page_address);
+            break;
+        case VM_FAULT_UNKNOWN: break;
+    }
+    spinlock_release_nodw(&region->lock);
+    return handled;
 }
 
 static void vm_fault_soft(void *data) {
@@ -250,14 +730,26 @@ static void vm_fault_soft(void *data) {
 
     ASSERT(thread->proc != nullptr);
 
-    bool ok = address_space_fix_page(thread->proc->address_space, thread->vm_fault.address);
-    if(!ok) panic("VM", "vm_fault_soft handling failed for (pid: %lu, tid: %lu) on %#lx", thread->proc->id, thread->id, thread->vm_fault.address);
+    rwlock_read_acquire_nodw(&thread->proc->address_space->lock);
+    bool ok = address_space_fix_page(thread->proc->address_space, thread->vm_fault.address, thread->vm_fault.type);
+    rwlock_read_release_nodw(&thread->proc->address_space->lock);
+    if(!ok) {
+        // The faulting instruction is retried, the next fault on this address will be reported as unhandled
+        log(LOG_LEVEL_DEBUG, "VM", "vm_fault_soft handling failed for (pid: %lu, tid: %lu) on %#lx", thread->proc->id, thread->id, thread->vm_fault.address);
+        thread->vm_fault.failed = true;
+    } else {
+        thread->accounting.minor_faults++;
+    }
 
     thread->vm_fault.in_flight = false;
 }
 
+/// @warning Assumes address space lock is acquired.
 static bool memory_exists(vm_address_space_t *address_space, uintptr_t address, size_t length) {
-    if(!ADDRESS_IN_BOUNDS(address, address_space->start, address_space->end) || !ADDRESS_IN_BOUNDS(address + length, address_space->start, address_space->end)) return false;
+    if(!SEGMENT_IN_BOUNDS(address, length, address_space->start, address_space->end)) return false;
+
+    vm_region_t *cached = __atomic_load_n(&address_space->lookup_cache, __ATOMIC_RELAXED);
+    if(cached != nullptr && address >= cached->base && address + length <= cached->base + cached->length) return true;
 
     uintptr_t top = address + length;
     while(top > address) {
@@ -269,12 +761,13 @@ static bool memory_exists(vm_address_space_t *address_space, uintptr_t address,
         vm_region_t *region = CONTAINER_OF(node, vm_region_t, rb_node);
         if(region->base + region->length < top) return false;
 
+        __atomic_store_n(&address_space->lookup_cache, region, __ATOMIC_RELAXED);
         top = region->base;
     }
     return true;
 }
 
-static void *map_common(vm_address_space_t *address_space, void *hint, size_t length, vm_protection_t prot, vm_cache_t cache, vm_flags_t flags, vm_region_type_t type, uintptr_t direct_physical_address) {
+static void *map_common(vm_address_space_t *address_space, void *hint, size_t length, vm_protection_t prot, vm_cache_t cache, vm_flags_t flags, vm_region_type_t type, vm_region_type_data_t type_data) {
     LOG_TRACE("VM", "map(hint: %#lx, length: %#lx, prot: %c%c%c, flags: %lu, cache: %u, type: %u)", (uintptr_t) hint, length, prot.read ? 'R' : '-', prot.write ? 'W' : '-', prot.exec ? 'E' : '-', flags, cache, type);
 
     uintptr_t address = (uintptr_t) hint;
@@ -284,12 +777,17 @@ static void *map_common(vm_address_space_t *address_space, void *hint, size_t le
         address += ARCH_PAGE_GRANULARITY - (address % ARCH_PAGE_GRANULARITY);
     }
 
-    vm_region_t *region = region_alloc(false);
-    spinlock_acquire_nodw(&address_space->lock);
-    bool result = find_hole(address_space, address, length, &address);
+    vm_region_t *region = region_alloc();
+    rwlock_write_acquire_nodw(&address_space->lock);
+    bool result;
+    if(address_space == g_vm_global_address_space) {
+        result = global_reserve(address, length, (flags & VM_FLAG_FIXED) != 0, &address);
+    } else {
+        result = find_hole(address_space, address, length, &address);
+    }
     if(!result || ((uintptr_t) hint != address && (flags & VM_FLAG_FIXED) != 0)) {
         region_free(region);
-        spinlock_release_nodw(&address_space->lock);
+        rwlock_write_release_nodw(&address_space->lock);
         return nullptr;
     }
 
@@ -303,13 +801,22 @@ static void *map_common(vm_address_space_t *address_space, void *hint, size_t le
     region->protection = prot;
     region->cache_behavior = cache;
     region->dynamically_backed = (flags & VM_FLAG_DYNAMICALLY_BACKED) != 0;
+    region->huge_hint = (flags & VM_FLAG_HUGE_HINT) != 0;
+    region->mergeable = false;
+    region->working_set.accessed = 0;
+    region->working_set.dirty = 0;
+    region->working_set.estimate = 0;
+    region->type_data = type_data;
 
     switch(region->type) {
         case VM_REGION_TYPE_ANON: region->type_data.anon.back_zeroed = (flags & VM_FLAG_ZERO) != 0; break;
         case VM_REGION_TYPE_DIRECT:
-            ASSERT(direct_physical_address % ARCH_PAGE_GRANULARITY == 0);
-            region->type_data.direct.physical_address = direct_physical_address;
-            LOG_TRACE("VM", "physical address of region: %#lx", direct_physical_address);
+            ASSERT(type_data.direct.physical_address % ARCH_PAGE_GRANULARITY == 0);
+            LOG_TRACE("VM", "physical address of region: %#lx", type_data.direct.physical_address);
+            break;
+        case VM_REGION_TYPE_FILE:
+            ASSERT(type_data.file.offset % ARCH_PAGE_GRANULARITY == 0);
+            LOG_TRACE("VM", "file region (offset: %#lx, size: %#lx)", type_data.file.offset, type_data.file.size);
             break;
     }
 
@@ -317,20 +824,21 @@ static void *map_common(vm_address_space_t *address_space, void *hint, size_t le
 
     region_insert(address_space, region);
 
-    spinlock_release_nodw(&address_space->lock);
+    rwlock_write_release_nodw(&address_space->lock);
 
     LOG_TRACE("VM", "map success (base: %#lx, length: %#lx)", address, length);
     return (void *) address;
 }
 
-static void rewrite_common(vm_address_space_t *address_space, void *address, size_t length, rewrite_type_t type, vm_protection_t prot, vm_cache_t cache) {
+static void rewrite_common(vm_address_space_t *address_space, void *address, size_t length, rewrite_type_t type, vm_protection_t prot, vm_cache_t cache, bool hint) {
     LOG_TRACE("VM", "rewrite(as_start: %#lx, address: %#lx, length: %#lx, prot: %c%c%c)", address_space->start, (uintptr_t) address, length, prot.read ? 'R' : '-', prot.write ? 'W' : '-', prot.exec ? 'X' : '-');
     if(length == 0) return;
 
     ASSERT((uintptr_t) address % ARCH_PAGE_GRANULARITY == 0 && length % ARCH_PAGE_GRANULARITY == 0);
     ASSERT(SEGMENT_IN_BOUNDS((uintptr_t) address, length, address_space->start, address_space->end));
 
-    spinlock_acquire_nodw(&address_space->lock);
+    rwlock_write_acquire_nodw(&address_space->lock);
+    address_space->lookup_cache = nullptr;
 
     uintptr_t current_address = (uintptr_t) address;
 
@@ -343,27 +851,37 @@ static void rewrite_common(vm_address_space_t *address_space, void *address, siz
             if(split_length > length) split_length = length;
 
             switch(type) {
-                case REWRITE_TYPE_DELETE: region_unmap(split_region, split_base, split_length); goto l_no_clone;
+                case REWRITE_TYPE_DELETE:
+                    region_unmap(split_region, split_base, split_length);
+                    global_release(address_space, split_base, split_length);
+                    goto l_no_clone;
                 case REWRITE_TYPE_CACHE:
                     if(split_region->cache_behavior == cache) goto l_skip;
                     break;
                 case REWRITE_TYPE_PROTECTION:
                     if(PROT_EQUALS(&split_region->protection, &prot)) goto l_skip;
                     break;
+                case REWRITE_TYPE_HUGE_HINT:
+                    if(split_region->huge_hint == hint) goto l_skip;
+                    break;
+                case REWRITE_TYPE_MERGEABLE:
+                    if(split_region->mergeable == hint) goto l_skip;
+                    break;
             }
 
-            vm_region_t *region = clone_to(address_space == g_vm_global_address_space, split_base, split_length, split_region);
+            vm_region_t *region = clone_to(split_base, split_length, split_region);
 
         l_no_clone:
 
             if(split_region->base + split_region->length > split_base + split_length) {
                 uintptr_t new_base = split_base + split_length;
                 size_t new_length = (split_region->base + split_region->length) - (split_base + split_length);
-                rb_insert(&address_space->regions, &clone_to(address_space == g_vm_global_address_space, new_base, new_length, split_region)->rb_node);
+                rb_insert(&address_space->regions, &clone_to(new_base, new_length, split_region)->rb_node);
             }
 
             if(split_base > split_region->base) {
                 split_region->length = split_base - split_region->base;
+                rb_update(&address_space->regions, &split_region->rb_node);
             } else {
                 rb_remove(&address_space->regions, &split_region->rb_node);
                 region_free(split_region);
@@ -373,12 +891,16 @@ static void rewrite_common(vm_address_space_t *address_space, void *address, siz
                 case REWRITE_TYPE_DELETE:     goto l_skip;
                 case REWRITE_TYPE_CACHE:      region->cache_behavior = cache; break;
                 case REWRITE_TYPE_PROTECTION: region->protection = prot; break;
+                case REWRITE_TYPE_HUGE_HINT:  region->huge_hint = hint; break;
+                case REWRITE_TYPE_MERGEABLE:  region->mergeable = hint; break;
             }
 
             region = region_insert(address_space, region);
+            if(type == REWRITE_TYPE_HUGE_HINT || type == REWRITE_TYPE_MERGEABLE) goto l_skip;
 
             bool is_global = region->address_space == g_vm_global_address_space;
             arch_ptm_rewrite(region->address_space, split_base, split_length, region->protection, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
+            if(region->type != VM_REGION_TYPE_DIRECT && region->protection.write) region_protect_shared(region, split_base, split_length);
 
         l_skip:
 
@@ -397,24 +919,33 @@ static void rewrite_common(vm_address_space_t *address_space, void *address, siz
         if(split_length > split_region->length) split_length = split_region->length;
 
         switch(type) {
-            case REWRITE_TYPE_DELETE: region_unmap(split_region, split_region->base, split_length); goto r_no_clone;
+            case REWRITE_TYPE_DELETE:
+                region_unmap(split_region, split_region->base, split_length);
+                global_release(address_space, split_region->base, split_length);
+                goto r_no_clone;
             case REWRITE_TYPE_CACHE:
                 if(split_region->cache_behavior == cache) goto r_skip;
                 break;
             case REWRITE_TYPE_PROTECTION:
                 if(PROT_EQUALS(&split_region->protection, &prot)) goto r_skip;
                 break;
+            case REWRITE_TYPE_HUGE_HINT:
+                if(split_region->huge_hint == hint) goto r_skip;
+                break;
+            case REWRITE_TYPE_MERGEABLE:
+                if(split_region->mergeable == hint) goto r_skip;
+                break;
         }
 
         uintptr_t split_base = split_region->base;
-        vm_region_t *region = clone_to(address_space == g_vm_global_address_space, split_base, split_length, split_region);
+        vm_region_t *region = clone_to(split_base, split_length, split_region);
 
     r_no_clone:
 
         if(split_region->length > split_length) {
             uintptr_t new_base = split_base + split_length;
             size_t new_length = split_region->length - split_length;
-            rb_insert(&address_space->regions, &clone_to(address_space == g_vm_global_address_space, new_base, new_length, split_region)->rb_node);
+            rb_insert(&address_space->regions, &clone_to(new_base, new_length, split_region)->rb_node);
         }
         rb_remove(&address_space->regions, &split_region->rb_node);
         region_free(split_region);
@@ -423,50 +954,160 @@ static void rewrite_common(vm_address_space_t *address_space, void *address, siz
             case REWRITE_TYPE_DELETE:     goto r_skip;
             case REWRITE_TYPE_CACHE:      region->cache_behavior = cache; break;
             case REWRITE_TYPE_PROTECTION: region->protection = prot; break;
+            case REWRITE_TYPE_HUGE_HINT:  region->huge_hint = hint; break;
+            case REWRITE_TYPE_MERGEABLE:  region->mergeable = hint; break;
         }
 
         region = region_insert(address_space, region);
+        if(type == REWRITE_TYPE_HUGE_HINT || type == REWRITE_TYPE_MERGEABLE) goto r_skip;
 
         bool is_global = region->address_space == g_vm_global_address_space;
         arch_ptm_rewrite(region->address_space, split_base, split_length, region->protection, region->cache_behavior, is_global ? VM_PRIVILEGE_KERNEL : VM_PRIVILEGE_USER, is_global);
+        if(region->type != VM_REGION_TYPE_DIRECT && region->protection.write) region_protect_shared(region, split_base, split_length);
 
     r_skip:
     }
-    spinlock_release_nodw(&address_space->lock);
+    rwlock_write_release_nodw(&address_space->lock);
 }
 
 void *vm_map_anon(vm_address_space_t *address_space, void *hint, size_t length, vm_protection_t prot, vm_cache_t cache, vm_flags_t flags) {
-    return map_common(address_space, hint, length, prot, cache, flags, VM_REGION_TYPE_ANON, 0);
+    return map_common(address_space, hint, length, prot, cache, flags, VM_REGION_TYPE_ANON, (vm_region_type_data_t) {});
 }
 
 void *vm_map_direct(vm_address_space_t *address_space, void *hint, size_t length, vm_protection_t prot, vm_cache_t cache, uintptr_t physical_address, vm_flags_t flags) {
-    return map_common(address_space, hint, length, prot, cache, flags, VM_REGION_TYPE_DIRECT, physical_address);
+    return map_common(address_space, hint, length, prot, cache, flags, VM_REGION_TYPE_DIRECT, (vm_region_type_data_t) { .direct.physical_address = physical_address });
+}
+
+void *vm_map_file(vm_address_space_t *address_space, void *hint, size_t length, vm_protection_t prot, vm_cache_t cache, vfs_node_t *node, size_t offset, size_t size, vm_flags_t flags) {
+    if(node->type != VFS_NODE_TYPE_FILE || offset % ARCH_PAGE_GRANULARITY != 0) return nullptr;
+
+    bool shared = (flags & VM_FLAG_SHARED) != 0;
+    if(shared && node->ops->page == nullptr) return nullptr;
+
+    return map_common(address_space, hint, length, prot, cache, flags, VM_REGION_TYPE_FILE, (vm_region_type_data_t) { .file = { .node = node, .offset = offset, .size = size, .shared = shared } });
 }
 
 void vm_unmap(vm_address_space_t *address_space, void *address, size_t length) {
-    rewrite_common(address_space, address, length, REWRITE_TYPE_DELETE, (vm_protection_t) {}, VM_CACHE_STANDARD);
+    rewrite_common(address_space, address, length, REWRITE_TYPE_DELETE, (vm_protection_t) {}, VM_CACHE_STANDARD, false);
 }
 
 void vm_rewrite_prot(vm_address_space_t *address_space, void *address, size_t length, vm_protection_t prot) {
-    rewrite_common(address_space, address, length, REWRITE_TYPE_PROTECTION, prot, VM_CACHE_STANDARD);
+    rewrite_common(address_space, address, length, REWRITE_TYPE_PROTECTION, prot, VM_CACHE_STANDARD, false);
 }
 
 void vm_rewrite_cache(vm_address_space_t *address_space, void *address, size_t length, vm_cache_t cache) {
-    rewrite_common(address_space, address, length, REWRITE_TYPE_CACHE, (vm_protection_t) {}, cache);
+    rewrite_common(address_space, address, length, REWRITE_TYPE_CACHE, (vm_protection_t) {}, cache, false);
+}
+
+bool vm_advise(vm_address_space_t *address_space, void *address, size_t length, vm_advice_t advice) {
+    LOG_TRACE("VM", "advise(as_start: %#lx, address: %#lx, length: %#lx, advice: %u)", address_space->start, (uintptr_t) address, length, advice);
+    if(length == 0 || (uintptr_t) address % ARCH_PAGE_GRANULARITY != 0 || length % ARCH_PAGE_GRANULARITY != 0) return false;
+    if(!SEGMENT_IN_BOUNDS((uintptr_t) address, length, address_space->start, address_space->end)) return false;
+
+    uintptr_t start = (uintptr_t) address;
+    switch(advice) {
+        case VM_ADVICE_NORMAL: break;
+        case VM_ADVICE_WILLNEED:
+            rwlock_read_acquire_nodw(&address_space->lock);
+            if(!memory_exists(address_space, start, length)) {
+                rwlock_read_release_nodw(&address_space->lock);
+                return false;
+            }
+            for(size_t i = 0; i < length; i += ARCH_PAGE_GRANULARITY) {
+                // Present pages are left alone, a write fault would unshare merged and copy-on-write pages
+                uintptr_t physical_address;
+                if(arch_ptm_physical(address_space, start + i, &physical_address)) continue;
+
+                // Populate anonymous memory with private pages rather than the zero page
+                vm_region_t *region = addr_to_region(address_space, start + i);
+                address_space_fix_page(address_space, start + i, region->type == VM_REGION_TYPE_ANON ? VM_FAULT_NOT_PRESENT_WRITE : VM_FAULT_NOT_PRESENT);
+            }
+            rwlock_read_release_nodw(&address_space->lock);
+            break;
+        case VM_ADVICE_DONTNEED:
+            rwlock_write_acquire_nodw(&address_space->lock);
+            if(!memory_exists(address_space, start, length)) {
+                rwlock_write_release_nodw(&address_space->lock);
+                return false;
+            }
+
+            uintptr_t current_address = start;
+            while(current_address < start + length) {
+                vm_region_t *region = CONTAINER_OF(rb_search(&address_space->regions, current_address, RB_SEARCH_TYPE_NEAREST_LTE), vm_region_t, rb_node);
+                uintptr_t end = MATH_MIN(region->base + region->length, start + length);
+
+                // Discarded anonymous memory reads back as freshly allocated memory
+                if(region->type == VM_REGION_TYPE_ANON) {
+                    region_unmap(region, current_address, end - current_address);
+                    if(!region->dynamically_backed) region_map(region, current_address, end - current_address);
+                }
+
+                current_address = end;
+            }
+            rwlock_write_release_nodw(&address_space->lock);
+            break;
+        case VM_ADVICE_HUGEPAGE:
+        case VM_ADVICE_NOHUGEPAGE:
+            rwlock_read_acquire_nodw(&address_space->lock);
+            bool exists = memory_exists(address_space, start, length);
+            rwlock_read_release_nodw(&address_space->lock);
+            if(!exists) return false;
+
+            rewrite_common(address_space, address, length, REWRITE_TYPE_HUGE_HINT, (vm_protection_t) {}, VM_CACHE_STANDARD, advice == VM_ADVICE_HUGEPAGE);
+            break;
+        case VM_ADVICE_MERGEABLE:
+            rwlock_read_acquire_nodw(&address_space->lock);
+            bool mergeable_exists = memory_exists(address_space, start, length);
+            rwlock_read_release_nodw(&address_space->lock);
+            if(!mergeable_exists) return false;
+
+            rewrite_common(address_space, address, length, REWRITE_TYPE_MERGEABLE, (vm_protection_t) {}, VM_CACHE_STANDARD, true);
+            break;
+        case VM_ADVICE_UNMERGEABLE:
+            rwlock_read_acquire_nodw(&address_space->lock);
+            bool unmergeable_exists = memory_exists(address_space, start, length);
+            rwlock_read_release_nodw(&address_space->lock);
+            if(!unmergeable_exists) return false;
+
+            // Stop the scanner first so nothing gets merged behind the unsharing
+            rewrite_common(address_space, address, length, REWRITE_TYPE_MERGEABLE, (vm_protection_t) {}, VM_CACHE_STANDARD, false);
+
+            rwlock_write_acquire_nodw(&address_space->lock);
+            for(size_t i = 0; i < length; i += ARCH_PAGE_GRANULARITY) {
+                vm_region_t *region = addr_to_region(address_space, start + i);
+                if(region == nullptr || region->type != VM_REGION_TYPE_ANON) continue;
+
+                uintptr_t physical_address;
+                if(!arch_ptm_physical(address_space, start + i, &physical_address) || !ksm_frame(physical_address)) continue;
+                region_unshare(region, start + i);
+            }
+            rwlock_write_release_nodw(&address_space->lock);
+            break;
+    }
+    return true;
 }
 
 bool vm_fault(uintptr_t address, vm_fault_t fault) {
-    if(fault != VM_FAULT_NOT_PRESENT) return false;
+    if(fault == VM_FAULT_UNKNOWN) return false;
     if(ADDRESS_IN_BOUNDS(address, g_vm_global_address_space->start, g_vm_global_address_space->end)) return false;
 
+    // The fix is deferred and would not run before the access is retried, the fault goes to the exception fixup instead
+    if(ARCH_CPU_CURRENT_READ(flags.deferred_work_status) != 0) return false;
+
     thread_t *current_thread = arch_sched_thread_current();
     ASSERT(!current_thread->vm_fault.in_flight);
 
     process_t *proc = current_thread->proc;
     if(proc == nullptr) return false;
 
+    if(current_thread->vm_fault.failed) {
+        current_thread->vm_fault.failed = false;
+        if(current_thread->vm_fault.address == address) return false;
+    }
+
     current_thread->vm_fault.in_flight = true;
     current_thread->vm_fault.address = address;
+    current_thread->vm_fault.type = fault;
     current_thread->vm_fault.dw_item.data = current_thread;
     current_thread->vm_fault.dw_item.fn = vm_fault_soft;
     current_thread->vm_fault.dw_item.cleanup_fn = nullptr;
@@ -477,33 +1118,53 @@ bool vm_fault(uintptr_t address, vm_fault_t fault) {
 }
 
 size_t vm_copy_to(vm_address_space_t *dest_as, uintptr_t dest_addr, void *src, size_t count) {
-    if(!memory_exists(dest_as, dest_addr, count)) return 0;
+    rwlock_read_acquire_nodw(&dest_as->lock);
+    if(!memory_exists(dest_as, dest_addr, count)) {
+        rwlock_read_release_nodw(&dest_as->lock);
+        return 0;
+    }
+
     size_t i = 0;
     while(i < count) {
         size_t offset = (dest_addr + i) % ARCH_PAGE_GRANULARITY;
         uintptr_t phys;
         if(!arch_ptm_physical(dest_as, dest_addr + i, &phys)) {
-            if(!address_space_fix_page(dest_as, dest_addr + i)) return i;
+            if(!address_space_fix_page(dest_as, dest_addr + i, VM_FAULT_NOT_PRESENT)) break;
             bool success = arch_ptm_physical(dest_as, dest_addr + i, &phys);
             ASSERT(success);
         }
 
+        // Never write through to the zero page or pages shared with the filesystem
+        vm_region_t *region = addr_to_region(dest_as, dest_addr + i);
+        if(region != nullptr && region->type != VM_REGION_TYPE_DIRECT) {
+            spinlock_acquire_nodw(&region->lock);
+            bool success = region_unshare(region, MATH_FLOOR(dest_addr + i, ARCH_PAGE_GRANULARITY));
+            spinlock_release_nodw(&region->lock);
+            if(!success || !arch_ptm_physical(dest_as, dest_addr + i, &phys)) break;
+        }
+
         size_t len = MATH_MIN(count - i, ARCH_PAGE_GRANULARITY - offset);
         mem_copy((void *) HHDM(phys), src, len);
         i += len;
         src += len;
     }
+    rwlock_read_release_nodw(&dest_as->lock);
     return i;
 }
 
 size_t vm_copy_from(void *dest, vm_address_space_t *src_as, uintptr_t src_addr, size_t count) {
-    if(!memory_exists(src_as, src_addr, count)) return 0;
+    rwlock_read_acquire_nodw(&src_as->lock);
+    if(!memory_exists(src_as, src_addr, count)) {
+        rwlock_read_release_nodw(&src_as->lock);
+        return 0;
+    }
+
     size_t i = 0;
     while(i < count) {
         size_t offset = (src_addr + i) % ARCH_PAGE_GRANULARITY;
         uintptr_t phys;
         if(!arch_ptm_physical(src_as, src_addr + i, &phys)) {
-            if(!address_space_fix_page(src_as, src_addr + i)) return i;
+            if(!address_space_fix_page(src_as, src_addr + i, VM_FAULT_NOT_PRESENT)) break;
             bool success = arch_ptm_physical(src_as, src_addr + i, &phys);
             ASSERT(success);
         }
@@ -513,9 +1174,176 @@ size_t vm_copy_from(void *dest, vm_address_space_t *src_as, uintptr_t src_addr,
         i += len;
         dest += len;
     }
+    rwlock_read_release_nodw(&src_as->lock);
     return i;
 }
 
+HOOK(init_slab_cache) {
+    g_region_cache = slab_cache_create("vm_region", sizeof(vm_region_t), 2);
+}
+
+void vm_address_space_destroy(vm_address_space_t *address_space) {
+    ASSERT(address_space != g_vm_global_address_space);
+
+    spinlock_acquire_nodw(&g_address_spaces_lock);
+    list_node_delete(&g_address_spaces, &address_space->list_node);
+    spinlock_release_nodw(&g_address_spaces_lock);
+
+    vm_unmap(address_space, (void *) address_space->start, MATH_FLOOR(address_space->end - address_space->start, ARCH_PAGE_GRANULARITY));
+    ASSERT(address_space->regions.root == nullptr);
+
+    arch_ptm_address_space_destroy(address_space);
+}
+
+void vm_address_space_register(vm_address_space_t *address_space) {
+    address_space->merge_cursor = address_space->start;
+    address_space->resident_pages = 0;
+    address_space->working_set_pages = 0;
+
+    spinlock_acquire_nodw(&g_address_spaces_lock);
+    list_push_back(&g_address_spaces, &address_space->list_node);
+    spinlock_release_nodw(&g_address_spaces_lock);
+}
+
+/// Take the next address space in turn, the list is rotated so every address space gets its turn.
+/// Destroying an address space unlinks it first, holding its lock keeps it alive once the list lock is dropped.
+/// @warning Assumes the address spaces lock is acquired, it is released when an address space is returned.
+/// @param remaining Address spaces left to try in this round
+/// @param write Try the write side of the address space lock instead of the read side
+/// @returns the address space with its lock acquired, nullptr once the round is over
+static vm_address_space_t *address_space_next(PARAM_INOUT(size_t *) remaining, bool write) {
+    while(*remaining > 0 && g_address_spaces.count > 0) {
+        (*remaining)--;
+        list_node_t *node = list_pop_front(&g_address_spaces);
+        list_push_back(&g_address_spaces, node);
+
+        vm_address_space_t *address_space = CONTAINER_OF(node, vm_address_space_t, list_node);
+        bool acquired = write ? rwlock_write_try_acquire_nodw(&address_space->lock) : rwlock_read_try_acquire_nodw(&address_space->lock);
+        if(!acquired) continue;
+
+        spinlock_release_nodw(&g_address_spaces_lock);
+        return address_space;
+    }
+    return nullptr;
+}
+
+size_t vm_merge_scan(size_t page_count) {
+    spinlock_acquire_nodw(&g_merge_lock);
+
+    size_t count = 0;
+    spinlock_acquire_nodw(&g_address_spaces_lock);
+    size_t remaining = g_address_spaces.count;
+    vm_address_space_t *address_space;
+    while(count < page_count && (address_space = address_space_next(&remaining, false)) != nullptr) {
+        uintptr_t address = address_space->merge_cursor;
+        while(count < page_count) {
+            vm_region_t *region = addr_to_region(address_space, address);
+            if(region == nullptr) {
+                rb_node_t *rb_node = rb_search(&address_space->regions, address, RB_SEARCH_TYPE_NEAREST_GT);
+                if(rb_node == nullptr) {
+                    address = address_space->start;
+                    if(g_merge_pass_remaining > 0) g_merge_pass_remaining--;
+                    break;
+                }
+                region = CONTAINER_OF(rb_node, vm_region_t, rb_node);
+                address = region->base;
+            }
+
+            if(region->type != VM_REGION_TYPE_ANON || !region->mergeable || region->cache_behavior != VM_CACHE_STANDARD) {
+                address = region->base + region->length;
+                continue;
+            }
+
+            spinlock_acquire_nodw(&region->lock);
+            for(; address < region->base + region->length && count < page_count; address += ARCH_PAGE_GRANULARITY, count++) region_merge(region, address);
+            spinlock_release_nodw(&region->lock);
+        }
+        address_space->merge_cursor = address;
+
+        rwlock_read_release_nodw(&address_space->lock);
+        spinlock_acquire_nodw(&g_address_spaces_lock);
+    }
+
+    bool pass_complete = g_merge_pass_remaining == 0;
+    if(pass_complete) g_merge_pass_remaining = g_address_spaces.count;
+    spinlock_release_nodw(&g_address_spaces_lock);
+
+    spinlock_release_nodw(&g_merge_lock);
+
+    if(pass_complete) ksm_pass_complete();
+    return count;
+}
+
+size_t vm_working_set_sample() {
+    size_t count = 0;
+    spinlock_acquire_nodw(&g_address_spaces_lock);
+    size_t remaining = g_address_spaces.count;
+    vm_address_space_t *address_space;
+    while((address_space = address_space_next(&remaining, false)) != nullptr) {
+        // Direct regions may map frames without a page descriptor
+        size_t working_set = 0;
+        rb_node_t *rb_node = rb_search(&address_space->regions, address_space->start, RB_SEARCH_TYPE_NEAREST_GTE);
+        while(rb_node != nullptr) {
+            vm_region_t *region = CONTAINER_OF(rb_node, vm_region_t, rb_node);
+            if(region->type != VM_REGION_TYPE_DIRECT) {
+                size_t dirty;
+                size_t accessed = arch_ptm_harvest(address_space, region->base, region->length, &dirty);
+                region->working_set.accessed = accessed;
+                region->working_set.dirty = dirty;
+                region->working_set.estimate = (region->working_set.estimate * (WORKING_SET_WEIGHT - 1) + accessed) / WORKING_SET_WEIGHT;
+                working_set += region->working_set.estimate;
+                count += region->length / ARCH_PAGE_GRANULARITY;
+            }
+            rb_node = rb_search(&address_space->regions, region->base + region->length, RB_SEARCH_TYPE_NEAREST_GTE);
+        }
+        __atomic_store_n(&address_space->working_set_pages, working_set, __ATOMIC_RELAXED);
+
+        rwlock_read_release_nodw(&address_space->lock);
+        spinlock_acquire_nodw(&g_address_spaces_lock);
+    }
+    spinlock_release_nodw(&g_address_spaces_lock);
+    return count;
+}
+
+/// Compress cold anonymous pages of user address spaces into zswap.
+/// The allocating thread might hold any address space lock so they are only ever tried.
+static size_t swap_shrink(size_t page_count) {
+    size_t limit = MATH_MIN(page_count, (size_t) RECLAIM_BATCH);
+
+    size_t count = 0;
+    spinlock_acquire_nodw(&g_address_spaces_lock);
+    size_t remaining = g_address_spaces.count;
+    vm_address_space_t *address_space;
+    while(count < limit && (address_space = address_space_next(&remaining, true)) != nullptr) {
+        rb_node_t *rb_node = rb_search(&address_space->regions, address_space->start, RB_SEARCH_TYPE_NEAREST_GTE);
+        while(rb_node != nullptr && count < limit) {
+            vm_region_t *region = CONTAINER_OF(rb_node, vm_region_t, rb_node);
+            // Every page was used during the last sampling period, none of them would be taken
+            bool hot = region->working_set.accessed * ARCH_PAGE_GRANULARITY >= region->length;
+            if(region->type == VM_REGION_TYPE_ANON && region->cache_behavior == VM_CACHE_STANDARD && !hot) {
+                for(size_t j = 0; j < region->length && count < limit; j += ARCH_PAGE_GRANULARITY) {
+                    if(region_swap_out(region, region->base + j)) count++;
+                }
+            }
+            rb_node = rb_search(&address_space->regions, region->base + region->length, RB_SEARCH_TYPE_NEAREST_GTE);
+        }
+
+        rwlock_write_release_nodw(&address_space->lock);
+        spinlock_acquire_nodw(&g_address_spaces_lock);
+    }
+    spinlock_release_nodw(&g_address_spaces_lock);
+
+    // Compressed pages share pool pages, so this overstates what was actually freed
+    LOG_TRACE("VM", "reclaim swapped out %lu pages", count);
+    return count;
+}
+
+static reclaim_shrinker_t g_swap_shrinker = { .name = "zswap", .shrink = swap_shrink };
+
+INIT_TARGET(vm_shrinker, INIT_STAGE_MAIN, INIT_SCOPE_BSP, INIT_DEPS()) {
+    reclaim_shrinker_register(&g_swap_shrinker);
+}
+
 rb_tree_t vm_create_regions() {
-    return RB_TREE_INIT(region_node_value);
+    return RB_TREE_INIT_AUGMENTED(region_node_value, region_node_update);
 }
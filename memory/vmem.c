@@ -0,0 +1,321 @@
+#include "memory/vmem.h"
+
+#include "common/assert.h"
+#include "common/panic.h"
+#include "lib/container.h"
+#include "lib/expect.h"
+#include "memory/slab.h"
+#include "sys/hook.h"
+
+/// Segments tile the arena in address order so freeing coalesces with the neighbours in constant time.
+/// Allocation takes the head of the first freelist whose smallest segment fits (instant fit), frees of
+/// whole allocations are found through the hash. Fixed allocations and frees of partial allocations
+/// walk the segment list, they are rare for kernel address space.
+/// OPTIMIZE: the hash does not grow with the amount of allocations
+
+#define SEGMENT_RESERVE_COUNT 128
+#define SPARE_COUNT 2 /* An operation splits at most two segments */
+
+static_assert(VMEM_HASH_BUCKET_COUNT == 256, "the hash takes the top 8 bits of the key");
+
+typedef enum {
+    SEGMENT_TYPE_FREE,
+    SEGMENT_TYPE_ALLOCATED
+} segment_type_t;
+
+typedef struct {
+    segment_type_t type;
+    uintptr_t base;
+    size_t size;
+    list_node_t segment_node; /* Used for the arena segments */
+    list_node_t list_node; /* Used for freelists, hash buckets, spares and the segment reserve */
+} segment_t;
+
+static slab_cache_t *g_segment_cache;
+
+static spinlock_t g_segment_reserve_lock = SPINLOCK_INIT;
+static list_t g_segment_reserve = LIST_INIT;
+static segment_t g_segment_reserve_pool[SEGMENT_RESERVE_COUNT];
+static bool g_segment_reserve_initialized = false;
+
+/// Allocate a segment descriptor.
+/// Falls back to the static reserve when the slab cache is not available yet.
+static segment_t *segment_alloc() {
+    if(EXPECT_LIKELY(g_segment_cache != nullptr)) return slab_allocate(g_segment_cache);
+
+    spinlock_acquire_nodw(&g_segment_reserve_lock);
+    if(!g_segment_reserve_initialized) {
+        for(size_t i = 0; i < SEGMENT_RESERVE_COUNT; i++) list_push(&g_segment_reserve, &g_segment_reserve_pool[i].list_node);
+        g_segment_reserve_initialized = true;
+    }
+    list_node_t *node = list_pop(&g_segment_reserve);
+    spinlock_release_nodw(&g_segment_reserve_lock);
+    if(node == nullptr) panic("VMEM", "segment reserve exhausted");
+    return CONTAINER_OF(node, segment_t, list_node);
+}
+
+static void segment_free(segment_t *segment) {
+    if(segment >= &g_segment_reserve_pool[0] && segment < &g_segment_reserve_pool[SEGMENT_RESERVE_COUNT]) {
+        spinlock_acquire_nodw(&g_segment_reserve_lock);
+        list_push(&g_segment_reserve, &segment->list_node);
+        spinlock_release_nodw(&g_segment_reserve_lock);
+        return;
+    }
+    slab_free(g_segment_cache, segment);
+}
+
+/// Descriptors are allocated before and freed after the arena lock is held.
+static void spares_fill(list_t *spares) {
+    while(spares->count < SPARE_COUNT) list_push(spares, &segment_alloc()->list_node);
+}
+
+static void spares_drain(list_t *spares) {
+    while(spares->count > 0) segment_free(CONTAINER_OF(list_pop(spares), segment_t, list_node));
+}
+
+static size_t freelist_index(size_t size) {
+    return 63 - __builtin_clzll(size);
+}
+
+static void freelist_insert(vmem_t *vmem, segment_t *segment) {
+    size_t index = freelist_index(segment->size);
+    list_push(&vmem->freelists[index], &segment->list_node);
+    vmem->freemap |= 1llu << index;
+}
+
+static void freelist_remove(vmem_t *vmem, segment_t *segment) {
+    size_t index = freelist_index(segment->size);
+    list_node_delete(&vmem->freelists[index], &segment->list_node);
+    if(vmem->freelists[index].count == 0) vmem->freemap &= ~(1llu << index);
+}
+
+static list_t *hash_bucket(vmem_t *vmem, uintptr_t base) {
+    return &vmem->hash[((base / vmem->quantum) * 0x9E37'79B9'7F4A'7C15llu) >> 56];
+}
+
+static segment_t *hash_find(vmem_t *vmem, uintptr_t base) {
+    LIST_ITERATE(hash_bucket(vmem, base), node) {
+        segment_t *segment = CONTAINER_OF(node, segment_t, list_node);
+        if(segment->base == base) return segment;
+    }
+    return nullptr;
+}
+
+/// Find the segment containing an address.
+static segment_t *segment_find(vmem_t *vmem, uintptr_t address) {
+    LIST_ITERATE(&vmem->segments, node) {
+        segment_t *segment = CONTAINER_OF(node, segment_t, segment_node);
+        if(address >= segment->base && address < segment->base + segment->size) return segment;
+    }
+    return nullptr;
+}
+
+/// Split a segment in two, the new segment starts at offset and is returned.
+static segment_t *segment_split(vmem_t *vmem, segment_t *segment, size_t offset, list_t *spares) {
+    ASSERT(offset > 0 && offset < segment->size);
+
+    list_node_t *node = list_pop(spares);
+    ASSERT(node != nullptr);
+    segment_t *split = CONTAINER_OF(node, segment_t, list_node);
+
+    if(segment->type == SEGMENT_TYPE_FREE) freelist_remove(vmem, segment);
+
+    split->type = segment->type;
+    split->base = segment->base + offset;
+    split->size = segment->size - offset;
+    segment->size = offset;
+    list_node_append(&vmem->segments, &segment->segment_node, &split->segment_node);
+
+    if(segment->type == SEGMENT_TYPE_FREE) {
+        freelist_insert(vmem, segment);
+        freelist_insert(vmem, split);
+    } else {
+        list_push(hash_bucket(vmem, split->base), &split->list_node);
+    }
+    return split;
+}
+
+static void segment_allocate(vmem_t *vmem, segment_t *segment) {
+    freelist_remove(vmem, segment);
+    segment->type = SEGMENT_TYPE_ALLOCATED;
+    list_push(hash_bucket(vmem, segment->base), &segment->list_node);
+}
+
+/// Free an allocated segment and coalesce it with free neighbours.
+static segment_t *segment_release(vmem_t *vmem, segment_t *segment, list_t *spares) {
+    list_node_delete(hash_bucket(vmem, segment->base), &segment->list_node);
+    segment->type = SEGMENT_TYPE_FREE;
+
+    list_node_t *prev = segment->segment_node.prev;
+    if(prev != nullptr && CONTAINER_OF(prev, segment_t, segment_node)->type == SEGMENT_TYPE_FREE) {
+        segment_t *left = CONTAINER_OF(prev, segment_t, segment_node);
+        freelist_remove(vmem, left);
+        left->size += segment->size;
+        list_node_delete(&vmem->segments, &segment->segment_node);
+        list_push(spares, &segment->list_node);
+        segment = left;
+    }
+
+    list_node_t *next = segment->segment_node.next;
+    if(next != nullptr && CONTAINER_OF(next, segment_t, segment_node)->type == SEGMENT_TYPE_FREE) {
+        segment_t *right = CONTAINER_OF(next, segment_t, segment_node);
+        freelist_remove(vmem, right);
+        segment->size += right->size;
+        list_node_delete(&vmem->segments, &right->segment_node);
+        list_push(spares, &right->list_node);
+    }
+
+    freelist_insert(vmem, segment);
+    return segment;
+}
+
+/// Instant fit, any segment on a list above the size class of the request fits.
+static bool alloc_segment(vmem_t *vmem, size_t size, PARAM_OUT(uintptr_t *) address, list_t *spares) {
+    size_t index = freelist_index(size);
+    if((size & (size - 1)) != 0) index++;
+
+    segment_t *segment = nullptr;
+    uint64_t candidates = index < VMEM_FREELIST_COUNT ? vmem->freemap & ~((1llu << index) - 1) : 0;
+    if(candidates != 0) {
+        segment = CONTAINER_OF(vmem->freelists[__builtin_ctzll(candidates)].head, segment_t, list_node);
+    } else {
+        // Segments in the size class of the request might still fit
+        LIST_ITERATE(&vmem->freelists[freelist_index(size)], node) {
+            segment_t *candidate = CONTAINER_OF(node, segment_t, list_node);
+            if(candidate->size < size) continue;
+            segment = candidate;
+            break;
+        }
+        if(segment == nullptr) return false;
+    }
+
+    if(segment->size > size) segment_split(vmem, segment, size, spares);
+    segment_allocate(vmem, segment);
+
+    *address = segment->base;
+    return true;
+}
+
+static bool xalloc_segment(vmem_t *vmem, uintptr_t address, size_t size, list_t *spares) {
+    segment_t *segment = segment_find(vmem, address);
+    if(segment == nullptr || segment->type != SEGMENT_TYPE_FREE || segment->base + segment->size - address < size) return false;
+
+    if(segment->base < address) segment = segment_split(vmem, segment, address - segment->base, spares);
+    if(segment->size > size) segment_split(vmem, segment, size, spares);
+    segment_allocate(vmem, segment);
+    return true;
+}
+
+/// Return the ranges held by the quantum caches to the arena.
+static void qcache_purge(vmem_t *vmem, list_t *spares) {
+    for(size_t i = 0; i < VMEM_QCACHE_COUNT; i++) {
+        while(vmem->qcaches[i].count > 0) {
+            segment_t *segment = hash_find(vmem, vmem->qcaches[i].addresses[--vmem->qcaches[i].count]);
+            ASSERT(segment != nullptr);
+            segment_release(vmem, segment, spares);
+        }
+    }
+}
+
+void vmem_initialize(vmem_t *vmem, const char *name, uintptr_t base, size_t size, size_t quantum) {
+    ASSERT(quantum > 0 && base % quantum == 0 && size % quantum == 0 && size > 0);
+
+    vmem->name = name;
+    vmem->lock = SPINLOCK_INIT;
+    vmem->base = base;
+    vmem->size = size;
+    vmem->quantum = quantum;
+    vmem->segments = LIST_INIT;
+    vmem->freemap = 0;
+    for(size_t i = 0; i < VMEM_FREELIST_COUNT; i++) vmem->freelists[i] = LIST_INIT;
+    for(size_t i = 0; i < VMEM_HASH_BUCKET_COUNT; i++) vmem->hash[i] = LIST_INIT;
+    for(size_t i = 0; i < VMEM_QCACHE_COUNT; i++) vmem->qcaches[i].count = 0;
+
+    segment_t *segment = segment_alloc();
+    segment->type = SEGMENT_TYPE_FREE;
+    segment->base = base;
+    segment->size = size;
+    list_push(&vmem->segments, &segment->segment_node);
+    freelist_insert(vmem, segment);
+}
+
+bool vmem_alloc(vmem_t *vmem, size_t size, PARAM_OUT(uintptr_t *) address) {
+    ASSERT(size > 0 && size % vmem->quantum == 0);
+
+    list_t spares = LIST_INIT;
+    spares_fill(&spares);
+
+    spinlock_acquire_nodw(&vmem->lock);
+    bool result = true;
+    size_t quanta = size / vmem->quantum;
+    if(quanta <= VMEM_QCACHE_COUNT && vmem->qcaches[quanta - 1].count > 0) {
+        *address = vmem->qcaches[quanta - 1].addresses[--vmem->qcaches[quanta - 1].count];
+    } else if(!alloc_segment(vmem, size, address, &spares)) {
+        qcache_purge(vmem, &spares);
+        result = alloc_segment(vmem, size, address, &spares);
+    }
+    spinlock_release_nodw(&vmem->lock);
+
+    spares_drain(&spares);
+    return result;
+}
+
+bool vmem_xalloc(vmem_t *vmem, uintptr_t address, size_t size) {
+    ASSERT(size > 0 && size % vmem->quantum == 0 && address % vmem->quantum == 0);
+    if(address < vmem->base || address - vmem->base > vmem->size || vmem->base + vmem->size - address < size) return false;
+
+    list_t spares = LIST_INIT;
+    spares_fill(&spares);
+
+    spinlock_acquire_nodw(&vmem->lock);
+    bool result = xalloc_segment(vmem, address, size, &spares);
+    if(!result) {
+        qcache_purge(vmem, &spares);
+        result = xalloc_segment(vmem, address, size, &spares);
+    }
+    spinlock_release_nodw(&vmem->lock);
+
+    spares_drain(&spares);
+    return result;
+}
+
+void vmem_free(vmem_t *vmem, uintptr_t address, size_t size) {
+    ASSERT(size > 0 && size % vmem->quantum == 0 && address % vmem->quantum == 0);
+    ASSERT(address >= vmem->base && address - vmem->base <= vmem->size && vmem->base + vmem->size - address >= size);
+
+    list_t spares = LIST_INIT;
+    spares_fill(&spares);
+
+    spinlock_acquire_nodw(&vmem->lock);
+    segment_t *segment = hash_find(vmem, address);
+    if(segment != nullptr && segment->size == size) {
+        size_t quanta = size / vmem->quantum;
+        if(quanta <= VMEM_QCACHE_COUNT && vmem->qcaches[quanta - 1].count < VMEM_QCACHE_DEPTH) {
+            vmem->qcaches[quanta - 1].addresses[vmem->qcaches[quanta - 1].count++] = address;
+            goto unlock;
+        }
+    }
+
+    if(segment == nullptr) segment = segment_find(vmem, address);
+    while(size > 0) {
+        ASSERT(segment != nullptr && segment->type == SEGMENT_TYPE_ALLOCATED);
+
+        if(segment->base < address) segment = segment_split(vmem, segment, address - segment->base, &spares);
+        if(segment->size > size) segment_split(vmem, segment, size, &spares);
+
+        address += segment->size;
+        size -= segment->size;
+
+        segment = segment_release(vmem, segment, &spares);
+        list_node_t *next = segment->segment_node.next;
+        segment = next != nullptr ? CONTAINER_OF(next, segment_t, segment_node) : nullptr;
+    }
+
+unlock:
+    spinlock_release_nodw(&vmem->lock);
+    spares_drain(&spares);
+}
+
+HOOK(init_slab_cache) {
+    g_segment_cache = slab_cache_create("vmem_segment", sizeof(segment_t), 1);
+}
@@ -0,0 +1,51 @@
+#include "memory/wss.h"
+
+#include "arch/sched.h"
+#include "common/lock/spinlock.h"
+#include "common/log.h"
+#include "memory/vm.h"
+#include "sched/sched.h"
+
+#define DEFAULT_INTERVAL (1'000 * (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND))
+
+/// Every period the accessed and dirty bits of anonymous and file regions are harvested and
+/// cleared. Regions keep the counts of the last period and a moving average of the accessed
+/// pages, reclaim leaves regions alone that were fully used during the last period.
+/// OPTIMIZE: every region is sampled each period, however large and however idle
+
+static spinlock_t g_wss_lock = SPINLOCK_INIT;
+static wss_tunables_t g_tunables = { .run = true, .interval = DEFAULT_INTERVAL };
+
+static void wss_thread() {
+    while(true) {
+        wss_tunables_t tunables = wss_tunables_get();
+        if(tunables.run) {
+            [[maybe_unused]] size_t count = vm_working_set_sample();
+            LOG_TRACE("WSS", "sampled %lu pages", count);
+        }
+
+        sched_sleep(tunables.interval);
+    }
+}
+
+thread_t *wss_thread_create() {
+    return arch_sched_thread_create_kernel(wss_thread);
+}
+
+wss_tunables_t wss_tunables_get() {
+    spinlock_acquire_nodw(&g_wss_lock);
+    wss_tunables_t tunables = g_tunables;
+    spinlock_release_nodw(&g_wss_lock);
+    return tunables;
+}
+
+bool wss_tunables_set(wss_tunables_t tunables) {
+    if(tunables.interval == 0) return false;
+
+    spinlock_acquire_nodw(&g_wss_lock);
+    g_tunables = tunables;
+    spinlock_release_nodw(&g_wss_lock);
+
+    log(LOG_LEVEL_DEBUG, "WSS", "tunables (run: %u, interval: %lu)", tunables.run, tunables.interval);
+    return true;
+}
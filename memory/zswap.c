@@ -0,0 +1,105 @@
+#include "memory/zswap.h"
+
+#include "arch/page.h"
+#include "common/assert.h"
+#include "common/lock/spinlock.h"
+#include "common/log.h"
+#include "lib/container.h"
+#include "lib/list.h"
+#include "lib/lz.h"
+#include "lib/mem.h"
+#include "memory/hhdm.h"
+#include "memory/page.h"
+#include "memory/pmm.h"
+
+/// Pool pages hold up to two compressed pages (zbud style). Whenever no pool page
+/// has a free slot, the frame that is being stored becomes the next pool page.
+/// Storing therefore never allocates, which matters because it runs when memory is exhausted.
+
+#define SLOT_COUNT 2
+#define SLOT_CAPACITY ((ARCH_PAGE_GRANULARITY - sizeof(pool_page_t)) / SLOT_COUNT)
+
+#define ENTRY(POOL_ADDRESS, SLOT) (((POOL_ADDRESS) / ARCH_PAGE_GRANULARITY) * SLOT_COUNT + (SLOT))
+#define ENTRY_POOL_ADDRESS(ENTRY) (((ENTRY) / SLOT_COUNT) * ARCH_PAGE_GRANULARITY)
+#define ENTRY_SLOT(ENTRY) ((ENTRY) % SLOT_COUNT)
+
+typedef struct {
+    list_node_t list_node; /* Used for the open pool pages list */
+    uint16_t sizes[SLOT_COUNT]; /* Compressed size of each slot, 0 for a free slot */
+} pool_page_t;
+
+static spinlock_t g_zswap_lock = SPINLOCK_INIT;
+static list_t g_open_pool_pages = LIST_INIT; /* Pool pages with a free slot */
+static uint8_t g_scratch[SLOT_CAPACITY];
+
+static void *slot_data(pool_page_t *pool_page, size_t slot) {
+    return (void *) ((uintptr_t) pool_page + sizeof(pool_page_t) + slot * SLOT_CAPACITY);
+}
+
+/// @warning Assumes zswap lock is acquired.
+static void release_slot(uint64_t entry) {
+    pool_page_t *pool_page = (pool_page_t *) HHDM(ENTRY_POOL_ADDRESS(entry));
+    size_t slot = ENTRY_SLOT(entry);
+    ASSERT(pool_page->sizes[slot] != 0);
+    pool_page->sizes[slot] = 0;
+
+    if(pool_page->sizes[SLOT_COUNT - 1 - slot] != 0) {
+        list_push(&g_open_pool_pages, &pool_page->list_node);
+        return;
+    }
+
+    list_node_delete(&g_open_pool_pages, &pool_page->list_node);
+    pmm_free(&PAGE(ENTRY_POOL_ADDRESS(entry))->block);
+}
+
+bool zswap_store(uintptr_t physical_address, PARAM_OUT(uint64_t *) entry) {
+    ASSERT(physical_address % ARCH_PAGE_GRANULARITY == 0);
+
+    spinlock_acquire_nodw(&g_zswap_lock);
+    size_t size = lz_compress((void *) HHDM(physical_address), ARCH_PAGE_GRANULARITY, g_scratch, SLOT_CAPACITY);
+    if(size == 0) {
+        spinlock_release_nodw(&g_zswap_lock);
+        return false;
+    }
+
+    bool reused = g_open_pool_pages.count == 0;
+    pool_page_t *pool_page;
+    size_t slot = 0;
+    if(reused) {
+        pool_page = (pool_page_t *) HHDM(physical_address);
+        for(size_t i = 0; i < SLOT_COUNT; i++) pool_page->sizes[i] = 0;
+        list_push(&g_open_pool_pages, &pool_page->list_node);
+    } else {
+        pool_page = CONTAINER_OF(g_open_pool_pages.head, pool_page_t, list_node);
+        while(pool_page->sizes[slot] != 0) slot++;
+        list_node_delete(&g_open_pool_pages, &pool_page->list_node);
+    }
+
+    pool_page->sizes[slot] = size;
+    mem_copy(slot_data(pool_page, slot), g_scratch, size);
+    *entry = ENTRY(HHDM_TO_PHYS((uintptr_t) pool_page), slot);
+    spinlock_release_nodw(&g_zswap_lock);
+
+    if(!reused) pmm_free(&PAGE(physical_address)->block);
+
+    LOG_TRACE("ZSWAP", "store(%#lx) -> %#lx (%lu bytes)", physical_address, *entry, size);
+    return true;
+}
+
+void zswap_load(uint64_t entry, uintptr_t physical_address) {
+    spinlock_acquire_nodw(&g_zswap_lock);
+    pool_page_t *pool_page = (pool_page_t *) HHDM(ENTRY_POOL_ADDRESS(entry));
+    size_t slot = ENTRY_SLOT(entry);
+    bool success = lz_decompress(slot_data(pool_page, slot), pool_page->sizes[slot], (void *) HHDM(physical_address), ARCH_PAGE_GRANULARITY);
+    ASSERT(success);
+    release_slot(entry);
+    spinlock_release_nodw(&g_zswap_lock);
+
+    LOG_TRACE("ZSWAP", "load(%#lx) -> %#lx", entry, physical_address);
+}
+
+void zswap_release(uint64_t entry) {
+    spinlock_acquire_nodw(&g_zswap_lock);
+    release_slot(entry);
+    spinlock_release_nodw(&g_zswap_lock);
+}
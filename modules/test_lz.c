@@ -0,0 +1,70 @@
+#include "arch/page.h"
+#include "common/assert.h"
+#include "common/log.h"
+#include "lib/lz.h"
+#include "lib/mem.h"
+#include "memory/hhdm.h"
+#include "memory/page.h"
+#include "memory/pmm.h"
+
+static uint8_t *g_page;
+static uint8_t *g_compressed; /* Two pages, room for input that does not compress */
+static uint8_t *g_decompressed;
+
+static uint8_t *alloc_pages(size_t count) {
+    return (uint8_t *) HHDM(PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_pages(count, PMM_FLAG_NONE))));
+}
+
+/// Round trip the page through the codec.
+/// @returns compressed size
+static size_t round_trip() {
+    size_t size = lz_compress(g_page, ARCH_PAGE_GRANULARITY, g_compressed, ARCH_PAGE_GRANULARITY * 2);
+    ASSERT(size > 0);
+
+    mem_set(g_decompressed, 0xAA, ARCH_PAGE_GRANULARITY);
+    ASSERT(lz_decompress(g_compressed, size, g_decompressed, ARCH_PAGE_GRANULARITY));
+    for(size_t i = 0; i < ARCH_PAGE_GRANULARITY; i++) ASSERT(g_decompressed[i] == g_page[i]);
+    return size;
+}
+
+void __module_initialize() {
+    log(LOG_LEVEL_INFO, "TEST_LZ", "Running LZ tests");
+
+    g_page = alloc_pages(1);
+    g_compressed = alloc_pages(2);
+    g_decompressed = alloc_pages(1);
+
+    // Zero page
+    mem_set(g_page, 0, ARCH_PAGE_GRANULARITY);
+    ASSERT(round_trip() < ARCH_PAGE_GRANULARITY / 16);
+
+    // Random page, expands slightly
+    uint64_t state = 0x9E37'79B9'7F4A'7C15;
+    for(size_t i = 0; i < ARCH_PAGE_GRANULARITY; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        g_page[i] = (uint8_t) state;
+    }
+    round_trip();
+
+    // Repetitive page, short pattern with the odd byte changed
+    for(size_t i = 0; i < ARCH_PAGE_GRANULARITY; i++) g_page[i] = (uint8_t) (i % 12);
+    for(size_t i = 0; i < ARCH_PAGE_GRANULARITY; i += 509) g_page[i] = 0xFF;
+    ASSERT(round_trip() < ARCH_PAGE_GRANULARITY / 2);
+
+    // Too little room fails instead of overflowing
+    ASSERT(lz_compress(g_page, ARCH_PAGE_GRANULARITY, g_compressed, 8) == 0);
+
+    // Truncated input is rejected
+    size_t size = lz_compress(g_page, ARCH_PAGE_GRANULARITY, g_compressed, ARCH_PAGE_GRANULARITY * 2);
+    ASSERT(!lz_decompress(g_compressed, size / 2, g_decompressed, ARCH_PAGE_GRANULARITY));
+
+    pmm_free(&PAGE(HHDM_TO_PHYS((uintptr_t) g_page))->block);
+    pmm_free(&PAGE(HHDM_TO_PHYS((uintptr_t) g_compressed))->block);
+    pmm_free(&PAGE(HHDM_TO_PHYS((uintptr_t) g_decompressed))->block);
+}
+
+void __module_uninitialize() {
+    log(LOG_LEVEL_INFO, "TEST_LZ", "Passed all LZ tests");
+}
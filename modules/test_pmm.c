@@ -21,6 +21,14 @@ void __module_initialize() {
 
     uint8_t *data = (uint8_t *) HHDM(paddr);
     for(size_t i = 0; i < ARCH_PAGE_GRANULARITY; i++) ASSERT(data[i] == 0);
+
+    page_t *page = PAGE_FROM_BLOCK(zeroed);
+    ASSERT(page->refcount == 1 && page->flags == 0);
+    page_get(page);
+    page_put(page);
+    ASSERT(zeroed->free == false);
+    page_put(page);
+    ASSERT(zeroed->free == true);
 }
 
 void __module_uninitialize() {
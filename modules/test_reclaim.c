@@ -0,0 +1,37 @@
+#include "common/assert.h"
+#include "common/log.h"
+#include "memory/hhdm.h"
+#include "memory/page.h"
+#include "memory/pmm.h"
+#include "sys/interrupt.h"
+
+void __module_initialize() {
+    log(LOG_LEVEL_INFO, "TEST_RECLAIM", "Running RECLAIM tests");
+
+    // Drain the zone below the min watermark, the drained pages are chained through their first word
+    uintptr_t drained = 0;
+    while(__atomic_load_n(&g_pmm_zone_normal.free_page_count, __ATOMIC_RELAXED) >= g_pmm_zone_normal.watermarks.min) {
+        pmm_block_t *block = pmm_alloc_page(PMM_FLAG_NO_RECLAIM);
+        ASSERT(block != nullptr);
+        uintptr_t physical_address = PAGE_PADDR(PAGE_FROM_BLOCK(block));
+        *(uintptr_t *) HHDM(physical_address) = drained;
+        drained = physical_address;
+    }
+
+    // With interrupts masked the allocation skips reclaim and is served from what is left
+    interrupt_state_t previous_state = interrupt_state_mask();
+    pmm_block_t *block = pmm_alloc_page(PMM_FLAG_NONE);
+    interrupt_state_restore(previous_state);
+    ASSERT(block != nullptr);
+    pmm_free(block);
+
+    while(drained != 0) {
+        uintptr_t next = *(uintptr_t *) HHDM(drained);
+        pmm_free(&PAGE(drained)->block);
+        drained = next;
+    }
+}
+
+void __module_uninitialize() {
+    log(LOG_LEVEL_INFO, "TEST_RECLAIM", "Passed all RECLAIM tests");
+}
@@ -136,11 +136,19 @@ void __module_initialize() {
 
     TEST_ASSERT(as, check_as(as, 1, (as_check_t) { .offset = 5, .count = 10 }));
 
+    // Test first fit hole search
+    TEST_ASSERT(as, vm_map_anon(as, nullptr, ARCH_PAGE_GRANULARITY * 4, VM_PROT_RX, VM_CACHE_STANDARD, VM_FLAG_NONE) == (void *) (ARCH_PAGE_GRANULARITY * 1));
+    TEST_ASSERT(as, vm_map_anon(as, nullptr, ARCH_PAGE_GRANULARITY * 2, VM_PROT_RX, VM_CACHE_STANDARD, VM_FLAG_NONE) == (void *) (ARCH_PAGE_GRANULARITY * 15));
+
+    UNMAP(as, 8, 2);
+    TEST_ASSERT(as, vm_map_anon(as, nullptr, ARCH_PAGE_GRANULARITY * 2, VM_PROT_RX, VM_CACHE_STANDARD, VM_FLAG_NONE) == (void *) (ARCH_PAGE_GRANULARITY * 8));
+    TEST_ASSERT(as, check_as(as, 5, (as_check_t) { .offset = 1, .count = 4 }, (as_check_t) { .offset = 5, .count = 3 }, (as_check_t) { .offset = 8, .count = 2 }, (as_check_t) { .offset = 10, .count = 5 }, (as_check_t) { .offset = 15, .count = 2 }));
+
     // Unmap everything
     vm_unmap(as, (void *) as->start, MATH_FLOOR(as->end - as->start, ARCH_PAGE_GRANULARITY));
     TEST_ASSERT(as, as->regions.root == nullptr);
 
-    // TODO: free address space
+    vm_address_space_destroy(as);
 }
 
 void __module_uninitialize() {
@@ -0,0 +1,66 @@
+#include "arch/page.h"
+#include "common/assert.h"
+#include "common/log.h"
+#include "memory/vmem.h"
+
+#define QUANTUM ARCH_PAGE_GRANULARITY
+#define BASE (QUANTUM * 16)
+#define SIZE (QUANTUM * 64)
+
+static vmem_t g_arena;
+
+void __module_initialize() {
+    log(LOG_LEVEL_INFO, "TEST_VMEM", "Running VMEM tests");
+
+    vmem_initialize(&g_arena, "test", BASE, SIZE, QUANTUM);
+
+    // Allocations fall inside the arena and do not overlap
+    uintptr_t a, b;
+    ASSERT(vmem_alloc(&g_arena, QUANTUM * 4, &a));
+    ASSERT(vmem_alloc(&g_arena, QUANTUM * 4, &b));
+    ASSERT(a >= BASE && a + QUANTUM * 4 <= BASE + SIZE);
+    ASSERT(b >= BASE && b + QUANTUM * 4 <= BASE + SIZE);
+    ASSERT(a + QUANTUM * 4 <= b || b + QUANTUM * 4 <= a);
+    uintptr_t unused;
+    ASSERT(!vmem_alloc(&g_arena, SIZE, &unused));
+
+    // Specific ranges
+    uintptr_t fixed = BASE + QUANTUM * 32;
+    ASSERT(vmem_xalloc(&g_arena, fixed, QUANTUM * 16));
+    ASSERT(!vmem_xalloc(&g_arena, fixed + QUANTUM * 4, QUANTUM * 4));
+    ASSERT(!vmem_xalloc(&g_arena, BASE + SIZE - QUANTUM, QUANTUM * 2));
+
+    // Freeing part of an allocation leaves the rest allocated
+    vmem_free(&g_arena, fixed + QUANTUM * 4, QUANTUM * 4);
+    ASSERT(vmem_xalloc(&g_arena, fixed + QUANTUM * 4, QUANTUM * 4));
+    ASSERT(!vmem_xalloc(&g_arena, fixed, QUANTUM));
+
+    // Freed pieces coalesce back into one segment, a free may span several allocations
+    vmem_free(&g_arena, fixed, QUANTUM * 2);
+    vmem_free(&g_arena, fixed + QUANTUM * 2, QUANTUM * 14);
+    ASSERT(vmem_xalloc(&g_arena, fixed, QUANTUM * 16));
+    vmem_free(&g_arena, fixed, QUANTUM * 16);
+
+    // Small ranges freed whole are cached and handed out again
+    vmem_free(&g_arena, a, QUANTUM * 4);
+    ASSERT(g_arena.qcaches[3].count == 1);
+    uintptr_t cached;
+    ASSERT(vmem_alloc(&g_arena, QUANTUM * 4, &cached) && cached == a);
+    ASSERT(g_arena.qcaches[3].count == 0);
+
+    // Cached ranges stay allocated until a failing allocation purges them
+    vmem_free(&g_arena, a, QUANTUM * 4);
+    vmem_free(&g_arena, b, QUANTUM * 4);
+    ASSERT(g_arena.qcaches[3].count == 2);
+    ASSERT(vmem_xalloc(&g_arena, a, QUANTUM * 4));
+    ASSERT(g_arena.qcaches[3].count == 0);
+    vmem_free(&g_arena, a, QUANTUM * 4);
+
+    uintptr_t whole;
+    ASSERT(vmem_alloc(&g_arena, SIZE, &whole) && whole == BASE);
+    vmem_free(&g_arena, whole, SIZE);
+}
+
+void __module_uninitialize() {
+    log(LOG_LEVEL_INFO, "TEST_VMEM", "Passed all VMEM tests");
+}
@@ -0,0 +1,76 @@
+#include "arch/page.h"
+#include "common/assert.h"
+#include "common/log.h"
+#include "memory/hhdm.h"
+#include "memory/page.h"
+#include "memory/pmm.h"
+#include "memory/zswap.h"
+
+#define SEED 0x9E37'79B9'7F4A'7C15
+
+typedef enum {
+    PATTERN_ZERO,
+    PATTERN_REPETITIVE,
+    PATTERN_RANDOM
+} pattern_t;
+
+/// Bytes of a pattern in order, random bytes come from a fixed seed so they can be generated again.
+static uint8_t pattern_next(pattern_t pattern, size_t i, uint64_t *state) {
+    switch(pattern) {
+        case PATTERN_ZERO:       return 0;
+        case PATTERN_REPETITIVE: return (uint8_t) (i % 12);
+        case PATTERN_RANDOM:
+            *state ^= *state << 13;
+            *state ^= *state >> 7;
+            *state ^= *state << 17;
+            return (uint8_t) *state;
+    }
+    return 0;
+}
+
+static uintptr_t alloc_filled(pattern_t pattern) {
+    uintptr_t physical_address = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_NONE)));
+    uint8_t *data = (uint8_t *) HHDM(physical_address);
+    uint64_t state = SEED;
+    for(size_t i = 0; i < ARCH_PAGE_GRANULARITY; i++) data[i] = pattern_next(pattern, i, &state);
+    return physical_address;
+}
+
+static bool matches(uintptr_t physical_address, pattern_t pattern) {
+    uint8_t *data = (uint8_t *) HHDM(physical_address);
+    uint64_t state = SEED;
+    for(size_t i = 0; i < ARCH_PAGE_GRANULARITY; i++) {
+        if(data[i] != pattern_next(pattern, i, &state)) return false;
+    }
+    return true;
+}
+
+void __module_initialize() {
+    log(LOG_LEVEL_INFO, "TEST_ZSWAP", "Running ZSWAP tests");
+
+    // Stored frames belong to the pool, the contents are regenerated for comparison
+    uint64_t zero_entry, repetitive_entry, released_entry;
+    ASSERT(zswap_store(alloc_filled(PATTERN_ZERO), &zero_entry));
+    ASSERT(zswap_store(alloc_filled(PATTERN_REPETITIVE), &repetitive_entry));
+    ASSERT(zswap_store(alloc_filled(PATTERN_REPETITIVE), &released_entry));
+
+    // A page that does not compress stays with the caller untouched
+    uint64_t unused;
+    uintptr_t random = alloc_filled(PATTERN_RANDOM);
+    ASSERT(!zswap_store(random, &unused));
+    ASSERT(matches(random, PATTERN_RANDOM));
+    pmm_free(&PAGE(random)->block);
+
+    zswap_release(released_entry);
+
+    uintptr_t frame = PAGE_PADDR(PAGE_FROM_BLOCK(pmm_alloc_page(PMM_FLAG_NONE)));
+    zswap_load(repetitive_entry, frame);
+    ASSERT(matches(frame, PATTERN_REPETITIVE));
+    zswap_load(zero_entry, frame);
+    ASSERT(matches(frame, PATTERN_ZERO));
+    pmm_free(&PAGE(frame)->block);
+}
+
+void __module_uninitialize() {
+    log(LOG_LEVEL_INFO, "TEST_ZSWAP", "Passed all ZSWAP tests");
+}
@@ -1,7 +1,9 @@
 #include "sched/process.h"
 
 #include "common/log.h"
+#include "lib/container.h"
 #include "memory/heap.h"
+#include "sched/thread.h"
 
 static long g_next_pid = 1;
 
@@ -13,6 +15,7 @@ process_t *process_create(vm_address_space_t *address_space) {
     proc->id = __atomic_fetch_add(&g_next_pid, 1, __ATOMIC_RELAXED);
     proc->lock = SPINLOCK_INIT;
     proc->threads = LIST_INIT;
+    proc->accounting = (accounting_t) {};
     proc->address_space = address_space;
 
     spinlock_acquire(&g_sched_processes_lock);
@@ -24,6 +27,16 @@ process_t *process_create(vm_address_space_t *address_space) {
     return proc;
 }
 
+accounting_t process_accounting(process_t *process) {
+    spinlock_acquire_nodw(&process->lock);
+    accounting_t accounting = process->accounting;
+    LIST_ITERATE(&process->threads, node) {
+        accounting_add(&accounting, &CONTAINER_OF(node, thread_t, list_node_proc)->accounting);
+    }
+    spinlock_release_nodw(&process->lock);
+    return accounting;
+}
+
 void process_destroy(process_t *process) {
     log(LOG_LEVEL_DEBUG, "PROCESS", "destroyed pid %lu", process->id);
 }
@@ -7,6 +7,7 @@
 #include "lib/container.h"
 #include "lib/list.h"
 #include "memory/heap.h"
+#include "memory/vm.h"
 #include "sched/process.h"
 #include "sched/thread.h"
 
@@ -31,7 +32,7 @@ repeat:
 
         log(LOG_LEVEL_DEBUG, "REAPER", "pid: %lu", process->id);
 
-        // TODO: free process address space
+        vm_address_space_destroy(process->address_space);
         heap_free(process, sizeof(process_t));
     }
 
@@ -46,7 +47,7 @@ repeat:
 
         log(LOG_LEVEL_DEBUG, "REAPER", "tid: %lu", thread->id);
 
-        // TODO: free arch thread
+        arch_sched_thread_destroy(thread);
     }
 
     sched_yield(THREAD_STATE_BLOCK);
@@ -12,6 +12,7 @@
 #include "sched/thread.h"
 #include "sys/cpu.h"
 #include "sys/dw.h"
+#include "sys/event.h"
 #include "sys/interrupt.h"
 
 void sched_thread_schedule(thread_t *thread) {
@@ -36,7 +37,8 @@ thread_t *sched_thread_next(sched_t *sched) {
     return thread;
 }
 
-void sched_yield(enum thread_state yield_state) {
+/// @param preempted The switch was forced on the thread, for accounting.
+static void yield(enum thread_state yield_state, bool preempted) {
     interrupt_state_t previous_state = interrupt_state_mask();
 
     ASSERT(yield_state != THREAD_STATE_ACTIVE);
@@ -51,6 +53,11 @@ void sched_yield(enum thread_state yield_state) {
     if(next != nullptr) {
         ASSERT(current != next);
         current->state = yield_state;
+        if(preempted) {
+            current->accounting.involuntary_switches++;
+        } else {
+            current->accounting.voluntary_switches++;
+        }
         arch_sched_context_switch(current, next);
     } else {
         ASSERT(current->state == yield_state);
@@ -61,6 +68,22 @@ void sched_yield(enum thread_state yield_state) {
     interrupt_state_restore(previous_state);
 }
 
+void sched_yield(enum thread_state yield_state) {
+    yield(yield_state, false);
+}
+
+static void sleep_wake(void *data) {
+    sched_thread_schedule(data);
+}
+
+void sched_sleep(time_t delay) {
+    // The timer event fires on this CPU, with interrupts masked it cannot fire before the thread is switched out
+    interrupt_state_t previous_state = interrupt_state_mask();
+    event_queue(delay, sleep_wake, arch_sched_thread_current());
+    sched_yield(THREAD_STATE_BLOCK);
+    interrupt_state_restore(previous_state);
+}
+
 void sched_preempt_inc() {
     ASSERT(ARCH_CPU_CURRENT_READ(sched.status.preempt_counter) < UINT32_MAX);
     ARCH_CPU_CURRENT_INC(sched.status.preempt_counter);
@@ -73,7 +96,7 @@ void sched_preempt_dec() {
     ASSERT(count > 0);
     bool do_yield = count == 1 && ARCH_CPU_CURRENT_EXCHANGE(sched.status.yield_immediately, false);
     ARCH_CPU_CURRENT_DEC(sched.status.preempt_counter);
-    if(do_yield) sched_yield(THREAD_STATE_READY); // FLIMSY: not sure if we need to account for the RC
+    if(do_yield) yield(THREAD_STATE_READY, true); // FLIMSY: not sure if we need to account for the RC
 }
 
 void internal_sched_thread_drop(thread_t *thread) {
@@ -87,6 +110,7 @@ void internal_sched_thread_drop(thread_t *thread) {
             if(thread->proc != nullptr) {
                 spinlock_acquire_nodw(&thread->proc->lock);
                 list_node_delete(&thread->proc->threads, &thread->list_node_proc);
+                accounting_add(&thread->proc->accounting, &thread->accounting);
                 if(thread->proc->threads.count == 0) {
                     reaper_queue_process(thread->proc);
                     dw_status_enable();
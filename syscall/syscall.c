@@ -2,31 +2,37 @@
 
 #include "abi/syscall/syscall.h"
 #include "arch/sched.h"
+#include "arch/time.h"
+#include "arch/usercopy.h"
 #include "common/assert.h"
 #include "common/log.h"
 #include "lib/string.h"
 #include "memory/heap.h"
 #include "memory/vm.h"
+#include "sched/process.h"
 
 #include <stddef.h>
 #include <stdint.h>
 
 #define MAX_DEBUG_LENGTH 512
 
+/// Check that a buffer lies entirely within the current process' address space.
+static bool user_buffer_valid(void *buffer, size_t count) {
+    vm_address_space_t *address_space = arch_sched_thread_current()->proc->address_space;
+    uintptr_t address = (uintptr_t) buffer;
+    return address >= address_space->start && address <= address_space->end && count <= address_space->end - address;
+}
+
 int syscall_buffer_out(void *dest, void *src, size_t count) {
     ASSERT(arch_sched_thread_current()->proc != nullptr);
-    return vm_copy_to(arch_sched_thread_current()->proc->address_space, (uintptr_t) dest, src, count);
+    if(!user_buffer_valid(dest, count)) return 0;
+    return count - arch_usercopy_to(dest, src, count);
 }
 
-void *syscall_buffer_in(void *src, size_t count) {
+int syscall_buffer_in(void *dest, void *src, size_t count) {
     ASSERT(arch_sched_thread_current()->proc != nullptr);
-    void *buffer = heap_alloc(count);
-    size_t read_count = vm_copy_from(buffer, arch_sched_thread_current()->proc->address_space, (uintptr_t) src, count);
-    if(read_count != count) {
-        heap_free(buffer, count);
-        return nullptr;
-    }
-    return buffer;
+    if(!user_buffer_valid(src, count)) return 0;
+    return count - arch_usercopy_from(dest, src, count);
 }
 
 int syscall_string_out(char *dest, char *src, size_t max) {
@@ -39,8 +45,11 @@ int syscall_string_out(char *dest, char *src, size_t max) {
 }
 
 char *syscall_string_in(char *src, size_t length) {
-    char *str = syscall_buffer_in(src, length + 1);
-    if(str == nullptr) return nullptr;
+    char *str = heap_alloc(length + 1);
+    if(syscall_buffer_in(str, src, length) != (int) length) {
+        heap_free(str, length + 1);
+        return nullptr;
+    }
     str[length] = 0;
     return str;
 }
@@ -81,3 +90,37 @@ syscall_return_t syscall_system_info(syscall_system_info_t *buffer) {
 
     return ret;
 }
+
+syscall_return_t syscall_resource_usage(syscall_int_t who, syscall_resource_usage_t *buffer) {
+    syscall_return_t ret = {};
+
+    thread_t *thread = arch_sched_thread_current();
+    accounting_t accounting;
+    size_t resident_pages = 0;
+    size_t working_set_pages = 0;
+    switch(who) {
+        case SYSCALL_RESOURCE_USAGE_THREAD: accounting = thread->accounting; break;
+        case SYSCALL_RESOURCE_USAGE_PROCESS:
+            accounting = process_accounting(thread->proc);
+            resident_pages = __atomic_load_n(&thread->proc->address_space->resident_pages, __ATOMIC_RELAXED);
+            working_set_pages = __atomic_load_n(&thread->proc->address_space->working_set_pages, __ATOMIC_RELAXED);
+            break;
+        default: ret.error = SYSCALL_ERROR_INVALID_VALUE; return ret;
+    }
+
+    // The running thread has not been switched out yet
+    accounting.cpu_time += arch_time_monotonic() - thread->switched_in;
+
+    syscall_resource_usage_t out = {
+        .cpu_time = accounting.cpu_time,
+        .voluntary_switches = accounting.voluntary_switches,
+        .involuntary_switches = accounting.involuntary_switches,
+        .minor_faults = accounting.minor_faults,
+        .pages_allocated = accounting.pages_allocated,
+        .resident_pages = resident_pages,
+        .working_set_pages = working_set_pages,
+    };
+    if(syscall_buffer_out(buffer, &out, sizeof(out)) != sizeof(out)) ret.error = SYSCALL_ERROR_INVALID_VALUE;
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "resource_usage(who: %lu, buffer: %#lx)", who, (uintptr_t) buffer);
+    return ret;
+}
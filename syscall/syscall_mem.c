@@ -2,22 +2,37 @@
 #include "arch/page.h"
 #include "arch/sched.h"
 #include "common/log.h"
+#include "graphics/framebuffer.h"
+#include "lib/math.h"
+#include "memory/ksm.h"
+#include "memory/shm.h"
 #include "memory/vm.h"
+#include "memory/wss.h"
+#include "syscall/syscall.h"
 
 #include <stddef.h>
 #include <stdint.h>
 
-syscall_return_t syscall_mem_anon_allocate(size_t size) {
+#define ANON_FLAGS (SYSCALL_ANON_FLAG_LAZY | SYSCALL_ANON_FLAG_POPULATE | SYSCALL_ANON_FLAG_HUGE)
+
+syscall_return_t syscall_mem_anon_allocate(size_t size, syscall_int_t flags) {
     syscall_return_t ret = {};
 
-    if(size == 0 || size % ARCH_PAGE_GRANULARITY != 0) {
+    if(size == 0 || size % ARCH_PAGE_GRANULARITY != 0 || (flags & ~ANON_FLAGS) != 0) {
         ret.error = SYSCALL_ERROR_INVALID_VALUE;
         return ret;
     }
 
-    void *ptr = vm_map_anon(arch_sched_thread_current()->proc->address_space, nullptr, size, (vm_protection_t) { .read = true, .write = true }, VM_CACHE_STANDARD, VM_FLAG_ZERO);
+    vm_flags_t vm_flags = VM_FLAG_ZERO;
+    if((flags & SYSCALL_ANON_FLAG_LAZY) != 0) vm_flags |= VM_FLAG_DYNAMICALLY_BACKED;
+    if((flags & SYSCALL_ANON_FLAG_HUGE) != 0) vm_flags |= VM_FLAG_HUGE_HINT;
+
+    vm_address_space_t *as = arch_sched_thread_current()->proc->address_space;
+    void *ptr = vm_map_anon(as, nullptr, size, (vm_protection_t) { .read = true, .write = true }, VM_CACHE_STANDARD, vm_flags);
+    if(ptr != nullptr && (flags & SYSCALL_ANON_FLAG_LAZY) != 0 && (flags & SYSCALL_ANON_FLAG_POPULATE) != 0) vm_advise(as, ptr, size, VM_ADVICE_WILLNEED);
+
     ret.value = (uintptr_t) ptr;
-    log(LOG_LEVEL_DEBUG, "SYSCALL", "anon_allocate(size: %#lx) -> %#lx", size, ret.value);
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "anon_allocate(size: %#lx, flags: %#lx) -> %#lx", size, flags, ret.value);
     return ret;
 }
 
@@ -33,3 +48,145 @@ syscall_return_t syscall_mem_anon_free(void *pointer, size_t size) {
     log(LOG_LEVEL_DEBUG, "SYSCALL", "anon_free(ptr: %#lx, size: %#lx)", (uintptr_t) pointer, size);
     return ret;
 }
+
+syscall_return_t syscall_mem_anon_advise(void *pointer, size_t size, syscall_int_t advice) {
+    syscall_return_t ret = {};
+
+    vm_address_space_t *as = arch_sched_thread_current()->proc->address_space;
+    if(size == 0 || (uintptr_t) pointer + size < (uintptr_t) pointer || (uintptr_t) pointer < as->start || (uintptr_t) pointer + size > as->end) {
+        ret.error = SYSCALL_ERROR_INVALID_VALUE;
+        return ret;
+    }
+
+    vm_advice_t vm_advice;
+    switch(advice) {
+        case SYSCALL_ADVICE_NORMAL:      vm_advice = VM_ADVICE_NORMAL; break;
+        case SYSCALL_ADVICE_WILLNEED:    vm_advice = VM_ADVICE_WILLNEED; break;
+        // There is no reclaim to lazily hand FREE pages to, so they are released right away
+        case SYSCALL_ADVICE_FREE:
+        case SYSCALL_ADVICE_DONTNEED:    vm_advice = VM_ADVICE_DONTNEED; break;
+        case SYSCALL_ADVICE_HUGEPAGE:    vm_advice = VM_ADVICE_HUGEPAGE; break;
+        case SYSCALL_ADVICE_NOHUGEPAGE:  vm_advice = VM_ADVICE_NOHUGEPAGE; break;
+        case SYSCALL_ADVICE_MERGEABLE:   vm_advice = VM_ADVICE_MERGEABLE; break;
+        case SYSCALL_ADVICE_UNMERGEABLE: vm_advice = VM_ADVICE_UNMERGEABLE; break;
+        default:                         ret.error = SYSCALL_ERROR_INVALID_VALUE; return ret;
+    }
+
+    if(!vm_advise(as, pointer, size, vm_advice)) ret.error = SYSCALL_ERROR_INVALID_VALUE;
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "anon_advise(ptr: %#lx, size: %#lx, advice: %lu)", (uintptr_t) pointer, size, advice);
+    return ret;
+}
+
+syscall_return_t syscall_mem_shm_create(size_t size) {
+    syscall_return_t ret = {};
+
+    shm_t *shm = shm_create(size, arch_sched_thread_current()->proc->id);
+    if(shm == nullptr) {
+        ret.error = SYSCALL_ERROR_INVALID_VALUE;
+        return ret;
+    }
+
+    ret.value = shm->id;
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "shm_create(size: %#lx) -> %li", size, shm->id);
+    shm_put(shm);
+    return ret;
+}
+
+syscall_return_t syscall_mem_shm_resize(long id, size_t size) {
+    syscall_return_t ret = {};
+
+    shm_t *shm = shm_lookup(id);
+    if(shm == nullptr || shm->owner != arch_sched_thread_current()->proc->id || !shm_resize(shm, size)) ret.error = SYSCALL_ERROR_INVALID_VALUE;
+    if(shm != nullptr) shm_put(shm);
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "shm_resize(id: %li, size: %#lx)", id, size);
+    return ret;
+}
+
+syscall_return_t syscall_mem_shm_destroy(long id) {
+    syscall_return_t ret = {};
+
+    if(!shm_destroy(id, arch_sched_thread_current()->proc->id)) ret.error = SYSCALL_ERROR_INVALID_VALUE;
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "shm_destroy(id: %li)", id);
+    return ret;
+}
+
+syscall_return_t syscall_mem_shm_map(long id, size_t offset, size_t length, syscall_int_t flags) {
+    syscall_return_t ret = {};
+
+    if((flags & ~SYSCALL_SHM_MAP_FLAG_READ_ONLY) != 0) {
+        ret.error = SYSCALL_ERROR_INVALID_VALUE;
+        return ret;
+    }
+
+    shm_t *shm = shm_lookup(id);
+    if(shm == nullptr) {
+        ret.error = SYSCALL_ERROR_INVALID_VALUE;
+        return ret;
+    }
+
+    vm_protection_t prot = { .read = true, .write = (flags & SYSCALL_SHM_MAP_FLAG_READ_ONLY) == 0 };
+    void *ptr = shm_map(shm, arch_sched_thread_current()->proc->address_space, offset, length, prot);
+    shm_put(shm);
+    if(ptr == nullptr) ret.error = SYSCALL_ERROR_INVALID_VALUE;
+
+    ret.value = (uintptr_t) ptr;
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "shm_map(id: %li, offset: %#lx, length: %#lx, flags: %#lx) -> %#lx", id, offset, length, flags, ret.value);
+    return ret;
+}
+
+syscall_return_t syscall_mem_ksm_configure(syscall_int_t run, size_t pages_to_scan, size_t interval_ms) {
+    syscall_return_t ret = {};
+
+    ksm_tunables_t tunables = { .run = run != 0, .pages_to_scan = pages_to_scan, .interval = interval_ms * (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND) };
+    // A larger interval would wrap around to a short one
+    if(interval_ms > UINT64_MAX / (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND) || !ksm_tunables_set(tunables)) ret.error = SYSCALL_ERROR_INVALID_VALUE;
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "ksm_configure(run: %lu, pages_to_scan: %lu, interval_ms: %lu)", run, pages_to_scan, interval_ms);
+    return ret;
+}
+
+syscall_return_t syscall_mem_ksm_stats(syscall_ksm_stats_t *buffer) {
+    syscall_return_t ret = {};
+
+    ksm_stats_t stats = ksm_stats();
+    syscall_ksm_stats_t out = { .pages_shared = stats.pages_shared, .pages_sharing = stats.pages_sharing, .pages_scanned = stats.pages_scanned, .full_scans = stats.full_scans };
+    if(syscall_buffer_out(buffer, &out, sizeof(out)) != sizeof(out)) ret.error = SYSCALL_ERROR_INVALID_VALUE;
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "ksm_stats(buffer: %#lx)", (uintptr_t) buffer);
+    return ret;
+}
+
+syscall_return_t syscall_mem_wss_configure(syscall_int_t run, size_t interval_ms) {
+    syscall_return_t ret = {};
+
+    wss_tunables_t tunables = { .run = run != 0, .interval = interval_ms * (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND) };
+    // A larger interval would wrap around to a short one
+    if(interval_ms > UINT64_MAX / (TIME_NANOSECONDS_IN_SECOND / TIME_MILLISECONDS_IN_SECOND) || !wss_tunables_set(tunables)) ret.error = SYSCALL_ERROR_INVALID_VALUE;
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "wss_configure(run: %lu, interval_ms: %lu)", run, interval_ms);
+    return ret;
+}
+
+syscall_return_t syscall_mem_framebuffer_map(syscall_framebuffer_info_t *buffer) {
+    syscall_return_t ret = {};
+
+    // Write combining lets stores to the framebuffer be merged into bursts instead of going out one by one
+    uintptr_t physical_base = MATH_FLOOR(g_framebuffer.physical_address, ARCH_PAGE_GRANULARITY);
+    size_t offset = g_framebuffer.physical_address - physical_base;
+    size_t length = MATH_CEIL(offset + g_framebuffer.size, ARCH_PAGE_GRANULARITY);
+
+    vm_address_space_t *as = arch_sched_thread_current()->proc->address_space;
+    void *ptr = vm_map_direct(as, nullptr, length, VM_PROT_RW, VM_CACHE_WRITE_COMBINE, physical_base, VM_FLAG_NONE);
+    if(ptr == nullptr) {
+        ret.error = SYSCALL_ERROR_INVALID_VALUE;
+        return ret;
+    }
+
+    syscall_framebuffer_info_t out = { .address = (uintptr_t) ptr + offset, .size = g_framebuffer.size, .width = g_framebuffer.width, .height = g_framebuffer.height, .pitch = g_framebuffer.pitch };
+    if(syscall_buffer_out(buffer, &out, sizeof(out)) != sizeof(out)) {
+        vm_unmap(as, ptr, length);
+        ret.error = SYSCALL_ERROR_INVALID_VALUE;
+        return ret;
+    }
+
+    ret.value = out.address;
+    log(LOG_LEVEL_DEBUG, "SYSCALL", "framebuffer_map(buffer: %#lx) -> %#lx", (uintptr_t) buffer, ret.value);
+    return ret;
+}